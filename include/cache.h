@@ -0,0 +1,163 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+
+#define CACHE_BLOCKS 1024       // 缓存的块数, 超过后按替换策略淘汰干净块
+
+// 缓冲区缓存, 按(owner, index)即(inode_id, 文件中的块序号)索引文件数据。
+// 被写过的块在刷回之前是脏的, block_id为0表示还没有分配磁盘块(延迟分配)。
+// 缓存只保护自己的索引结构, 块的内容由owner的inode锁保护:
+// 持有读锁可以读取内容, 持有写锁才能修改内容, 创建或删除块。
+//
+// owner为CACHE_META_OWNER的块是元数据块(inode表块和目录块), index为磁盘块号, 内容由该块所属的
+// inode块锁或目录锁保护。元数据块属于单独的优先级类别, 淘汰时先淘汰文件数据,
+// 元数据块只在超过CACHE_META_SHARE块或者没有可淘汰的数据块时才淘汰。
+#define CACHE_META_OWNER -1
+#define CACHE_META_SHARE (CACHE_BLOCKS/4)
+
+// 文件数据的替换策略, 可以在运行时切换
+#define CACHE_LRU 0             // 淘汰最久没有使用的块
+#define CACHE_2Q 1              // 第一次读入的块放在FIFO队列中, 再次被访问过的块才进入LRU队列,
+                                // 一次顺序扫描只会冲掉FIFO队列, 不会冲掉常用的块
+#define CACHE_2Q_IN (CACHE_BLOCKS/4)    // 2Q中FIFO队列的块数, 超过后先从FIFO队列淘汰
+#define CACHE_2Q_GHOST (CACHE_BLOCKS/2) // 记住最近从FIFO队列淘汰的块数, 这些块再次读入时直接进入LRU队列
+
+// 命中率统计的类别
+#define CACHE_CLASS_DATA 0
+#define CACHE_CLASS_META 1
+
+typedef struct cache_stat {
+    uint64_t hits[2];           // 按类别统计的cache_lookup()命中次数
+    uint64_t misses[2];         // 按类别统计的cache_lookup()未命中次数
+} cache_stat;
+
+typedef struct cache_buf {
+    int owner;
+    uint64_t index;
+    uint64_t block_id;          // 对应的磁盘块号, 0表示还没有分配
+    int dirty;
+    int loading;                // 正在从磁盘读入, 查找该块的线程等待读入完成
+    int queue;                  // 干净时所在的链表, 见cache.c
+    uint64_t dirtied_at;        // 变脏的时间(CLOCK_MONOTONIC毫秒), 一直是脏的时不更新
+    int refs;                   // 被引用的块不会被淘汰
+    struct cache_buf *hash_next;
+    struct cache_buf *prev;     // 所在的LRU, FIFO, 元数据或脏块链表
+    struct cache_buf *next;
+    char data[];                // 一个文件系统块, 大小由cache_new()设置
+} cache_buf;
+
+// 一个缓存实例, 每个挂载的文件系统有自己的缓存, 下面的函数都作用于传入的缓存
+typedef struct block_cache block_cache;
+
+/**
+ * @brief 新建一个空的缓存, 缓存块的大小为文件系统的块大小block_size
+ * @note 挂载或格式化时按超级块中的块大小新建
+ */
+block_cache* cache_new(uint32_t block_size);
+
+/**
+ * @brief 释放缓存和其中所有的块, 脏块直接丢弃
+ * @note 调用者需要先写回脏块, 并且没有其他引用
+ */
+void cache_free(block_cache *cache);
+
+/**
+ * @brief 查找owner的第index块, 找到后增加引用; 该块正在读入时等待读入完成
+ * @return 找到返回缓存块, 否则返回NULL
+ */
+cache_buf* cache_lookup(block_cache *cache, int owner, uint64_t index);
+
+/**
+ * @brief 为owner的第index块新建一个干净的缓存块并增加引用, 内容由调用者填充
+ * @return 返回缓存块
+ * @note 调用者需要持有owner的写锁, 并且该块不在缓存中
+ */
+cache_buf* cache_create(block_cache *cache, int owner, uint64_t index, uint64_t block_id);
+
+/**
+ * @brief 把从磁盘读到的owner第index块(磁盘块block_id)的内容data放入缓存, 已经在缓存中时什么也不做
+ * @note 持有owner的读锁即可调用
+ */
+void cache_insert(block_cache *cache, int owner, uint64_t index, uint64_t block_id, char *data);
+
+/**
+ * @brief 取得owner第index块(磁盘块block_id)的缓存块并增加引用, 返回的块可以直接读写, 不会被淘汰
+ * @return 返回缓存块; 不在缓存中时新建一个并把created置1, 调用者读入内容后调用cache_loaded(),
+ *         在此之前查找该块的线程都等待
+ * @note 调用者需要持有保护该块的锁
+ */
+cache_buf* cache_get(block_cache *cache, int owner, uint64_t index, uint64_t block_id, int *created);
+
+/**
+ * @brief cache_get()新建的块读入完成, ok为0表示读取失败, 这时该块连同调用者的引用一起丢弃
+ */
+void cache_loaded(block_cache *cache, cache_buf *buf, int ok);
+
+/**
+ * @brief 把写入磁盘的owner第index块的新内容data同步到缓存中, 不在缓存中时什么也不做
+ * @note 用于直接写磁盘的元数据块; 调用者需要持有保护该块的锁
+ */
+void cache_update(block_cache *cache, int owner, uint64_t index, char *data);
+
+/**
+ * @brief 释放对缓存块的引用
+ */
+void cache_release(block_cache *cache, cache_buf *buf);
+
+/**
+ * @brief 标记缓存块为脏
+ */
+void cache_mark_dirty(block_cache *cache, cache_buf *buf);
+
+/**
+ * @brief 缓存块已经写入磁盘块block_id, 标记为干净
+ */
+void cache_mark_clean(block_cache *cache, cache_buf *buf, uint64_t block_id);
+
+/**
+ * @brief 获取owner的所有脏块(最多max个), 按index从小到大存放到bufs中, 每个都增加引用
+ * @return 脏块数
+ */
+int cache_dirty_bufs(block_cache *cache, int owner, cache_buf **bufs, int max);
+
+/**
+ * @brief 获取有脏块的owner(最多max个), 存放到owners中
+ * @return owner数
+ */
+int cache_dirty_owners(block_cache *cache, int *owners, int max);
+
+/**
+ * @brief 获取有变脏超过age_ms毫秒的脏块的owner(最多max个), 按最早变脏的时间从早到晚存放到owners中
+ * @return owner数; age_ms为0时返回所有有脏块的owner
+ */
+int cache_expired_owners(block_cache *cache, uint32_t age_ms, int *owners, int max);
+
+/**
+ * @brief 当前的脏块数
+ */
+int cache_dirty_count(block_cache *cache);
+
+/**
+ * @brief 丢弃owner的所有缓存块(包括脏块)
+ * @return 丢弃的还没有分配磁盘块的脏块数
+ * @note 调用者需要持有owner的写锁, 并且没有其他引用
+ */
+int cache_drop(block_cache *cache, int owner);
+
+/**
+ * @brief 切换文件数据的替换策略, policy为CACHE_LRU或CACHE_2Q
+ */
+void cache_set_policy(block_cache *cache, int policy);
+
+/**
+ * @brief 当前的替换策略
+ */
+int cache_get_policy(block_cache *cache);
+
+/**
+ * @brief 读取命中率统计到st中
+ */
+void cache_get_stat(block_cache *cache, cache_stat *st);
+
+#endif
@@ -1,35 +1,74 @@
 #ifndef DISK_H
 #define DISK_H
 
+#include <stdint.h>
+
 // The size of one single disk block in bytes
 #define DEVICE_BLOCK_SIZE 512
 
 
-// Total disk size in bytes, 4 * 1024 * 1024 bytes (4 MiB) in total
-int get_disk_size();
+// Default size of a newly created disk, 4 * 1024 * 1024 bytes (4 MiB)
+#define DEFAULT_DISK_SIZE (4*1024*1024)
+
+// An opened disk image. Every function below takes the disk it operates on,
+// so one process can open several images at the same time.
+typedef struct disk disk;
+
+// I/O classes for disk_set_io_class()
+#define DISK_IO_FOREGROUND 0    // interactive reads and synchronous writes, the default
+#define DISK_IO_BACKGROUND 1    // write-back, zeroing and other bulk work
 
 /**
- * @brief Open the virtual disk.
+ * @brief Set the I/O class of the calling thread.
  * 
- * @return returns 0 on success, -1 otherwise. 
+ * @note Only a few requests run on a disk at the same time, the rest are queued.
+ * Queued foreground reads are served first, then foreground writes, then background requests,
+ * unless a request has waited past the deadline of its class. Adjacent queued requests in the
+ * same direction are merged into one.
+ */
+void disk_set_io_class(int io_class);
+
+// Total disk size in bytes, i.e. the size of the image file when it was opened or last grown
+uint64_t get_disk_size(disk *d);
+
+/**
+ * @brief Open the file at path as a virtual disk.
  * 
- * @note This function will open a file named "disk" as a vritual disk
- * If the file is not found, it will try to create the file, and fill it with zeros of 4 MiB.
+ * @return returns the disk on success, NULL otherwise. 
+ * 
+ * @note If the file is not found, it will try to create the file, and fill it with zeros of 4 MiB.
  * This function must be called before any calls to disk_read_block() and disk_write_block().
- * This function will fail if the disk is already opened.
  */
-int open_disk();
+disk* open_disk(const char *path);
+
+/**
+ * @brief Open the file at path as a virtual disk.
+ * 
+ * @return returns the disk on success, NULL otherwise. 
+ * 
+ * @note Unlike open_disk(), the file is not created if it does not exist.
+ */
+disk* open_disk_path(const char *path);
+
+/**
+ * @brief Grow the virtual disk file to size bytes.
+ * 
+ * @return returns 0 on success, -1 otherwise.
+ * 
+ * @note The new space reads as zeros. The disk is never shrunk, a size no larger than the
+ * current size succeeds without changing anything. Reads and writes may run concurrently.
+ */
+int grow_disk(disk *d, uint64_t size);
 
 /**
  * @brief Close the virtual disk.
  * 
  * @return returns 0 on success, -1 otherwise. 
  * 
- * @note This function will close the virtual disk file.
- * After calling this function, all calls to disk_read_block() and disk_write_block() will fail
- * util open_disk() is called again.
+ * @note This function will close the virtual disk file and free d.
+ * d must not be used after calling this function.
  */
-int close_disk();
+int close_disk(disk *d);
 
 /**
  * @brief Fill buf with the content of the block_num-th block.
@@ -39,9 +78,8 @@ int close_disk();
  * @return returns 0 on success, -1 otherwise.
  * 
  * @note The space of buf should be no less than DEVICE_BLOCK_SIZE.
- * Make sure open_disk() is called before calling this function.
  */
-int disk_read_block(unsigned int block_num, char* buf);
+int disk_read_block(disk *d, uint64_t block_num, char* buf);
 
 /**
  * @brief Write content of buf to the block_num-th block.
@@ -49,9 +87,24 @@ int disk_read_block(unsigned int block_num, char* buf);
  * @param block_num The index of the block to be written.
  * @param buf       The pointer to the space where the data to be written to disk is placed.
  * @return returns 0 on success, -1 otherwise.
+ */
+int disk_write_block(disk *d, uint64_t block_num, char* buf);
+
+/**
+ * @brief Fill buf with the content of count consecutive blocks starting at block_num.
  * 
- * @note Make sure open_disk() is called before calling this function.
+ * @return returns 0 on success, -1 otherwise.
+ * 
+ * @note The space of buf should be no less than count * DEVICE_BLOCK_SIZE.
+ * The blocks are read with a single request, which is used for file system blocks larger than one device block.
+ */
+int disk_read_blocks(disk *d, uint64_t block_num, uint32_t count, char* buf);
+
+/**
+ * @brief Write count consecutive blocks starting at block_num from buf.
+ * 
+ * @return returns 0 on success, -1 otherwise.
  */
-int disk_write_block(unsigned int block_num, char* buf);
+int disk_write_blocks(disk *d, uint64_t block_num, uint32_t count, char* buf);
 
 #endif 
\ No newline at end of file
@@ -0,0 +1,24 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+// 基于epoch的内存回收(EBR)
+// 读者在epoch_enter()和epoch_exit()之间可以不加锁地访问共享指针,
+// 写者用原子操作发布新版本后, 把旧版本交给epoch_retire(),
+// 等到所有可能看到旧版本的读者都退出后才会真正释放。
+
+/**
+ * @brief 进入读临界区, 可以嵌套
+ */
+void epoch_enter();
+
+/**
+ * @brief 退出读临界区
+ */
+void epoch_exit();
+
+/**
+ * @brief 延迟释放ptr(由malloc分配), 调用前ptr必须已经从共享结构中摘除
+ */
+void epoch_retire(void *ptr);
+
+#endif
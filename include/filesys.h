@@ -1,19 +1,28 @@
+#ifndef FILESYS_H
+#define FILESYS_H
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 
-#define SYS_MAGIC_NUM  180110318
-#define BLOCK_SIZE 1024
+#include "disk.h"
+
+#define SYS_MAGIC_NUM  180110322 //inode表延迟初始化的格式
 #define SUPER_BLOCK_INDEX 0 //super block放在第0块
-#define INODE_BLOCK_INDEX 1 //inode 的起始块号为1
-#define INODE_BLOCK_NUMS 32 //inode总共有32个块
-#define INODE_NUMS_EACH_BLOCK 32 //每个数据块里面有32个inode
-#define DIR_ITEMS_EACH_BLOCK  8
+#define SUPER_BLOCK_SIZE 1024 //挂载时先读取的超级块区域大小, 不依赖块大小
+#define MIN_BLOCK_SIZE 1024
+#define MAX_BLOCK_SIZE (64*1024)
+#define DEFAULT_BLOCK_SIZE 1024
+#define DEFAULT_INODE_RATIO 4096 //默认每4096字节的空间分配一个inode
+#define MAX_DIR_ITEMS (6*MAX_BLOCK_SIZE/128) //一个目录最多的目录项数
 #define TYPE_FOLDER 0
 #define TYPE_FILE   1
 
+#define GROUP_BLOCK_UNINIT 1 //块位图还没有写入磁盘, 只有元数据块被占用
+#define GROUP_INODE_UNINIT 2 //inode位图还没有写入磁盘, 所有inode都空闲
+
 #define DIR_VALID 1
 #define DIR_INVALID 0
 
@@ -21,22 +30,135 @@ typedef unsigned   uint32_t;
 
 typedef struct super_block {
     int32_t magic_num;                  // 幻数
-    int32_t free_block_count;           // 空闲数据块数
-    int32_t free_inode_count;           // 空闲inode数
     int32_t dir_inode_count;            // 目录inode数
-    uint32_t block_map[128];            // 数据块占用位图
-    uint32_t inode_map[32];             // inode占用位图
+    int64_t free_block_count;           // 空闲数据块数
+    int64_t free_inode_count;           // 空闲inode数
+    uint64_t block_count;               // 总块数
+    uint32_t inode_count;               // inode总数
+    uint32_t blocks_per_group;          // 每个块组的块数
+    uint32_t inodes_per_group;          // 每个块组的inode数
+    uint32_t group_count;               // 块组数
+    uint32_t block_size;                // 块大小, 1KiB到64KiB之间的2的幂
+    uint32_t inode_size;                // inode大小
+    uint32_t desc_size;                 // 块组描述符大小
+    uint32_t journal_blocks;            // 日志区的块数, 0表示没有日志区
+    uint64_t journal_start;             // 日志区的起始块号
+    uint32_t inode_ratio;               // 格式化时每多少字节的空间分配一个inode
+    uint32_t chunk_count;               // 动态分配的inode chunk数
+    uint64_t chunk_map;                 // inode chunk映射表的第一个块, 0表示还没有
+    uint32_t refcount_count;            // 引用计数表的项数, 即被多个文件共享的数据块数
+    uint32_t reserved;
+    uint64_t refcount_map;              // 引用计数表的第一个块, 0表示没有
+    uint64_t snapshot_table;            // 快照表所在的块, 0表示还没有
+    uint32_t snapshot_count;            // 快照数
+    uint32_t tail_count;                // 尾块表的项数, 即尾块数
+    uint64_t tail_map;                  // 尾块表的第一个块, 0表示没有
 } sp_block;
 
 
+// 由超级块推出的几何参数, 挂载或格式化时计算一次。
+// 每个块组的块数等于块位图的位数, 每个块组的inode数由inode_ratio决定, 不超过inode位图的位数
+typedef struct fs_geometry {
+    uint32_t block_size;
+    uint32_t blocks_per_group;
+    uint32_t inodes_per_group;
+    uint32_t inodes_each_block;         // 每个inode块的inode数
+    uint32_t inode_blocks_per_group;    // 每个块组的inode表的块数
+    uint32_t descs_each_block;          // 每个块的块组描述符数
+    uint32_t dir_items_each_block;      // 每个目录块的目录项数
+    uint32_t inodes_each_chunk;         // 每个动态inode chunk的inode数
+    uint32_t chunks_each_map_block;     // 每个映射表块的chunk项数
+    uint32_t refcounts_each_block;      // 每个引用计数表块的项数
+    uint32_t snapshots_each_block;      // 快照表中最多的快照数
+    uint32_t cows_each_block;           // 每个例外表块的项数
+    uint32_t tails_each_block;          // 每个尾块表块的项数
+} fs_geometry;
+
+
+// 块组中的inode用完后, inode按chunk动态分配: 一个chunk占用一个数据块, 存放最多64个inode,
+// 编号从DYNAMIC_INODE_BASE开始, 每个chunk占用CHUNK_STRIDE个编号。
+// chunk映射表记录每个chunk所在的块和inode的使用情况, 存放在一串映射表块中,
+// 每个映射表块以chunk_map_head开头, 后面是chunk_entry数组
+#define DYNAMIC_INODE_BASE (1 << 30)
+#define CHUNK_STRIDE 64
+
+typedef struct chunk_entry {
+    uint64_t block;                     // chunk所在的块号
+    uint64_t used_mask;                 // 第k位为1表示chunk中的第k个inode已被使用
+} chunk_entry;
+
+typedef struct chunk_map_head {
+    uint64_t next;                      // 下一个映射表块, 0表示没有
+    uint64_t reserved;
+} chunk_map_head;
+
+
+// 数据块可以被多个文件共享(reflink复制), 第一次写入共享的块时才复制出一个新块。
+// 引用计数表只记录被两个以上文件引用的块, 不在表中的已分配块只被一个文件引用;
+// 和chunk映射表一样存放在一串以chunk_map_head开头的块中, 后面是refcount_entry数组
+typedef struct refcount_entry {
+    uint64_t block;                     // 被共享的数据块号
+    uint32_t refs;                      // 引用这个块的文件数, 至少为2
+    uint32_t reserved;
+} refcount_entry;
+
+
+// 块组描述符, 每个块组依次存放块位图, inode位图, inode表和数据块。
+// 描述符表按每块的描述符数分段, 每段放在段内第一个组的开头,
+// 这样块组数不受一个块组大小的限制, 增加块组时也不用移动已有的描述符;
+// 第0组的开头还有超级块
+typedef struct group_desc {
+    uint64_t block_bitmap;              // 块位图所在的块号
+    uint64_t inode_bitmap;              // inode位图所在的块号
+    uint64_t inode_table;               // inode表的起始块号
+    uint64_t first_data_block;          // 第一个数据块的块号
+    uint32_t block_count;               // 组内的块数, 最后一个组可能不满
+    uint32_t free_block_count;          // 组内空闲块数
+    uint32_t free_inode_count;          // 组内空闲inode数
+    uint32_t dir_count;                 // 组内目录数
+    uint32_t flags;                     // GROUP_BLOCK_UNINIT/GROUP_INODE_UNINIT
+    uint32_t itable_zeroed;             // inode表中已经清零的块数, 之后的块还没有初始化
+    uint32_t reserved[2];
+} group_desc;
+
+
 typedef struct inode {
-    uint32_t size;              // 文件大小
+    uint64_t size;              // 文件大小
     uint16_t file_type;         // 文件类型（文件/文件夹）
     uint16_t link;              // 连接数
-    uint32_t block_point[6];    // 数据块指针
+    uint32_t flags;             // INODE_COMPRESS/INODE_COMPRESSED/INODE_TAIL, 打包存放时8~15位为槽号
+    uint64_t block_point[6];    // 数据块指针
 } inode;
 
 
+// 启用压缩的文件在写回时把整个文件作为一个簇压缩, 至少能省下一个块时才按压缩格式存放:
+// 压缩后的数据从block_point[0]开始依次存放, 以cluster_head开头, 之后的指针为0;
+// 压缩不了的文件照常按块存放。写压缩存放的文件时先把它解压到缓存中, 再按普通文件写入
+#define INODE_COMPRESS   1      // 文件启用了压缩
+#define INODE_COMPRESSED 2      // 文件的数据当前按压缩格式存放
+
+typedef struct cluster_head {
+    uint32_t raw_len;           // 解压后的字节数, 即文件大小
+    uint32_t packed_len;        // cluster_head之后压缩数据的字节数
+} cluster_head;
+
+
+// 不超过半个块的小文件写回时打包到共享的尾块中: 尾块按槽的大小分为块大小的1/16, 1/8, 1/4, 1/2四类,
+// 同一个尾块中的槽一样大。打包的文件block_point[0]为尾块的块号, flags中记录槽号, 数据的长度就是文件大小。
+// 尾块表记录所有尾块的类别和槽的使用情况, 和引用计数表一样存放在一串以chunk_map_head开头的块中
+#define INODE_TAIL 4                    // 文件的数据打包存放在尾块中
+#define TAIL_SLOT_SHIFT 8
+#define TAIL_SLOT_MASK (0xff << TAIL_SLOT_SHIFT)
+#define TAIL_CLASSES 4                  // 第c类尾块有(16>>c)个槽
+
+typedef struct tail_entry {
+    uint64_t block;                     // 尾块的块号
+    uint32_t used_mask;                 // 第k位为1表示第k个槽已被使用
+    uint16_t slots;                     // 槽数
+    uint16_t reserved;
+} tail_entry;
+
+
 typedef struct dir_item {               // 目录项一个更常见的叫法是 dirent(directory entry)
     uint32_t inode_id;          // 当前目录项表示的文件/目录的对应inode
     uint16_t valid;             // 当前目录项是否有效 
@@ -45,16 +167,69 @@ typedef struct dir_item {               // 目录项一个更常见的叫法是
 }dir_item;
 
 
-char buf[BLOCK_SIZE]; 
-sp_block super_block_buf;
-inode inode_buf[INODE_NUMS_EACH_BLOCK];
-dir_item dir_table[DIR_ITEMS_EACH_BLOCK];
+// 快照是创建时整个镜像的一份只读视图, 创建时只写回所有数据并在快照表中加一项, 不复制任何块。
+// 之后第一次覆盖写快照创建时已占用的块(inode块, 目录块, 数据块, 位图等)之前, 先把旧内容复制到一个新块,
+// 记入最新快照的例外表; 释放这样的块时不放回位图, 直接记为快照自己的块。
+// 读快照时块号先依次查该快照及之后创建的快照的例外表, 都没有时读原来的块。
+// 快照表占一个块, 按创建时间排列, 每项是一个snapshot_entry; 例外表和引用计数表一样存放在一串以chunk_map_head开头的块中,
+// 后面是cow_entry数组; 快照只能以只读方式挂载, 挂载快照时镜像不能同时被读写挂载
+#define SNAPSHOT_NAME_MAX 48
+
+typedef struct snapshot_entry {
+    uint64_t cow_map;                   // 例外表的第一个块, 0表示没有
+    uint64_t block_count;               // 创建时的总块数
+    uint32_t cow_count;                 // 例外表的项数
+    uint32_t reserved;
+    int64_t created;                    // 创建时间(秒)
+    char name[SNAPSHOT_NAME_MAX];       // 快照名, 以'\0'结尾
+} snapshot_entry;
+
+typedef struct cow_entry {
+    uint64_t block;                     // 创建快照之后被覆盖写或释放的块
+    uint64_t copy;                      // 快照中这个块的内容所在的块, 释放的块就是它自己
+} cow_entry;
+
+
+// 离线去重的统计
+typedef struct dedupe_stat {
+    uint64_t scanned;           // 读取并计算哈希的不同数据块数
+    uint64_t duplicates;        // 改为指向相同内容的块的引用数
+    uint64_t freed;             // 因此释放的块数
+} dedupe_stat;
+
+
+// 一个挂载的文件系统实例, 由filesys_init()返回, 下面的函数都作用于传入的实例
+typedef struct filesys filesys;
+
+filesys* filesys_init(disk *d);
+filesys* filesys_open_snapshot(disk *d, char *name);
+int filesys_format(disk *d, uint32_t block_size, uint32_t inode_ratio, uint64_t journal_blocks);
+int filesys_resize(filesys *fs, uint64_t size);
+void ls(filesys *fs, char *path);
+int read_dir(filesys *fs, char *path, dir_item *items, int max_items);
+int lookup(filesys *fs, char *path, inode *stat);
+int mkdir(filesys *fs, char *path);
+int touch(filesys *fs, char *path);
+int touch_bulk(filesys *fs, char *dir, char *names[], int num);
+int copy(filesys *fs, char *dest, char *src);
+int copy_reflink(filesys *fs, char *dest, char *src);
+int set_compress(filesys *fs, char *path, int enable);
+int read_file(filesys *fs, char *path, uint32_t offset, char *data, uint32_t len);
+int write_file(filesys *fs, char *path, uint32_t offset, char *data, uint32_t len);
+int close_file(filesys *fs, char *path);
+int remove_file(filesys *fs, char *path);
+int get_free_inode(filesys *fs, int parent_id, int type);
+int get_free_inodes(filesys *fs, int parent_id, int inode_num, int* inodes_index);
+void put_free_inode(filesys *fs, int inode_id);
+int get_free_block(filesys *fs, uint64_t goal, int block_num, uint64_t* blocks_index);
+void sync_spblock(filesys *fs);
+void filesys_sync(filesys *fs);
+int filesys_dedupe(filesys *fs, int threads, dedupe_stat *stat);
+int filesys_snapshot(filesys *fs, char *name);
+int filesys_snapshot_delete(filesys *fs, char *name);
+void ls_snapshots(filesys *fs);
+int set_cache_policy(filesys *fs, char *name);
+void cache_info(filesys *fs);
+void filesys_shutdown(filesys *fs);
 
-void filesys_init();
-void ls(char *path);
-int mkdir(char *path);
-int touch(char *path);
-void copy(char *dest, char *src);
-int get_free_inode();
-int get_free_block(int block_num, int* blocks_index);
-void shutdown();
\ No newline at end of file
+#endif
@@ -0,0 +1,21 @@
+#ifndef LZ_H
+#define LZ_H
+
+// 简单的LZ77压缩, 格式和LZ4的块格式类似:
+// 每个序列是一个标记字节(高4位为字面量长度, 低4位为匹配长度减4, 为15时后面跟着255累加的扩展长度),
+// 然后是字面量, 2字节小端的匹配距离和匹配长度的扩展; 最后一个序列只有字面量。
+// 压缩只查一个哈希表, 速度优先, 不追求压缩率
+
+/**
+ * @brief 将src中的len个字节压缩到dst中, dst最多写cap个字节
+ * @return 成功返回压缩后的字节数, 压缩后超过cap时返回-1
+ */
+int lz_compress(const char *src, int len, char *dst, int cap);
+
+/**
+ * @brief 将src中len个字节的压缩数据解压到dst中, dst最多写cap个字节
+ * @return 成功返回解压后的字节数, 数据损坏或超过cap时返回-1
+ */
+int lz_decompress(const char *src, int len, char *dst, int cap);
+
+#endif
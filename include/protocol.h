@@ -0,0 +1,53 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+
+// 文件系统服务端与客户端之间的二进制协议
+// 请求: fs_request头 + path_len字节的路径 + data_len字节的数据(仅写请求)
+// 响应: fs_response头 + data_len字节的数据
+
+#define FS_PROTO_MAGIC 0x46535250   // "FSRP"
+#define FS_PATH_MAX    256          // 路径(包括copy的两个路径)的最大长度
+#define FS_DATA_MAX    (64*1024)    // 一次请求或响应携带数据的最大长度
+
+#define FS_OP_LOOKUP   1    // 查找文件或文件夹,        响应数据为fs_stat
+#define FS_OP_CREATE   2    // 创建文件或文件夹(flags为类型), 响应status为inode_id
+#define FS_OP_READDIR  3    // 读取目录,                响应数据为若干fs_dirent
+#define FS_OP_READ     4    // 读取offset处data_len字节, 响应数据为读到的内容
+#define FS_OP_WRITE    5    // 写入offset处data_len字节, 响应status为写入字节数
+#define FS_OP_COPY     6    // 路径为"dest\0src",        响应status为dest的inode_id
+#define FS_OP_CLOSE    7    // 关闭文件, 写回脏块并释放它预留的块
+#define FS_OP_REMOVE   8    // 删除文件
+#define FS_OP_SYNC     9    // 写回所有文件的脏块, 路径为空
+
+#define FS_COPY_REFLINK 1   // FS_OP_COPY的flags: 共享src的数据块而不复制数据
+
+typedef struct fs_request {
+    uint32_t magic;
+    uint16_t op;
+    uint16_t flags;
+    uint32_t path_len;
+    uint32_t offset;
+    uint32_t data_len;
+} fs_request;
+
+typedef struct fs_response {
+    int32_t status;             // 失败为-1, 成功为非负数
+    uint32_t data_len;
+} fs_response;
+
+typedef struct fs_stat {
+    uint32_t inode_id;
+    uint32_t size;
+    uint16_t file_type;
+    uint16_t link;
+} fs_stat;
+
+typedef struct fs_dirent {
+    uint32_t inode_id;
+    uint8_t type;
+    uint8_t name_len;           // 紧跟在后面的名字的长度(不包括'\0')
+} fs_dirent;
+
+#endif
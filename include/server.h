@@ -0,0 +1,21 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "filesys.h"
+
+#define SERVER_DEFAULT_SOCKET  "fs.sock"
+#define SERVER_DEFAULT_WORKERS 4
+
+/**
+ * @brief 以服务端模式运行文件系统fs
+ * @param fs        filesys_init()返回的文件系统实例
+ * @param sock_path UNIX域套接字的路径
+ * @param workers   工作线程数
+ * @return 失败返回-1, 成功时直到收到SIGINT/SIGTERM才返回0
+ *
+ * @note 每个实例有自己的连接队列和工作线程, 多个镜像可以在不同的线程中分别调用, 在同一个进程中服务;
+ *       收到信号后所有实例都返回
+ */
+int server_run(filesys *fs, const char *sock_path, int workers);
+
+#endif
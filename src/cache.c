@@ -0,0 +1,538 @@
+#include "cache.h"
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define CACHE_HASH 1024
+
+// 干净块所在的链表, 记录在cache_buf的queue中; 变脏时移到脏块链表, 写回后回到原来的链表
+#define QUEUE_LRU 0             // LRU策略下所有的数据块, 2Q策略下再次被访问过的数据块
+#define QUEUE_IN 1              // 2Q策略下第一次读入的数据块, 先进先出
+#define QUEUE_META 2            // 元数据块, LRU
+
+// 2Q记住的最近从FIFO队列淘汰的块
+typedef struct ghost_key {
+    int owner;
+    uint64_t index;
+} ghost_key;
+
+struct block_cache {
+    // 同一个owner的数据块都在同一个哈希链上, 丢弃和收集一个文件的块时只需要遍历一条链; 元数据块按块号散列
+    cache_buf *buckets[CACHE_HASH];
+    // 干净块的LRU链表, FIFO链表, 元数据链表(表头最近使用或最近读入)和脏块链表, 都是带哨兵的双向链表
+    cache_buf lru;
+    cache_buf in;
+    cache_buf meta;
+    cache_buf dirty_list;
+    int in_count;
+    int meta_count;
+    int total;
+    uint32_t block_size;
+    int dirty_count;
+    int policy;
+    ghost_key ghosts[CACHE_2Q_GHOST];
+    int ghost_pos;
+    cache_stat stat;
+    pthread_mutex_t lock;
+    pthread_cond_t loaded;      // 有块读入完成
+};
+
+
+static uint64_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+static cache_buf** bucket_of(block_cache *cache, int owner, uint64_t index)
+{
+    if(owner == CACHE_META_OWNER)
+        return &cache->buckets[index % CACHE_HASH];
+    return &cache->buckets[(unsigned)owner % CACHE_HASH];
+}
+
+
+static void list_remove(cache_buf *buf)
+{
+    buf->prev->next = buf->next;
+    buf->next->prev = buf->prev;
+}
+
+
+static void list_push(cache_buf *head, cache_buf *buf)
+{
+    buf->next = head->next;
+    buf->prev = head;
+    head->next->prev = buf;
+    head->next = buf;
+}
+
+
+static cache_buf* queue_head(block_cache *cache, int queue)
+{
+    return queue == QUEUE_META ? &cache->meta : (queue == QUEUE_IN ? &cache->in : &cache->lru);
+}
+
+
+/**
+ * @brief 把干净块buf放到表头, queue为它所在的链表
+ * @note 调用者需要持有缓存的锁
+ */
+static void link_clean(block_cache *cache, cache_buf *buf, int queue)
+{
+    buf->queue = queue;
+    list_push(queue_head(cache, queue), buf);
+    if(queue == QUEUE_IN)
+        cache->in_count++;
+    else if(queue == QUEUE_META)
+        cache->meta_count++;
+}
+
+
+/**
+ * @brief 把干净块buf从它所在的链表中取下
+ * @note 调用者需要持有缓存的锁
+ */
+static void unlink_clean(block_cache *cache, cache_buf *buf)
+{
+    list_remove(buf);
+    if(buf->queue == QUEUE_IN)
+        cache->in_count--;
+    else if(buf->queue == QUEUE_META)
+        cache->meta_count--;
+}
+
+
+/**
+ * @brief 从表尾开始在链表head中找一个没有引用的块
+ * @return 找到返回该块, 否则返回NULL
+ */
+static cache_buf* find_victim(cache_buf *head)
+{
+    for(cache_buf *victim = head->prev; victim != head; victim = victim->prev)
+    {
+        if(victim->refs == 0)
+            return victim;
+    }
+    return NULL;
+}
+
+
+/**
+ * @brief 选出要淘汰的干净块: 元数据超过CACHE_META_SHARE时先淘汰元数据,
+ *        否则先淘汰数据块(2Q策略下FIFO队列超过CACHE_2Q_IN时先淘汰FIFO队列), 最后才淘汰元数据
+ * @return 返回选出的块, 所有干净块都被引用时返回NULL
+ * @note 调用者需要持有缓存的锁
+ */
+static cache_buf* pick_victim(block_cache *cache)
+{
+    cache_buf *victim = NULL;
+    if(cache->meta_count > CACHE_META_SHARE)
+        victim = find_victim(&cache->meta);
+    if(victim == NULL && cache->in_count > CACHE_2Q_IN)
+        victim = find_victim(&cache->in);
+    if(victim == NULL)
+        victim = find_victim(&cache->lru);
+    if(victim == NULL)
+        victim = find_victim(&cache->in);
+    if(victim == NULL)
+        victim = find_victim(&cache->meta);
+    return victim;
+}
+
+
+/**
+ * @brief 在2Q记住的块中查找(owner, index), 找到后把它忘掉
+ * @return 找到返回1, 否则返回0
+ */
+static int ghost_take(block_cache *cache, int owner, uint64_t index)
+{
+    for(int i=0; i<CACHE_2Q_GHOST; i++)
+    {
+        if(cache->ghosts[i].owner == owner && cache->ghosts[i].index == index)
+        {
+            cache->ghosts[i].owner = INT_MIN;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+static void hash_remove(block_cache *cache, cache_buf *buf)
+{
+    cache_buf **p = bucket_of(cache, buf->owner, buf->index);
+    while(*p != buf)
+        p = &(*p)->hash_next;
+    *p = buf->hash_next;
+}
+
+
+/**
+ * @brief 在哈希链中查找owner的第index块
+ * @note 调用者需要持有缓存的锁
+ */
+static cache_buf* find(block_cache *cache, int owner, uint64_t index)
+{
+    for(cache_buf *buf = *bucket_of(cache, owner, index); buf != NULL; buf = buf->hash_next)
+    {
+        if(buf->owner == owner && buf->index == index)
+            return buf;
+    }
+    return NULL;
+}
+
+
+/**
+ * @brief 新建一个干净块放入缓存, 缓存已满时按替换策略复用一个没有引用的干净块
+ * @note 调用者需要持有缓存的锁; 所有干净块都被引用时临时超出容量
+ */
+static cache_buf* alloc_buf(block_cache *cache, int owner, uint64_t index, uint64_t block_id)
+{
+    cache_buf *buf = NULL;
+    if(cache->total >= CACHE_BLOCKS)
+        buf = pick_victim(cache);
+    if(buf != NULL)
+    {
+        unlink_clean(cache, buf);
+        hash_remove(cache, buf);
+        // 从FIFO队列淘汰的块记住一段时间, 期间再次读入说明它会被反复使用
+        if(buf->queue == QUEUE_IN)
+        {
+            cache->ghosts[cache->ghost_pos].owner = buf->owner;
+            cache->ghosts[cache->ghost_pos].index = buf->index;
+            cache->ghost_pos = (cache->ghost_pos + 1) % CACHE_2Q_GHOST;
+        }
+    }
+    else
+    {
+        buf = malloc(sizeof(cache_buf) + cache->block_size);
+        cache->total++;
+    }
+
+    buf->owner = owner;
+    buf->index = index;
+    buf->block_id = block_id;
+    buf->dirty = 0;
+    buf->loading = 0;
+    buf->refs = 0;
+    buf->hash_next = *bucket_of(cache, owner, index);
+    *bucket_of(cache, owner, index) = buf;
+    if(owner == CACHE_META_OWNER)
+        link_clean(cache, buf, QUEUE_META);
+    else if(cache->policy == CACHE_2Q && !ghost_take(cache, owner, index))
+        link_clean(cache, buf, QUEUE_IN);
+    else
+        link_clean(cache, buf, QUEUE_LRU);
+    return buf;
+}
+
+
+block_cache* cache_new(uint32_t block_size)
+{
+    block_cache *cache = calloc(1, sizeof(block_cache));
+    cache->lru.prev = cache->lru.next = &cache->lru;
+    cache->in.prev = cache->in.next = &cache->in;
+    cache->meta.prev = cache->meta.next = &cache->meta;
+    for(int i=0; i<CACHE_2Q_GHOST; i++)
+        cache->ghosts[i].owner = INT_MIN;
+    cache->policy = CACHE_2Q;
+    cache->dirty_list.prev = cache->dirty_list.next = &cache->dirty_list;
+    cache->block_size = block_size;
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->loaded, NULL);
+    return cache;
+}
+
+
+void cache_free(block_cache *cache)
+{
+    for(int i=0; i<CACHE_HASH; i++)
+    {
+        while(cache->buckets[i] != NULL)
+        {
+            cache_buf *buf = cache->buckets[i];
+            cache->buckets[i] = buf->hash_next;
+            free(buf);
+        }
+    }
+    pthread_mutex_destroy(&cache->lock);
+    pthread_cond_destroy(&cache->loaded);
+    free(cache);
+}
+
+
+/**
+ * @brief 查找(owner, index), 该块正在读入时等待读入完成; 找到后增加引用并按替换策略调整位置
+ * @return 找到返回缓存块, 否则返回NULL
+ * @note 调用者需要持有缓存的锁
+ */
+static cache_buf* find_and_get(block_cache *cache, int owner, uint64_t index)
+{
+    int cls = owner == CACHE_META_OWNER ? CACHE_CLASS_META : CACHE_CLASS_DATA;
+    cache_buf *buf;
+    while((buf = find(cache, owner, index)) != NULL && buf->loading)
+        pthread_cond_wait(&cache->loaded, &cache->lock);
+    if(buf == NULL)
+    {
+        cache->stat.misses[cls]++;
+        return NULL;
+    }
+    cache->stat.hits[cls]++;
+    buf->refs++;
+    // FIFO队列中的块被访问时不移动, 被淘汰后再次读入才进入LRU队列
+    if(!buf->dirty && buf->queue != QUEUE_IN)
+    {
+        list_remove(buf);
+        list_push(queue_head(cache, buf->queue), buf);
+    }
+    return buf;
+}
+
+
+cache_buf* cache_lookup(block_cache *cache, int owner, uint64_t index)
+{
+    pthread_mutex_lock(&cache->lock);
+    cache_buf *buf = find_and_get(cache, owner, index);
+    pthread_mutex_unlock(&cache->lock);
+    return buf;
+}
+
+
+cache_buf* cache_get(block_cache *cache, int owner, uint64_t index, uint64_t block_id, int *created)
+{
+    pthread_mutex_lock(&cache->lock);
+    cache_buf *buf = find_and_get(cache, owner, index);
+    *created = buf == NULL;
+    if(buf == NULL)
+    {
+        buf = alloc_buf(cache, owner, index, block_id);
+        buf->refs = 1;
+        buf->loading = 1;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return buf;
+}
+
+
+void cache_loaded(block_cache *cache, cache_buf *buf, int ok)
+{
+    pthread_mutex_lock(&cache->lock);
+    buf->loading = 0;
+    if(!ok)
+    {
+        hash_remove(cache, buf);
+        unlink_clean(cache, buf);
+        cache->total--;
+        free(buf);
+    }
+    pthread_cond_broadcast(&cache->loaded);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+
+cache_buf* cache_create(block_cache *cache, int owner, uint64_t index, uint64_t block_id)
+{
+    pthread_mutex_lock(&cache->lock);
+    cache_buf *buf = alloc_buf(cache, owner, index, block_id);
+    buf->refs = 1;
+    pthread_mutex_unlock(&cache->lock);
+    return buf;
+}
+
+
+void cache_insert(block_cache *cache, int owner, uint64_t index, uint64_t block_id, char *data)
+{
+    pthread_mutex_lock(&cache->lock);
+    if(find(cache, owner, index) == NULL)
+    {
+        cache_buf *buf = alloc_buf(cache, owner, index, block_id);
+        memcpy(buf->data, data, cache->block_size);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+
+void cache_update(block_cache *cache, int owner, uint64_t index, char *data)
+{
+    pthread_mutex_lock(&cache->lock);
+    cache_buf *buf = find(cache, owner, index);
+    if(buf != NULL && !buf->loading && buf->data != data)
+        memcpy(buf->data, data, cache->block_size);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+
+void cache_release(block_cache *cache, cache_buf *buf)
+{
+    pthread_mutex_lock(&cache->lock);
+    buf->refs--;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+
+void cache_mark_dirty(block_cache *cache, cache_buf *buf)
+{
+    pthread_mutex_lock(&cache->lock);
+    if(!buf->dirty)
+    {
+        buf->dirty = 1;
+        buf->dirtied_at = now_ms();
+        cache->dirty_count++;
+        unlink_clean(cache, buf);
+        list_push(&cache->dirty_list, buf);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+
+void cache_mark_clean(block_cache *cache, cache_buf *buf, uint64_t block_id)
+{
+    pthread_mutex_lock(&cache->lock);
+    buf->block_id = block_id;
+    if(buf->dirty)
+    {
+        buf->dirty = 0;
+        cache->dirty_count--;
+        list_remove(buf);
+        // 切换到LRU时脏块不在FIFO队列中, 没有被移走, 变干净时再放进LRU队列
+        int queue = buf->queue == QUEUE_IN && cache->policy == CACHE_LRU ? QUEUE_LRU : buf->queue;
+        link_clean(cache, buf, queue);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+
+int cache_dirty_bufs(block_cache *cache, int owner, cache_buf **bufs, int max)
+{
+    int num = 0;
+    pthread_mutex_lock(&cache->lock);
+    for(cache_buf *buf = *bucket_of(cache, owner, 0); buf != NULL && num < max; buf = buf->hash_next)
+    {
+        if(buf->owner != owner || !buf->dirty)
+            continue;
+        buf->refs++;
+        // 插入排序, 一个文件的脏块很少
+        int k = num++;
+        for(; k>0 && bufs[k-1]->index > buf->index; k--)
+            bufs[k] = bufs[k-1];
+        bufs[k] = buf;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return num;
+}
+
+
+int cache_dirty_owners(block_cache *cache, int *owners, int max)
+{
+    int num = 0;
+    pthread_mutex_lock(&cache->lock);
+    for(cache_buf *buf = cache->dirty_list.next; buf != &cache->dirty_list && num < max; buf = buf->next)
+    {
+        int k = 0;
+        while(k < num && owners[k] != buf->owner)
+            k++;
+        if(k == num)
+            owners[num++] = buf->owner;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return num;
+}
+
+
+int cache_expired_owners(block_cache *cache, uint32_t age_ms, int *owners, int max)
+{
+    uint64_t now = now_ms();
+    int num = 0;
+    pthread_mutex_lock(&cache->lock);
+    // 脏块链表按变脏的时间从新到旧排列, 从表尾往前找
+    for(cache_buf *buf = cache->dirty_list.prev; buf != &cache->dirty_list && num < max; buf = buf->prev)
+    {
+        if(now - buf->dirtied_at < age_ms)
+            break;
+        int k = 0;
+        while(k < num && owners[k] != buf->owner)
+            k++;
+        if(k == num)
+            owners[num++] = buf->owner;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return num;
+}
+
+
+int cache_dirty_count(block_cache *cache)
+{
+    pthread_mutex_lock(&cache->lock);
+    int num = cache->dirty_count;
+    pthread_mutex_unlock(&cache->lock);
+    return num;
+}
+
+
+int cache_drop(block_cache *cache, int owner)
+{
+    int delayed = 0;
+    pthread_mutex_lock(&cache->lock);
+    cache_buf **p = bucket_of(cache, owner, 0);
+    while(*p != NULL)
+    {
+        cache_buf *buf = *p;
+        if(buf->owner != owner)
+        {
+            p = &buf->hash_next;
+            continue;
+        }
+        *p = buf->hash_next;
+        if(buf->dirty)
+        {
+            list_remove(buf);
+            cache->dirty_count--;
+            if(buf->block_id == 0)
+                delayed++;
+        }
+        else
+            unlink_clean(cache, buf);
+        cache->total--;
+        free(buf);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return delayed;
+}
+
+
+void cache_set_policy(block_cache *cache, int policy)
+{
+    pthread_mutex_lock(&cache->lock);
+    // 切换到LRU时FIFO队列中的块都移到LRU队列; 切换到2Q时原来的块都当作常用的块
+    if(policy == CACHE_LRU)
+    {
+        while(cache->in.prev != &cache->in)
+        {
+            cache_buf *buf = cache->in.prev;
+            unlink_clean(cache, buf);
+            link_clean(cache, buf, QUEUE_LRU);
+        }
+    }
+    cache->policy = policy;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+
+int cache_get_policy(block_cache *cache)
+{
+    return cache->policy;
+}
+
+
+void cache_get_stat(block_cache *cache, cache_stat *st)
+{
+    pthread_mutex_lock(&cache->lock);
+    *st = cache->stat;
+    pthread_mutex_unlock(&cache->lock);
+}
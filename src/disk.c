@@ -1,79 +1,343 @@
+#define _FILE_OFFSET_BITS 64
 #include "disk.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
-inline int get_disk_size()
+#define IO_DEPTH 4              // 同时进行的I/O请求数, 超过后请求排队
+#define IO_MERGE_MAX 32         // 一次最多合并的请求数
+
+// 排队的请求按类别放在三个队列中, 优先级从高到低
+#define QUEUE_READ 0            // 前台读
+#define QUEUE_WRITE 1           // 前台同步写
+#define QUEUE_BACKGROUND 2      // 后台线程的读写
+#define QUEUE_COUNT 3
+
+// 各类请求排队的期限(微秒), 过期的请求优先于高优先级的请求, 后台请求不会一直饿死
+static const uint64_t queue_deadline_us[QUEUE_COUNT] = { 5000, 50000, 500000 };
+
+// 当前线程的I/O类别
+static _Thread_local int thread_io_class = DISK_IO_FOREGROUND;
+
+// 一个读写请求; 排队时由提交的线程等待, 被调度后由它自己执行, 合并进来的请求挂在merged链表上一起执行
+typedef struct io_request {
+        uint64_t block_num;
+        uint32_t count;
+        char *buf;
+        int write;
+        uint64_t deadline;
+        int state;
+        int result;
+        pthread_cond_t cond;
+        struct io_request *next;        // 同一个队列中的下一个请求
+        struct io_request *merged;      // 合并到执行者上一起执行的请求
+} io_request;
+
+// 请求的状态
+#define REQ_QUEUED 0
+#define REQ_DISPATCHED 1        // 由提交的线程执行, 连同merged链表上的请求
+#define REQ_DONE 2              // 已经被合并到其他请求中执行完
+
+// 一个打开的磁盘镜像, 使用pread/pwrite按64位偏移读写, 多个线程可以同时访问
+// 磁盘大小在扩容时会变大, 读写时原子地读取
+// 同时进行的请求不超过IO_DEPTH个, 没有排队的请求时直接执行, 否则按类别排队, 由完成的请求调度下一个
+struct disk {
+        int fd;
+        _Atomic uint64_t size;
+        pthread_mutex_t lock;
+        int inflight;
+        int queued;
+        io_request *queue_head[QUEUE_COUNT];
+        io_request *queue_tail[QUEUE_COUNT];
+};
+
+void disk_set_io_class(int io_class)
 {
-        return 4*1024*1024; 
+        thread_io_class = io_class;
 }
 
-static FILE* disk;
+static uint64_t now_us()
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-static int create_disk()
+/**
+ * @brief 从类别为q的队列中取出req
+ * @note 调用者需要持有d->lock
+ */
+static void queue_remove(disk *d, int q, io_request *req)
 {
-        FILE* tmp = fopen("disk","w");
-        for(int i = 0; i < get_disk_size(); i++){
-                fputc(0,tmp);
+        io_request **p = &d->queue_head[q];
+        io_request *prev = NULL;
+        while(*p != req){
+                prev = *p;
+                p = &(*p)->next;
         }
-        fclose(tmp);
+        *p = req->next;
+        if(d->queue_tail[q] == req){
+                d->queue_tail[q] = prev;
+        }
+        d->queued--;
 }
 
-int open_disk()
+/**
+ * @brief 选出下一个要执行的请求: 期限已过的队首请求中期限最早的, 没有时取优先级最高的非空队列的队首
+ * @note 调用者需要持有d->lock, 并且有排队的请求; 同一个队列中的请求按期限排序, 只需要看队首
+ */
+static io_request* pick_request(disk *d, int *queue)
 {
-        if(disk != 0){
-                return -1;
+        uint64_t now = now_us();
+        int best = -1;
+        for(int q = 0; q < QUEUE_COUNT; q++){
+                io_request *head = d->queue_head[q];
+                if(head != NULL && head->deadline <= now && (best < 0 || head->deadline < d->queue_head[best]->deadline)){
+                        best = q;
+                }
         }
-        disk = fopen("disk","r+");
-        if(disk == 0){
-                create_disk();
-                disk = fopen("disk","r+");
-                if(disk == 0){
-                        return -1;
+        for(int q = 0; best < 0 && q < QUEUE_COUNT; q++){
+                if(d->queue_head[q] != NULL){
+                        best = q;
                 }
         }
-        return 0;
+        *queue = best;
+        return d->queue_head[best];
 }
 
-int disk_read_block(unsigned int block_num, char* buf)
+/**
+ * @brief 把排队的请求中和req合并后的范围首尾相接的同方向请求取出, 挂到req的merged链表上
+ * @note 调用者需要持有d->lock
+ */
+static void merge_adjacent(disk *d, io_request *req)
 {
-        if(disk == 0){
-                return -1;
+        uint64_t start = req->block_num, end = req->block_num + req->count;
+        int num = 1;
+        int found = 1;
+        while(found && num < IO_MERGE_MAX){
+                found = 0;
+                for(int q = 0; q < QUEUE_COUNT && !found; q++){
+                        for(io_request *r = d->queue_head[q]; r != NULL; r = r->next){
+                                if(r->write != req->write || (r->block_num != end && r->block_num + r->count != start)){
+                                        continue;
+                                }
+                                queue_remove(d, q, r);
+                                if(r->block_num == end){
+                                        end += r->count;
+                                }else{
+                                        start = r->block_num;
+                                }
+                                r->merged = req->merged;
+                                req->merged = r;
+                                num++;
+                                found = 1;
+                                break;
+                        }
+                }
         }
-        if(block_num * DEVICE_BLOCK_SIZE >= get_disk_size()){
-                return -1;
+}
+
+/**
+ * @brief 在有空闲的请求位时调度排队的请求, 唤醒它们的提交线程去执行
+ * @note 调用者需要持有d->lock
+ */
+static void dispatch_locked(disk *d)
+{
+        while(d->inflight < IO_DEPTH && d->queued > 0){
+                int q;
+                io_request *req = pick_request(d, &q);
+                queue_remove(d, q, req);
+                req->merged = NULL;
+                merge_adjacent(d, req);
+                req->state = REQ_DISPATCHED;
+                d->inflight++;
+                pthread_cond_signal(&req->cond);
         }
-        if(fseek(disk, block_num * DEVICE_BLOCK_SIZE, SEEK_SET)){
-                return -1;
+}
+
+/**
+ * @brief 执行req和合并到它上面的请求, 它们的块号连续, 按块号排序后用一次preadv/pwritev完成
+ * @return 成功返回0, 失败返回-1
+ */
+static int run_requests(disk *d, io_request *req)
+{
+        io_request *order[IO_MERGE_MAX];
+        int num = 0;
+        for(io_request *r = req; r != NULL; r = r->merged){
+                int k = num++;
+                for(; k > 0 && order[k-1]->block_num > r->block_num; k--){
+                        order[k] = order[k-1];
+                }
+                order[k] = r;
         }
-        if(fread(buf, DEVICE_BLOCK_SIZE,1,disk) != 1){
-                return -1;
+
+        struct iovec iov[IO_MERGE_MAX];
+        size_t len = 0;
+        for(int i = 0; i < num; i++){
+                iov[i].iov_base = order[i]->buf;
+                iov[i].iov_len = (size_t)order[i]->count * DEVICE_BLOCK_SIZE;
+                len += iov[i].iov_len;
         }
-        return 0;
+        off_t offset = (off_t)order[0]->block_num * DEVICE_BLOCK_SIZE;
+        ssize_t n = req->write ? pwritev(d->fd, iov, num, offset) : preadv(d->fd, iov, num, offset);
+        return n == (ssize_t)len ? 0 : -1;
 }
 
-int disk_write_block(unsigned int block_num, char* buf)
+/**
+ * @brief 提交一个读写请求, 等它执行完
+ * @note 有空闲的请求位并且没有排队的请求时直接执行, 否则按当前线程的类别排队, 被调度后自己执行;
+ *       执行完后把空出的请求位交给下一个排队的请求
+ * @return 成功返回0, 失败返回-1
+ */
+static int submit(disk *d, uint64_t block_num, uint32_t count, char *buf, int write)
 {
-        if(disk == 0){
+        if(block_num + count > d->size / DEVICE_BLOCK_SIZE){
                 return -1;
         }
-        if(block_num * DEVICE_BLOCK_SIZE >= get_disk_size()){
-                return -1;
+        io_request req;
+        req.block_num = block_num;
+        req.count = count;
+        req.buf = buf;
+        req.write = write;
+        req.merged = NULL;
+        req.next = NULL;
+        int waited = 0;
+
+        pthread_mutex_lock(&d->lock);
+        if(d->inflight < IO_DEPTH && d->queued == 0){
+                d->inflight++;
+        }else{
+                int q = thread_io_class == DISK_IO_BACKGROUND ? QUEUE_BACKGROUND : (write ? QUEUE_WRITE : QUEUE_READ);
+                req.deadline = now_us() + queue_deadline_us[q];
+                req.state = REQ_QUEUED;
+                pthread_cond_init(&req.cond, NULL);
+                waited = 1;
+                if(d->queue_tail[q] != NULL){
+                        d->queue_tail[q]->next = &req;
+                }else{
+                        d->queue_head[q] = &req;
+                }
+                d->queue_tail[q] = &req;
+                d->queued++;
+                while(req.state == REQ_QUEUED){
+                        pthread_cond_wait(&req.cond, &d->lock);
+                }
         }
-        if(fseek(disk, block_num * DEVICE_BLOCK_SIZE, SEEK_SET)){
-                return -1;
+        if(waited && req.state == REQ_DONE){
+                // 已经合并到其他请求中执行完
+                pthread_mutex_unlock(&d->lock);
+                pthread_cond_destroy(&req.cond);
+                return req.result;
+        }
+        pthread_mutex_unlock(&d->lock);
+
+        int result = run_requests(d, &req);
+
+        pthread_mutex_lock(&d->lock);
+        for(io_request *r = req.merged; r != NULL; ){
+                // 唤醒之后r就失效了, 先取出下一个
+                io_request *next = r->merged;
+                r->result = result;
+                r->state = REQ_DONE;
+                pthread_cond_signal(&r->cond);
+                r = next;
         }
-        if(fwrite(buf,DEVICE_BLOCK_SIZE,1,disk) != 1){
+        d->inflight--;
+        dispatch_locked(d);
+        pthread_mutex_unlock(&d->lock);
+        if(waited){
+                pthread_cond_destroy(&req.cond);
+        }
+        return result;
+}
+
+uint64_t get_disk_size(disk *d)
+{
+        return d->size;
+}
+
+static int create_disk(const char *path)
+{
+        FILE* tmp = fopen(path,"w");
+        if(tmp == NULL){
                 return -1;
         }
+        for(int i = 0; i < DEFAULT_DISK_SIZE; i++){
+                fputc(0,tmp);
+        }
+        fclose(tmp);
         return 0;
 }
 
-int close_disk()
+disk* open_disk_path(const char *path)
+{
+        int fd = open(path, O_RDWR);
+        if(fd < 0){
+                return NULL;
+        }
+        struct stat st;
+        if(fstat(fd, &st) < 0){
+                close(fd);
+                return NULL;
+        }
+        disk *d = calloc(1, sizeof(disk));
+        d->fd = fd;
+        d->size = st.st_size;
+        pthread_mutex_init(&d->lock, NULL);
+        return d;
+}
+
+disk* open_disk(const char *path)
+{
+        if(access(path, F_OK) != 0 && create_disk(path) != 0){
+                return NULL;
+        }
+        return open_disk_path(path);
+}
+
+int grow_disk(disk *d, uint64_t size)
 {
-        if(disk == 0){
+        if(size <= d->size){
+                return 0;
+        }
+        if(ftruncate(d->fd, (off_t)size) != 0){
                 return -1;
         }
-        int r = fclose(disk);
-        disk = 0;
+        d->size = size;
+        return 0;
+}
+
+int disk_read_block(disk *d, uint64_t block_num, char* buf)
+{
+        return submit(d, block_num, 1, buf, 0);
+}
+
+int disk_write_block(disk *d, uint64_t block_num, char* buf)
+{
+        return submit(d, block_num, 1, buf, 1);
+}
+
+int disk_read_blocks(disk *d, uint64_t block_num, uint32_t count, char* buf)
+{
+        return submit(d, block_num, count, buf, 0);
+}
+
+int disk_write_blocks(disk *d, uint64_t block_num, uint32_t count, char* buf)
+{
+        return submit(d, block_num, count, buf, 1);
+}
+
+int close_disk(disk *d)
+{
+        int r = close(d->fd);
+        pthread_mutex_destroy(&d->lock);
+        free(d);
         return r;
-}
\ No newline at end of file
+}
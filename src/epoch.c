@@ -0,0 +1,149 @@
+#include "epoch.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define RETIRE_THRESHOLD 64
+
+typedef struct retired {
+    void *ptr;
+    uint64_t epoch;             // 摘除时的全局epoch
+    struct retired *next;
+} retired;
+
+// 每个线程一条记录, 线程退出后记录留给之后的线程复用
+typedef struct epoch_record {
+    _Atomic uint64_t active;    // 所在的epoch, 0表示不在读临界区
+    _Atomic int in_use;
+    int nesting;
+    retired *retired_list;
+    int retired_num;
+    struct epoch_record *next;
+} epoch_record;
+
+static _Atomic uint64_t global_epoch = 1;
+static _Atomic(epoch_record*) records;
+static pthread_key_t record_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static __thread epoch_record *self;
+
+
+static void release_record(void *arg)
+{
+    epoch_record *rec = arg;
+    atomic_store(&rec->active, 0);
+    atomic_store(&rec->in_use, 0);
+}
+
+
+static void make_key()
+{
+    pthread_key_create(&record_key, release_record);
+}
+
+
+/**
+ * @brief 获取当前线程的记录, 第一次调用时复用空闲记录或者新建一条
+ */
+static epoch_record* get_record()
+{
+    if(self != NULL)
+        return self;
+
+    pthread_once(&key_once, make_key);
+    for(epoch_record *rec = atomic_load(&records); rec != NULL; rec = rec->next)
+    {
+        int expected = 0;
+        if(atomic_compare_exchange_strong(&rec->in_use, &expected, 1))
+        {
+            self = rec;
+            break;
+        }
+    }
+    if(self == NULL)
+    {
+        epoch_record *rec = calloc(1, sizeof(epoch_record));
+        atomic_store(&rec->in_use, 1);
+        rec->next = atomic_load(&records);
+        while(!atomic_compare_exchange_weak(&records, &rec->next, rec))
+            ;
+        self = rec;
+    }
+    pthread_setspecific(record_key, self);
+    return self;
+}
+
+
+/**
+ * @brief 尝试推进全局epoch, 并释放所有读者都已经看不到的对象
+ */
+static void reclaim(epoch_record *rec)
+{
+    uint64_t epoch = atomic_load(&global_epoch);
+    uint64_t min_active = UINT64_MAX;
+    int all_current = 1;
+    for(epoch_record *r = atomic_load(&records); r != NULL; r = r->next)
+    {
+        uint64_t active = atomic_load(&r->active);
+        if(active == 0)
+            continue;
+        if(active < min_active)
+            min_active = active;
+        if(active != epoch)
+            all_current = 0;
+    }
+    if(all_current)
+        atomic_compare_exchange_strong(&global_epoch, &epoch, epoch + 1);
+
+    // 在epoch e时摘除的对象只可能被active<=e的读者看到
+    retired **p = &rec->retired_list;
+    while(*p != NULL)
+    {
+        retired *r = *p;
+        if(r->epoch < min_active)
+        {
+            *p = r->next;
+            free(r->ptr);
+            free(r);
+            rec->retired_num--;
+        }
+        else
+            p = &r->next;
+    }
+}
+
+
+void epoch_enter()
+{
+    epoch_record *rec = get_record();
+    if(rec->nesting++ == 0)
+    {
+        // seq_cst的写保证之后对共享指针的读不会被重排到它前面
+        atomic_store(&rec->active, atomic_load(&global_epoch));
+    }
+}
+
+
+void epoch_exit()
+{
+    epoch_record *rec = self;
+    if(--rec->nesting == 0)
+        atomic_store_explicit(&rec->active, 0, memory_order_release);
+}
+
+
+void epoch_retire(void *ptr)
+{
+    if(ptr == NULL)
+        return;
+    epoch_record *rec = get_record();
+    retired *r = malloc(sizeof(retired));
+    r->ptr = ptr;
+    r->epoch = atomic_load(&global_epoch);
+    r->next = rec->retired_list;
+    rec->retired_list = r;
+    if(++rec->retired_num >= RETIRE_THRESHOLD)
+        reclaim(rec);
+}
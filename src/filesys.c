@@ -1,750 +1,5823 @@
+#define _GNU_SOURCE
 #include "filesys.h"
 #include "disk.h"
+#include "epoch.h"
+#include "cache.h"
+#include "lz.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#define ALLOC_CPUS 64
+#define RESERVE_WINDOW 8 //每次为增长的文件预留的最多块数
+#define DIRTY_LIMIT (CACHE_BLOCKS/2) //脏块超过这个数时写者等待后台线程写回
+#define DIRTY_BACKGROUND (CACHE_BLOCKS/4) //脏块超过这个数时后台线程写回所有脏块
+#define DIRTY_EXPIRE_MS 3000 //变脏超过这个时间的块由后台线程写回
+#define FLUSH_INTERVAL_MS 500 //后台写回线程每轮之间最多休眠的毫秒数
+#define INODE_LOCKS 4096 //inode读写锁的个数, inode按编号散列到锁上
+#define INODE_BLOCK_LOCKS 1024 //inode块锁的个数
+#define SLOT_CHUNK 4096 //icache和dcache每个二级表的项数
+#define CHUNK_SEG 4096 //inode chunk表每段的项数
+#define REFCOUNT_HASH 1024 //引用计数表的哈希桶数
+#define COW_HASH 4096 //快照例外表的哈希桶数
+#define TAIL_HASH 256 //尾块按块号散列的桶数
+#define TAIL_CACHE 64 //缓存的尾块数, 按块号直接映射
+#define GROUP_SEG 1024 //块组表每段的组数, 是每块描述符数的整数倍
+#define MAX_GROUPS (DYNAMIC_INODE_BASE / 32) //块组数的上限, 每组至少32个inode
+#define DIR_GROUP_SCAN 32 //为新目录选择块组时最多比较的组数
+#define ITABLE_ZERO_BYTES (256*1024) //后台线程每轮清零的inode表字节数
+#define ITABLE_ZERO_INTERVAL 10 //后台线程每轮之间休眠的毫秒数
+#define DEDUPE_MAX_THREADS 64 //去重时计算哈希的最多线程数
+#define READAHEAD_SLOTS 256 //记录顺序读状态的文件数, 按inode_id直接映射
+#define READAHEAD_INIT 2 //第一次预读的块数
+#define READAHEAD_MAX 5 //最多预读的块数, 文件最多6块
+
+// 每个块组的空闲摘要和位图, 选择块组时只看摘要, 不用扫描位图。
+// 位图在第一次用到时才从磁盘加载, 之后一直留在内存中; 按字用CAS分配, 用原子与释放, 分配器之间不加锁
+typedef struct group_info {
+    _Atomic int32_t free_blocks;
+    _Atomic int32_t free_inodes;
+    _Atomic int32_t dirs;
+    _Atomic uint32_t dirty;                 // 组内的位图或摘要被修改过, 需要写回
+    _Atomic uint32_t itable_zeroed;         // inode表中已经清零的块数
+    _Atomic(_Atomic uint32_t*) block_map;
+    _Atomic(_Atomic uint32_t*) inode_map;
+    char pad[24];                           // 每组独占一个cache line
+} group_info;
+
+// 每个CPU一组空闲计数的增量, 写回超级块时才折叠进free_block_count/free_inode_count
+typedef struct free_delta {
+    _Atomic int32_t blocks;
+    _Atomic int32_t inodes;
+    char pad[56];               // 每组独占一个cache line
+} free_delta;
+
+// 每个文件的块预留窗口: [start, start+len)已经在位图中占用, [start, next)已经分配给文件
+// 按inode锁分链, 由该文件的inode写锁保护, 空间不足时其他线程用trywrlock回收
+typedef struct reservation {
+    int inode_id;
+    int len;
+    uint64_t start;
+    uint64_t next;
+    struct reservation *link;
+} reservation;
+
+// 目录快照: 目录中所有有效目录项的只读副本
+typedef struct dir_snapshot {
+    int num;
+    dir_item items[];
+} dir_snapshot;
+
+// 无锁读路径: 读者在epoch_enter()/epoch_exit()之间直接读取缓存的只读版本,
+// 写者修改磁盘后发布新版本, 旧版本通过epoch_retire()延迟释放。
+// icache由inode块锁串行更新, dcache在持有目录写锁(或读锁加CAS)时更新。
+// 两者都是按SLOT_CHUNK分段的两级表, 覆盖所有inode编号(包括动态分配的), 二级表在第一次发布时分配, 只有用到的inode才占内存
+typedef _Atomic(void*) cache_slot;
+
+// 内存中的尾块表项; 有空闲槽的尾块按类别挂在partial链表上
+typedef struct tail_block {
+    uint64_t block;
+    uint32_t used_mask;
+    uint16_t slots;
+    uint16_t in_partial;
+    struct tail_block *hash_next;
+    struct tail_block *partial_next;
+} tail_block;
+
+// 缓存的尾块内容, 许多小文件共用一个缓存的尾块
+typedef struct tail_cached {
+    uint64_t block;
+    char *data;
+} tail_cached;
+
+// 一个文件的顺序读状态: next是上次预读到的位置, 从这里继续读时认为是顺序读
+typedef struct readahead_state {
+    int inode_id;
+    int next;
+    int window;
+} readahead_state;
+
+// 内存中的引用计数表项
+typedef struct refcount_node {
+    uint64_t block;
+    uint32_t refs;
+    struct refcount_node *next;
+} refcount_node;
+
+// 内存中一个快照的例外表: 项按加入的顺序存放, 写回时只追加新项; 按块号散列查找, 桶和链中存放下标+1, 0表示没有。
+// maps[g]是创建快照时第g组的块位图, 第一次用到时从快照的视图中读出
+typedef struct cow_table {
+    cow_entry *entries;
+    uint32_t count;
+    uint32_t cap;
+    uint32_t synced;                    // 已经写入磁盘的项数
+    uint32_t *chain;
+    uint32_t buckets[COW_HASH];
+    uint64_t *blocks;                   // 磁盘上的例外表块, 按链表顺序
+    uint32_t block_num;
+    uint64_t block_count;               // 创建时的总块数, 之后扩容增加的块都不在快照中
+    uint32_t **maps;
+    uint32_t map_count;
+} cow_table;
+
+// 一个挂载的文件系统实例: 磁盘, 缓存, 超级块以及所有的锁和内存中的元数据都在这里,
+// 不同实例之间不共享状态, 一个进程可以同时挂载多个镜像
+struct filesys {
+    disk *disk;
+    block_cache *cache;
+
+    // 内存中的超级块和块组描述符表, 只在写回和扩容时由sb_lock保护
+    // 其中的空闲计数只是写回用的副本, 真正的位图和计数在下面
+    sp_block super_block_buf;
+    fs_geometry geo;
+    pthread_mutex_t sb_lock;
+    _Atomic uint32_t sb_dirty;
+
+    // 块组描述符和空闲摘要都按GROUP_SEG分段存放, 扩容时只追加新段, 已有的组不会移动,
+    // 分配器不加锁也能安全访问; 新组的段先发布, 再增加group_count
+    _Atomic(group_desc*) desc_table[MAX_GROUPS / GROUP_SEG];
+    _Atomic(group_info*) group_table[MAX_GROUPS / GROUP_SEG];
+    _Atomic uint32_t group_count;
+    _Atomic uint64_t block_count;
+    pthread_mutex_t bitmap_load_lock;
+
+    // 格式化时不清零inode表, 第一次在某个inode块中分配inode时才清零到这个块为止,
+    // 剩下的由后台线程限速清零; itable_lock串行化清零, 保证itable_zeroed之前的块都已清零
+    pthread_mutex_t itable_lock;
+    pthread_t itable_thread;
+    int itable_thread_running;
+    _Atomic int itable_stop;
+
+    // 后台写回线程: 每FLUSH_INTERVAL_MS醒来一次写回过期的脏块, 脏块太多时被写者提前唤醒;
+    // 每写回一轮广播flush_done, 唤醒被限流的写者
+    pthread_t flusher_thread;
+    int flusher_running;
+    int flusher_stop;
+    pthread_mutex_t flush_lock;
+    pthread_cond_t flush_wake;
+    pthread_cond_t flush_done;
+
+    // 串行化在线扩容
+    pthread_mutex_t resize_lock;
+
+    // 被修改过的块组, 写回时只写这些组的位图和描述符块, 不用遍历所有块组
+    uint32_t *dirty_groups;
+    uint32_t *flush_groups;
+    uint32_t dirty_group_num;
+    pthread_mutex_t dirty_groups_lock;
+
+    free_delta free_deltas[ALLOC_CPUS];
+    // 已经折叠进超级块的空闲计数和目录数, 加上各CPU的增量就是当前的空闲数
+    _Atomic int64_t folded_free_blocks;
+    _Atomic int64_t folded_free_inodes;
+    _Atomic int32_t dir_total;
+
+    // 已经写入缓存但还没有分配磁盘块的块数, 这些块在刷回时一定要能分配到
+    _Atomic int64_t delalloc_blocks;
+
+    reservation *reservations[INODE_LOCKS];
+
+    // inode读写锁: 目录的锁保护它的目录块, 文件的锁保护它的数据块, 两者都保护inode本身。
+    // inode数随镜像大小增长, 所以按编号散列到固定个数的锁上, 同时持有两个inode的锁的地方都要先放开一个
+    pthread_rwlock_t inode_locks[INODE_LOCKS];
+
+    // inode块锁, 按块号散列, 保护写inode时对inode块的读-改-写
+    pthread_mutex_t inode_block_locks[INODE_BLOCK_LOCKS];
+
+    _Atomic(cache_slot*) *icache;
+    _Atomic(cache_slot*) *dcache;
+
+    // 动态分配的inode chunk, 按CHUNK_SEG分段存放, 段在追加chunk时分配, 已发布的chunk的块号不再改变。
+    // 分配和释放动态inode, 追加chunk以及写回映射表都持有chunk_lock
+    _Atomic(chunk_entry*) chunk_table[(0x80000000u - DYNAMIC_INODE_BASE) / CHUNK_STRIDE / CHUNK_SEG];
+    uint32_t chunk_count;
+    uint32_t chunk_hint;                // 这之前的chunk都已用满
+    uint64_t *map_blocks;               // 映射表块的块号
+    uint8_t *map_dirty;                 // 映射表块是否需要写回
+    uint32_t map_block_num;
+    uint32_t map_block_cap;
+    pthread_mutex_t chunk_lock;
+
+    // 被多个文件共享的数据块的引用计数, 按块号散列, 由refcount_lock保护;
+    // 没有共享的块时shared_count为0, 写回和释放数据块时不用加锁查表
+    refcount_node *refcounts[REFCOUNT_HASH];
+    _Atomic uint32_t shared_count;
+    int refcount_dirty;
+    uint64_t *refcount_blocks;          // 磁盘上的引用计数表块, 按链表顺序
+    uint32_t refcount_block_num;
+    pthread_mutex_t refcount_lock;
+
+    // 尾块分配器: 按块号散列的尾块表, 每类一个有空闲槽的尾块链表, 以及尾块内容的缓存, 都由tail_lock保护
+    tail_block *tail_hash[TAIL_HASH];
+    tail_block *partial[TAIL_CLASSES];
+    tail_cached tail_cache[TAIL_CACHE];
+    uint32_t tail_count;
+    int tail_dirty;
+    uint64_t *tail_map_blocks;          // 磁盘上的尾块表块, 按链表顺序
+    uint32_t tail_map_num;
+    pthread_mutex_t tail_lock;
+
+    // 各文件的顺序读状态, 只在缓存未命中时由readahead_lock保护更新
+    readahead_state readahead[READAHEAD_SLOTS];
+    pthread_mutex_t readahead_lock;
+
+    // 只读挂载快照时所有修改都被拒绝, 也不写回超级块
+    int read_only;
+    // 串行化快照的创建和删除
+    pthread_mutex_t snapshot_lock;
+    // 修改文件系统的操作和后台写回持有读锁, 创建和删除快照持有写锁, 快照看到的是所有操作之间的一个时刻
+    pthread_rwlock_t snapshot_barrier;
+    // 最新快照的例外表, 没有快照时为NULL; 由cow_lock保护, 覆盖写和释放块时查找和追加
+    _Atomic(cow_table*) cow;
+    pthread_mutex_t cow_lock;
+    // 只读挂载快照时, 从该快照到最新快照依次排列的例外表, 读块时按顺序查找
+    cow_table **view;
+    int view_num;
+};
+
+static void release_all_reservations(filesys *fs, int except_id);
+static int claim_blocks(filesys *fs, uint64_t goal, int want, uint64_t *start);
+static void release_blocks(filesys *fs, uint64_t start, int n);
+static void release_blocks_nocow(filesys *fs, uint64_t start, int n);
+static int write_cow_table(filesys *fs);
+static int cow_unsynced(filesys *fs);
+static void start_flusher(filesys *fs);
+static void stop_flusher(filesys *fs);
+
+
+
+
+static pthread_rwlock_t* inode_lock_of(filesys *fs, int inode_id)
+{
+    return &fs->inode_locks[(uint32_t)inode_id % INODE_LOCKS];
+}
+
+
+static void inode_rdlock(filesys *fs, int inode_id)
+{
+    pthread_rwlock_rdlock(inode_lock_of(fs, inode_id));
+}
+
+
+static void inode_wrlock(filesys *fs, int inode_id)
+{
+    pthread_rwlock_wrlock(inode_lock_of(fs, inode_id));
+}
+
+
+static void inode_unlock(filesys *fs, int inode_id)
+{
+    pthread_rwlock_unlock(inode_lock_of(fs, inode_id));
+}
+
 
 /**
- * @brief 根据数据块号读取磁盘块, 读取内容存放到buf中
- * @return 读取失败返回-1, 成功返回0
+ * @brief 返回inode_id在两级表table中的槽
+ * @return 二级表还没有分配时, create为1则分配, 否则返回NULL
  */
-int read_block_from_disk(int block_id)
+static cache_slot* inode_slot(_Atomic(cache_slot*) *table, int inode_id, int create)
 {
-    int device_blocks[2];
-    device_blocks[0] = block_id*2;
-    device_blocks[1] = block_id*2 + 1;
-    if(!disk_read_block(device_blocks[0],buf) && !disk_read_block(device_blocks[1],buf+DEVICE_BLOCK_SIZE))
+    _Atomic(cache_slot*) *chunk = &table[inode_id / SLOT_CHUNK];
+    cache_slot *slots = atomic_load(chunk);
+    if(slots == NULL)
     {
-        return 0;
+        if(!create)
+            return NULL;
+        cache_slot *fresh = calloc(SLOT_CHUNK, sizeof(cache_slot));
+        if(atomic_compare_exchange_strong(chunk, &slots, fresh))
+            slots = fresh;
+        else
+            free(fresh);
     }
-    printf("fail to read block %d\n", block_id);
-    return -1;
+    return &slots[inode_id % SLOT_CHUNK];
 }
 
 
 /**
- * @brief 读取超级块, 存放到super_block_buf中
- * @return 读取失败返回-1, 成功返回0
+ * @brief 第g组的描述符
  */
-int read_spblock_from_disk()
+static group_desc* desc_at(filesys *fs, uint32_t g)
 {
+    return &atomic_load(&fs->desc_table[g / GROUP_SEG])[g % GROUP_SEG];
+}
 
-    if(read_block_from_disk(SUPER_BLOCK_INDEX)!=0)
-    {
-        printf("fail to read super block\n");
-        return -1;
-    }
-    memcpy(&super_block_buf, buf, BLOCK_SIZE);
-    return 0;
+
+/**
+ * @brief 第g组的空闲摘要和位图
+ */
+static group_info* group_at(filesys *fs, uint32_t g)
+{
+    return &atomic_load(&fs->group_table[g / GROUP_SEG])[g % GROUP_SEG];
 }
 
 
 /**
- * @brief 根据inode_id读取inode块, 并且将inode_id的值存放到inode_buf中
- * @return 读取失败返回NULL, 成功返回inode_id对应的inode
+ * @brief 第g组的第一个块的块号
  */
-inode* read_inode_block_from_disk(int inode_id)
+static uint64_t group_start(filesys *fs, uint32_t g)
 {
-    int inode_block_id = inode_id / INODE_NUMS_EACH_BLOCK + 1;
-    if(read_block_from_disk(inode_block_id) != 0)
-    {
-        printf("fail to read inode %d\n", inode_id);
-        return NULL;
-    }
-    memcpy(inode_buf, buf, BLOCK_SIZE);
-    return &(inode_buf[inode_id%INODE_NUMS_EACH_BLOCK]);
+    return (uint64_t)g * fs->geo.blocks_per_group;
 }
 
 
 /**
- * @brief 从磁盘中读取目录块,存放到dir_table中
- * @return 读取失败返回-1, 成功返回0
+ * @brief 第g组的描述符所在的块号, 即这一段描述符中第一个组的开头(第0组在超级块之后)
  */
-int read_dir_table_from_disk(int block_id)
+static uint64_t group_desc_block(filesys *fs, uint32_t g)
 {
-    if(read_block_from_disk(block_id) != 0)
-    {
-        printf("fail to read block %d\n", block_id);
-        return -1;
-    }
-    memcpy(dir_table, buf, BLOCK_SIZE);
+    uint32_t first = g - g % fs->geo.descs_each_block;
+    return group_start(fs, first) + (first == 0 ? 1 : 0);
 }
 
 
 /**
- * @brief 将buf的内容写入到磁盘中
- * @return 写入成功返回0, 失败返回-1
+ * @brief 第g组第一个元数据块(块位图)的块号
  */
-int write_block_to_disk(int block_id)
+static uint64_t group_meta_block(filesys *fs, uint32_t g)
 {
-    int device_block[2];
-    device_block[0] = block_id*2;
-    device_block[1] = block_id*2 + 1;
-    if(!disk_write_block(device_block[0], buf) && !disk_write_block(device_block[1], buf+DEVICE_BLOCK_SIZE))
-    {
-        return 0;
-    }
-    return -1;
+    uint64_t block = group_start(fs, g) + (g == 0 ? 1 : 0);
+    if(g % fs->geo.descs_each_block == 0)
+        block++;
+    return block;
 }
 
 
 /**
- * @brief 将超级块写入到磁盘中
- * @return 写入成功返回0, 失败返回-1
+ * @brief 动态分配的inode_id所在的chunk
  */
-int write_spblock_to_disk()
+static chunk_entry* chunk_of(filesys *fs, int inode_id)
 {
-    memcpy(buf, &super_block_buf, BLOCK_SIZE);
-    
-    if(!write_block_to_disk(SUPER_BLOCK_INDEX))
-    {
-        return 0;
-    }
-    
-    printf("fail to write superblock to disk\n");
-    return -1;
+    uint32_t c = (inode_id - DYNAMIC_INODE_BASE) / CHUNK_STRIDE;
+    return &atomic_load(&fs->chunk_table[c / CHUNK_SEG])[c % CHUNK_SEG];
 }
 
 
 /**
- * @brief 将inode块写入到磁盘中
- * @return 写入成功返回0, 失败返回-1
+ * @brief inode_id所在的inode块的块号
  */
-int write_inode_block_to_disk(int inode_id)
+static uint64_t inode_block_of(filesys *fs, int inode_id)
 {
-    int block_id = inode_id/INODE_NUMS_EACH_BLOCK + 1;
-    memcpy(buf, inode_buf, BLOCK_SIZE);
-    if(!write_block_to_disk(block_id))
-        return 0;
-    printf("fail to write superblock to disk\n");
-    return -1;
+    if(inode_id >= DYNAMIC_INODE_BASE)
+        return chunk_of(fs, inode_id)->block;
+    uint32_t g = inode_id / fs->geo.inodes_per_group;
+    return desc_at(fs, g)->inode_table + inode_id % fs->geo.inodes_per_group / fs->geo.inodes_each_block;
 }
 
 
 /**
- * @brief 将dir_table块写入到磁盘中
- * @return 写入成功返回0, 失败返回-1
+ * @brief inode_id在它的inode块中的序号
  */
-int write_dir_table_to_disk(int block_id)
+static uint32_t inode_index_of(filesys *fs, int inode_id)
 {
-    memcpy(buf, dir_table, BLOCK_SIZE);
-    if(!write_block_to_disk(block_id))
-        return 0;
-    printf("fail to write superblock to disk\n");
-    return -1;
+    if(inode_id >= DYNAMIC_INODE_BASE)
+        return (inode_id - DYNAMIC_INODE_BASE) % CHUNK_STRIDE;
+    return inode_id % fs->geo.inodes_each_block;
 }
 
 
 /**
- * @brief 初始化文件系统
- * @return 成功初始化返回0
+ * @brief inode_id所在的块组, 动态分配的inode属于它的chunk块所在的组
  */
-void filesys_init()
+static uint32_t inode_group(filesys *fs, int inode_id)
 {
-    read_spblock_from_disk();
-    if(super_block_buf.magic_num == SYS_MAGIC_NUM)
-        return ; 
-    else
-    {
-        // init super_block
-        super_block_buf.magic_num = SYS_MAGIC_NUM; //180110318
-        super_block_buf.free_block_count = 4062; //4096-32-1-1
-        super_block_buf.free_inode_count = 1023; //1024-1
-        super_block_buf.dir_inode_count = 1;
-        memset(super_block_buf.block_map, 0, 128);
-        memset(super_block_buf.inode_map, 0, 32);
-        super_block_buf.block_map[0] = ~0;
-        super_block_buf.block_map[1] = 0xc0000000;
-        super_block_buf.inode_map[0] = 0x80000000;
-        write_spblock_to_disk();
+    if(inode_id >= DYNAMIC_INODE_BASE)
+        return chunk_of(fs, inode_id)->block / fs->geo.blocks_per_group;
+    return inode_id / fs->geo.inodes_per_group;
+}
 
-        // init inode block
-        inode* root_inode = read_inode_block_from_disk(0);
-        root_inode->size = 1;
-        root_inode->file_type = TYPE_FOLDER;
-        root_inode->link = 0;
-        root_inode->block_point[0] = 33;
-        write_inode_block_to_disk(0);
 
-        //init root data block
-        read_dir_table_from_disk(33);
-        dir_table[0].inode_id = 0;
-        dir_table[0].valid = DIR_VALID;
-        dir_table[0].type = TYPE_FOLDER;
-        strcpy(dir_table->name, ".");
-    }
-    return;
+static pthread_mutex_t* inode_block_lock_of(filesys *fs, int inode_id)
+{
+    return &fs->inode_block_locks[inode_block_of(fs, inode_id) % INODE_BLOCK_LOCKS];
 }
 
 
 /**
- * @brief 关闭文件系统
- * @return 
+ * @brief 在例外表t中查找块block
+ * @return 快照中这个块的内容所在的块, 不在表中返回0
  */
-void shutdown()
+static uint64_t cow_lookup(cow_table *t, uint64_t block)
 {
-    printf("shutdown the file system ...\n");
-    if(close_disk() >= 0)
-    {
-        printf("Successfully to shutdown the file system\n");
-    }
-    else
+    for(uint32_t i=t->buckets[block % COW_HASH]; i != 0; i = t->chain[i-1])
     {
-        printf("fail to shutdown the file system\n");
+        if(t->entries[i-1].block == block)
+            return t->entries[i-1].copy;
     }
-    exit(0);
+    return 0;
 }
 
 
 /**
- * @brief 获取空闲inode
- * @return 成功初始化返回inode的id,失败返回-1
+ * @brief 在例外表t中加入一项: 快照中块block的内容在copy中
  */
-int get_free_inode()
+static void cow_insert(cow_table *t, uint64_t block, uint64_t copy)
 {
-    read_spblock_from_disk();
-    if(super_block_buf.free_inode_count==0)
-    {
-        printf("No more inodes\n");
-        return -1;
-    }
-
-    int mask;
-    for(int i=0; i<32; i++)
+    if(t->count == t->cap)
     {
-        mask = 0x80000000;
-        for(int j=0; j<32; j++)
-        {
-            if(mask & super_block_buf.inode_map[i])
-            {
-                mask >>= 1;
-                continue;
-            }
-            else
-            {
-                super_block_buf.inode_map[i] |= mask;
-                super_block_buf.free_inode_count -= 1;
-                write_spblock_to_disk();
-                return i*32+j;
-            }    
-        }
+        t->cap = t->cap > 0 ? t->cap*2 : 64;
+        t->entries = realloc(t->entries, t->cap * sizeof(cow_entry));
+        t->chain = realloc(t->chain, t->cap * sizeof(uint32_t));
     }
+    t->entries[t->count].block = block;
+    t->entries[t->count].copy = copy;
+    t->chain[t->count] = t->buckets[block % COW_HASH];
+    t->buckets[block % COW_HASH] = ++t->count;
 }
 
 
 /**
- * @brief 获取空闲块, block_num为要获取的块数, 获得的block_id存到block_index中
- * @return 成功返回0, 失败返回-1
+ * @brief 快照中块block的内容所在的块, chain为从该快照到最新快照依次排列的num个例外表
  */
-int get_free_block(int block_num, int* blocks_index)
+static uint64_t cow_resolve(cow_table **chain, int num, uint64_t block)
 {
-    read_spblock_from_disk();
-    if(super_block_buf.free_block_count < block_num)
+    for(int i=0; i<num; i++)
     {
-        printf("No enough free blocks\n");
-        return -1;
+        uint64_t copy = cow_lookup(chain[i], block);
+        if(copy != 0)
+            return copy;
     }
+    return block;
+}
+
 
-    int mask;
-    for(int i=0; i<128; i++)
+/**
+ * @brief 根据数据块号读取磁盘块, 读取内容存放到buf中
+ * @return 读取失败返回-1, 成功返回0
+ */
+int read_block_from_disk(filesys *fs, uint64_t block_id, char *buf)
+{
+    uint32_t device_blocks = fs->geo.block_size / DEVICE_BLOCK_SIZE;
+    block_id = cow_resolve(fs->view, fs->view_num, block_id);
+    if(!disk_read_blocks(fs->disk, block_id*device_blocks, device_blocks, buf))
     {
-        mask = 0x80000000;
-        for(int j=0; j<32; j++)
-        {
-            if(mask & super_block_buf.block_map[i])
-            {
-                mask >>= 1;
-                continue;
-            }
-            else
-            {
-                super_block_buf.block_map[i] |= mask;
-                super_block_buf.free_block_count -= 1;
-                *blocks_index = i*32+j;
-                block_num -= 1;
-                if(block_num ==0)
-                {
-                    write_spblock_to_disk();
-                    return 0;
-                }
-                else
-                {
-                    blocks_index ++;
-                }  
-            }
-            
-        }
+        return 0;
     }
+    printf("fail to read block %llu\n", (unsigned long long)block_id);
+    return -1;
 }
 
 
 /**
- * @brief 找到上一级目录的inode_id
- * @return 成功初始化返回inode_id, 失败返回-1
+ * @brief 读取num个块号为blocks[i]的块, 依次存放到buf中, 块号连续的块合并成一次读取, 块号为0的位置填0
+ * @return 读取失败返回-1, 成功返回0
  */
-int find_prev_path(char *path, char *name)
+static int read_blocks_from_disk(filesys *fs, const uint64_t *blocks, int num, char *buf)
 {
-    int i=0;
-    int j=0;
-    int inode_id=0;
-
-    i = path[0]=='/' ? 1:0;
-    while(path[i] != '\0')
+    uint32_t bs = fs->geo.block_size;
+    uint32_t device_blocks = bs / DEVICE_BLOCK_SIZE;
+    for(int i=0; i<num; )
     {
-        if(path[i]!='/')
+        // 挂载快照时块号要逐个经过例外表, 不能合并
+        if(blocks[i] != 0 && fs->view_num > 0)
         {
-            name[j++] = path[i];
+            if(read_block_from_disk(fs, blocks[i], buf + (size_t)i*bs) != 0)
+                return -1;
+            i++;
+            continue;
         }
-
-        if(path[i]=='/' && path[i+1]=='\0')
+        if(blocks[i] == 0)
         {
-            name[j] = '\0';
-            break;
+            memset(buf + (size_t)i*bs, 0, bs);
+            i++;
+            continue;
         }
-
-        if(path[i]=='/'&&path[i+1]!='\0')
+        int n = 1;
+        while(i+n < num && blocks[i+n] == blocks[i] + n)
+            n++;
+        if(disk_read_blocks(fs->disk, blocks[i]*device_blocks, n*device_blocks, buf + (size_t)i*bs) != 0)
         {
-            name[j] = '\0';
-            j=0;
-            inode* inode_tmp = read_inode_block_from_disk(inode_id);
-            int success = 0;
-            for(int k=0; k<inode_tmp->size; k++)
-            {
-                read_dir_table_from_disk(inode_tmp->block_point[k]);
-                for(int l=0; l<8; l++)
-                {
-                    if(dir_table[l].valid==DIR_VALID
-                        && dir_table[l].type==TYPE_FOLDER
-                        && !strcmp(dir_table[l].name, name))
-                        {
-                            inode_id = dir_table[l].inode_id;
-                            success = 1;
-                            k = inode_tmp->size;
-                        }
-                }
-            }
-
-            if(!success)
-            {
-                // printf("Directory doesn't exist\n");
-                // name[j] = '\0';
-                return -1;
-            }
+            printf("fail to read block %llu\n", (unsigned long long)blocks[i]);
+            return -1;
         }
-        i++;
+        i += n;
     }
-    name[j] = '\0';
-    return inode_id; 
+    return 0;
 }
 
 
 /**
- * @brief 找到当前目录的inode_id
- * @return 成功初始化返回inode_id, 失败返回-1
+ * @brief 取得元数据块(inode表块或目录块)block_id的句柄, 不在缓存中时从磁盘读入
+ * @return 成功返回被引用的缓存块, 可以直接在data上读写inode或dir_item; 读取失败返回NULL
+ * @note 调用者需要持有保护该块的inode块锁或目录锁, 用完后调用put_meta_block()
  */
-int find_cur_path(char *path, char *name)
+static cache_buf* get_meta_block(filesys *fs, uint64_t block_id)
 {
-    int i=0;
-    int j=0;
-    int inode_id=0;
-
-    i = path[0]=='/' ? 1:0;
-    while(path[i] != '\0')
+    int created;
+    cache_buf *buf = cache_get(fs->cache, CACHE_META_OWNER, block_id, block_id, &created);
+    if(created)
     {
-        if(path[i]!='/')
-        {
-            name[j++] = path[i];
-        }
+        int ok = read_block_from_disk(fs, block_id, buf->data) == 0;
+        cache_loaded(fs->cache, buf, ok);
+        if(!ok)
+            return NULL;
+    }
+    return buf;
+}
 
-        if(path[i]=='/' || path[i+1]=='\0')
-        {
-            name[j] = '\0';
-            j=0;
-            inode* inode_tmp = read_inode_block_from_disk(inode_id);
-            int success = 0;
-            for(int k=0; k<inode_tmp->size; k++)
-            {
-                read_dir_table_from_disk(inode_tmp->block_point[k]);
-                for(int l=0; l<8; l++)
-                {
-                    if(dir_table[l].valid==DIR_VALID
-                        && dir_table[l].type==TYPE_FOLDER
-                        && !strcmp(dir_table[l].name, name))
-                        {
-                            inode_id = dir_table[l].inode_id;
-                            success = 1;
-                            k = inode_tmp->size;
-                        }
-                }
-            }
 
-            if(!success)
-            {
-                // name[j] = '\0';
-                return -1;
-            }
-        }
+/**
+ * @brief 取得新分配的元数据块block_id的句柄, 内容清零, 不读磁盘
+ */
+static cache_buf* get_new_meta_block(filesys *fs, uint64_t block_id)
+{
+    int created;
+    cache_buf *buf = cache_get(fs->cache, CACHE_META_OWNER, block_id, block_id, &created);
+    memset(buf->data, 0, fs->geo.block_size);
+    if(created)
+        cache_loaded(fs->cache, buf, 1);
+    return buf;
+}
 
-        i++;
+
+/**
+ * @brief 释放get_meta_block()取得的句柄
+ */
+static void put_meta_block(filesys *fs, cache_buf *buf)
+{
+    cache_release(fs->cache, buf);
+}
+
+
+/**
+ * @brief 将buf的内容写入到磁盘中, 不经过快照的写前复制
+ * @return 写入成功返回0, 失败返回-1
+ * @note 该块在缓冲区缓存的元数据类别中时同时更新, 块被释放后重新使用时也不会读到旧内容
+ */
+static int write_block_nocow(filesys *fs, uint64_t block_id, char *buf)
+{
+    uint32_t device_blocks = fs->geo.block_size / DEVICE_BLOCK_SIZE;
+    if(!disk_write_blocks(fs->disk, block_id*device_blocks, device_blocks, buf))
+    {
+        cache_update(fs->cache, CACHE_META_OWNER, block_id, buf);
+        return 0;
     }
-    // name[j] = '\0';
-    return inode_id; 
+    return -1;
 }
 
 
 /**
- * @brief 找到file的inode_id
- * @return 成功初始化返回inode_id, 失败返回-1
+ * @brief 新建一个空的例外表, block_count为快照创建时的总块数
  */
-int find_cur_file(char *path, char *name)
+static cow_table* new_cow_table(filesys *fs, uint64_t block_count)
 {
-    int i=0;
-    int j=0;
-    int inode_id=0;
+    cow_table *t = calloc(1, sizeof(cow_table));
+    t->block_count = block_count;
+    t->map_count = (block_count + fs->geo.blocks_per_group - 1) / fs->geo.blocks_per_group;
+    t->maps = calloc(t->map_count, sizeof(uint32_t*));
+    return t;
+}
 
-    i = path[0]=='/' ? 1:0;
-    while(path[i] != '\0')
-    {
-        if(path[i]!='/')
-        {
-            name[j++] = path[i];
-        }
 
-        if(path[i]=='/' &&path[i+1]!='\0')
-        {
-            name[j] = '\0';
-            j=0;
-            inode* inode_tmp = read_inode_block_from_disk(inode_id);
-            int success = 0;
-            for(int k=0; k<inode_tmp->size; k++)
-            {
-                read_dir_table_from_disk(inode_tmp->block_point[k]);
-                for(int l=0; l<8; l++)
-                {
-                    if(dir_table[l].valid==DIR_VALID
-                        && dir_table[l].type==TYPE_FOLDER
-                        && !strcmp(dir_table[l].name, name))
-                        {
-                            inode_id = dir_table[l].inode_id;
-                            success = 1;
-                            k = inode_tmp->size;
-                        }
-                }
-            }
+static void free_cow_table(cow_table *t)
+{
+    if(t == NULL)
+        return;
+    for(uint32_t g=0; g<t->map_count; g++)
+        free(t->maps[g]);
+    free(t->maps);
+    free(t->entries);
+    free(t->chain);
+    free(t->blocks);
+    free(t);
+}
 
-            if(!success)
-            {
-                // printf("Directory %s doesn't exist\n", name);
-                return -1;
-            }
-        }
 
-        // 最后一级
-        if(path[i+1] == '\0')
-        {
-            name[j] = 0;
-            inode* inode_tmp = read_inode_block_from_disk(inode_id);
-            int success = 0;
-            for(int k=0; k<inode_tmp->size; k++)
-            {
-                read_dir_table_from_disk(inode_tmp->block_point[k]);
-                for(int l=0; l<8; l++)
-                {
-                    if(dir_table[l].valid==DIR_VALID
-                        && dir_table[l].type==TYPE_FILE
-                        && !strcmp(dir_table[l].name, name))
-                        {
-                            inode_id = dir_table[l].inode_id;
-                            success = 1;
-                            k = inode_tmp->size;
-                        }
-                }
-            }
+/**
+ * @brief 构造第g组未初始化的块位图: 只有组开头到first_data_block之前的元数据块被占用
+ */
+static void build_uninit_bitmap(filesys *fs, uint32_t g, uint64_t first_data_block, char *buf)
+{
+    memset(buf, 0, fs->geo.block_size);
+    uint32_t used = first_data_block - group_start(fs, g);
+    uint32_t *words = (uint32_t*)buf;
+    for(uint32_t b=0; b<used; b++)
+        words[b/32] |= 0x80000000u >> (b%32);
+}
 
-            if(!success)
-            {
-                // name[j] = '\0';
-                return -1;
-            }
-        }
 
-        i++;
+/**
+ * @brief 块block在创建快照chain[0]时是否已被占用; chain为从该快照到最新快照依次排列的num个例外表,
+ *        用来读出快照中的描述符和块位图, 读出的位图缓存在chain[0]中
+ * @return 已占用返回1, 空闲返回0, 读取失败时当作已占用
+ * @note 调用者需要持有cow_lock; 创建快照时位图已经全部写回, 快照中的位图就是那一时刻的分配情况
+ */
+static int cow_was_used(filesys *fs, cow_table **chain, int num, uint64_t block)
+{
+    cow_table *t = chain[0];
+    if(block >= t->block_count)
+        return 0;
+    uint32_t g = block / fs->geo.blocks_per_group;
+    if(t->maps[g] == NULL)
+    {
+        char buf[fs->geo.block_size];
+        if(read_block_from_disk(fs, cow_resolve(chain, num, group_desc_block(fs, g)), buf) != 0)
+            return 1;
+        group_desc desc = ((group_desc*)buf)[g % fs->geo.descs_each_block];
+        if(desc.flags & GROUP_BLOCK_UNINIT)
+            build_uninit_bitmap(fs, g, desc.first_data_block, buf);
+        else if(read_block_from_disk(fs, cow_resolve(chain, num, desc.block_bitmap), buf) != 0)
+            return 1;
+        t->maps[g] = malloc(fs->geo.block_size);
+        memcpy(t->maps[g], buf, fs->geo.block_size);
     }
-    // name[j] = '\0';
-    return inode_id; 
+    uint32_t bit = block % fs->geo.blocks_per_group;
+    return (t->maps[g][bit/32] & (0x80000000u >> (bit%32))) != 0;
 }
 
 
 /**
- * @brief 给目标文件或文件夹创建dir_item
- * @param prev_path_inode_id为上一级目录的inode_id
- * @param inode_prev_path为上一级目录的inode
- * @param block_id为创建的dir_item所在的目录块号
- * @param dir_item_index为创建的dir_item在目录快的位置
- * @return 成功初始化返回0, 失败返回-1
+ * @brief 覆盖写从start开始的n个块之前, 把其中创建最新快照时已占用并且之后还没有复制过的块复制到新块,
+ *        记入最新快照的例外表
+ * @return 成功返回0, 读写失败或空间不足返回-1, 这时不能覆盖写
+ * @note 创建快照和写回超级块都持有sb_lock, 不持有快照屏障的写入(写回超级块)也不会和创建快照交错
  */
-int create_dir_item(int prev_path_inode_id, inode *inode_prev_path, int*block_id, int*dir_item_index)
+static int cow_preserve(filesys *fs, uint64_t start, int n)
 {
-    int success=0;
-
-    //优先从上一级目录中已有的目录块找到空闲的dir_item.
-    for(int i=0; i<6; i++)
+    if(atomic_load(&fs->cow) == NULL)
+        return 0;
+    pthread_mutex_lock(&fs->cow_lock);
+    cow_table *t = atomic_load(&fs->cow);
+    char buf[fs->geo.block_size];
+    int ret = 0;
+    for(uint64_t b=start; t != NULL && b<start+n && ret == 0; b++)
     {
-        if(inode_prev_path->block_point[i] != 0 && !success)
+        if(cow_lookup(t, b) != 0 || !cow_was_used(fs, &t, 1, b))
+            continue;
+        // 新块在创建快照时一定是空闲的(快照占用的块释放时不放回位图), 写它不用再复制
+        uint64_t copy;
+        if(claim_blocks(fs, b, 1, &copy) == 0)
         {
-            read_dir_table_from_disk(inode_prev_path->block_point[i]);
-            for(int j=0; j<DIR_ITEMS_EACH_BLOCK; j++)
-            {
-                if(dir_table[j].valid==DIR_INVALID)
-                {
-                    inode_prev_path->size++;
-                    write_inode_block_to_disk(prev_path_inode_id);
-                    *block_id = inode_prev_path->block_point[i];
-                    *dir_item_index = j;
-                    success = 1;
-                    return 0;
-                }
-            }
+            printf("No enough free blocks for the snapshot\n");
+            ret = -1;
+        }
+        else if(read_block_from_disk(fs, b, buf) != 0 || write_block_nocow(fs, copy, buf) != 0)
+        {
+            release_blocks_nocow(fs, copy, 1);
+            ret = -1;
         }
+        else
+            cow_insert(t, b, copy);
     }
+    pthread_mutex_unlock(&fs->cow_lock);
+    return ret;
+}
+
+
+/**
+ * @brief 释放块block之前检查它是否还在最新快照中, 是则直接记为快照的块, 不放回位图
+ * @return 块留给了快照返回1, 可以释放返回0
+ */
+static int cow_keep(filesys *fs, uint64_t block)
+{
+    if(atomic_load(&fs->cow) == NULL)
+        return 0;
+    pthread_mutex_lock(&fs->cow_lock);
+    cow_table *t = atomic_load(&fs->cow);
+    int keep = t != NULL && cow_lookup(t, block) == 0 && cow_was_used(fs, &t, 1, block);
+    if(keep)
+        cow_insert(t, block, block);
+    pthread_mutex_unlock(&fs->cow_lock);
+    return keep;
+}
+
+
+/**
+ * @brief 标记元数据块被修改; 元数据是直写的, 直接从缓存块写回磁盘
+ * @return 写入成功返回0, 失败返回-1
+ */
+static int mark_meta_dirty(filesys *fs, cache_buf *buf)
+{
+    uint32_t device_blocks = fs->geo.block_size / DEVICE_BLOCK_SIZE;
+    if(cow_preserve(fs, buf->block_id, 1) == 0 && !disk_write_blocks(fs->disk, buf->block_id*device_blocks, device_blocks, buf->data))
+        return 0;
+    printf("fail to write block %llu\n", (unsigned long long)buf->block_id);
+    return -1;
+}
+
+
+/**
+ * @brief 读取超级块, 存放到super_block_buf中
+ * @note 超级块在磁盘的开头, 这时还不知道块大小, 只读取开头的SUPER_BLOCK_SIZE字节
+ * @return 读取失败返回-1, 成功返回0
+ */
+int read_spblock_from_disk(filesys *fs)
+{
+    char buf[SUPER_BLOCK_SIZE];
+    // 挂载快照时已经知道块大小, 超级块所在的块也要经过例外表
+    uint64_t start = SUPER_BLOCK_INDEX;
+    if(fs->view_num > 0)
+        start = cow_resolve(fs->view, fs->view_num, SUPER_BLOCK_INDEX) * (fs->geo.block_size / DEVICE_BLOCK_SIZE);
+    if(disk_read_blocks(fs->disk, start, SUPER_BLOCK_SIZE/DEVICE_BLOCK_SIZE, buf)!=0)
+    {
+        printf("fail to read super block\n");
+        return -1;
+    }
+    memcpy(&fs->super_block_buf, buf, sizeof(sp_block));
+    return 0;
+}
+
+
+/**
+ * @brief 发布inode_id的新版本node到icache, 旧版本延迟释放
+ * @note 调用者需要持有该inode所在inode块的锁
+ */
+static void icache_publish(filesys *fs, int inode_id, inode *node)
+{
+    inode *cached = malloc(sizeof(inode));
+    *cached = *node;
+    epoch_retire(atomic_exchange(inode_slot(fs->icache, inode_id, 1), cached));
+}
+
+
+/**
+ * @brief 读取inode_id对应的inode, 存放到node中
+ * @return 读取失败返回-1, 成功返回0
+ * @note 命中icache时不加锁; 需要读到一致的inode时调用者应持有该inode的锁
+ */
+int read_inode(filesys *fs, int inode_id, inode *node)
+{
+    epoch_enter();
+    cache_slot *slot = inode_slot(fs->icache, inode_id, 0);
+    inode *cached = slot != NULL ? atomic_load(slot) : NULL;
+    if(cached != NULL)
+    {
+        *node = *cached;
+        epoch_exit();
+        return 0;
+    }
+    epoch_exit();
+
+    // 未命中: 持有inode块锁读取, 不会和write_inode交错
+    int ret = 0;
+    pthread_mutex_lock(inode_block_lock_of(fs, inode_id));
+    slot = inode_slot(fs->icache, inode_id, 0);
+    cached = slot != NULL ? atomic_load(slot) : NULL;
+    cache_buf *block = cached == NULL ? get_meta_block(fs, inode_block_of(fs, inode_id)) : NULL;
+    if(cached != NULL)
+        *node = *cached;
+    else if(block != NULL)
+    {
+        *node = ((inode*)block->data)[inode_index_of(fs, inode_id)];
+        put_meta_block(fs, block);
+        icache_publish(fs, inode_id, node);
+    }
+    else
+        ret = -1;
+    pthread_mutex_unlock(inode_block_lock_of(fs, inode_id));
+
+    if(ret != 0)
+        printf("fail to read inode %d\n", inode_id);
+    return ret;
+}
+
+
+/**
+ * @brief 从磁盘中读取目录块,存放到dir_table中
+ * @return 读取失败返回-1, 成功返回0
+ */
+int read_dir_table_from_disk(filesys *fs, uint64_t block_id, dir_item *dir_table)
+{
+    cache_buf *block = get_meta_block(fs, block_id);
+    if(block == NULL)
+    {
+        printf("fail to read block %llu\n", (unsigned long long)block_id);
+        return -1;
+    }
+    memcpy(dir_table, block->data, fs->geo.block_size);
+    put_meta_block(fs, block);
+    return 0;
+}
+
+
+/**
+ * @brief 将buf的内容写入到磁盘中, 块还在最新快照中时先复制出旧内容
+ * @return 写入成功返回0, 失败返回-1
+ * @note 该块在缓冲区缓存的元数据类别中时同时更新, 块被释放后重新使用时也不会读到旧内容
+ */
+int write_block_to_disk(filesys *fs, uint64_t block_id, char *buf)
+{
+    if(cow_preserve(fs, block_id, 1) != 0)
+        return -1;
+    return write_block_nocow(fs, block_id, buf);
+}
+
+
+/**
+ * @brief 把num个缓存块的内容写入从block_id开始的连续num个块, 合并成一次写入
+ * @return 写入成功返回0, 失败返回-1
+ */
+static int write_bufs_to_disk(filesys *fs, uint64_t block_id, cache_buf **bufs, int num)
+{
+    if(num == 1)
+        return write_block_to_disk(fs, block_id, bufs[0]->data);
+    if(cow_preserve(fs, block_id, num) != 0)
+        return -1;
+    uint32_t bs = fs->geo.block_size;
+    uint32_t device_blocks = bs / DEVICE_BLOCK_SIZE;
+    char *run = malloc((size_t)num * bs);
+    for(int i=0; i<num; i++)
+        memcpy(run + (size_t)i*bs, bufs[i]->data, bs);
+    int ret = disk_write_blocks(fs->disk, block_id*device_blocks, num*device_blocks, run) == 0 ? 0 : -1;
+    for(int i=0; i<num && ret == 0; i++)
+        cache_update(fs->cache, CACHE_META_OWNER, block_id + i, bufs[i]->data);
+    free(run);
+    return ret;
+}
+
+
+/**
+ * @brief 标记第g组需要写回
+ */
+static void mark_group_dirty(filesys *fs, uint32_t g)
+{
+    if(atomic_exchange(&group_at(fs, g)->dirty, 1) != 0)
+        return;
+    pthread_mutex_lock(&fs->dirty_groups_lock);
+    fs->dirty_groups[fs->dirty_group_num++] = g;
+    pthread_mutex_unlock(&fs->dirty_groups_lock);
+}
+
+
+static int cmp_group(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+
+/**
+ * @brief 将第g组所在的那一块描述符写入磁盘
+ * @return 写入成功返回0, 失败返回-1
+ * @note 调用者需要持有sb_lock; 组数以super_block_buf为准, 扩容时新组的描述符在分配器看到它们之前写入
+ */
+static int write_group_descs(filesys *fs, uint32_t g)
+{
+    char buf[fs->geo.block_size];
+    uint32_t count = fs->super_block_buf.group_count;
+    uint32_t first = g - g % fs->geo.descs_each_block;
+    uint32_t num = count - first < fs->geo.descs_each_block ? count - first : fs->geo.descs_each_block;
+    memset(buf, 0, fs->geo.block_size);
+    memcpy(buf, desc_at(fs, first), num*sizeof(group_desc));
+    return write_block_to_disk(fs, group_desc_block(fs, g), buf);
+}
+
+
+/**
+ * @brief 第c个chunk
+ * @note chunk所在的段在追加chunk时分配
+ */
+static chunk_entry* chunk_at(filesys *fs, uint32_t c)
+{
+    return &atomic_load(&fs->chunk_table[c / CHUNK_SEG])[c % CHUNK_SEG];
+}
+
+
+/**
+ * @brief 记录一个新的映射表块
+ * @note 调用者需要持有chunk_lock
+ */
+static void add_map_block_locked(filesys *fs, uint64_t block, int dirty)
+{
+    if(fs->map_block_num == fs->map_block_cap)
+    {
+        fs->map_block_cap = fs->map_block_cap > 0 ? fs->map_block_cap*2 : 16;
+        fs->map_blocks = realloc(fs->map_blocks, fs->map_block_cap * sizeof(uint64_t));
+        fs->map_dirty = realloc(fs->map_dirty, fs->map_block_cap);
+    }
+    fs->map_blocks[fs->map_block_num] = block;
+    fs->map_dirty[fs->map_block_num] = dirty;
+    fs->map_block_num++;
+}
+
+
+/**
+ * @brief 将被修改过的映射表块写入磁盘, 并把chunk数, 映射表的位置和新增chunk带来的inode数记入super_block_buf
+ * @return 写入成功返回0, 失败返回-1
+ * @note 调用者需要持有sb_lock
+ */
+static int write_chunk_map(filesys *fs)
+{
+    char buf[fs->geo.block_size];
+    chunk_map_head *head = (chunk_map_head*)buf;
+    chunk_entry *entries = (chunk_entry*)(head + 1);
+    uint32_t per = fs->geo.chunks_each_map_block;
+    int ret = 0;
+
+    pthread_mutex_lock(&fs->chunk_lock);
+    for(uint32_t i=0; i<fs->map_block_num; i++)
+    {
+        if(!fs->map_dirty[i])
+            continue;
+        memset(buf, 0, fs->geo.block_size);
+        head->next = i+1 < fs->map_block_num ? fs->map_blocks[i+1] : 0;
+        for(uint32_t c=i*per; c<fs->chunk_count && c<(i+1)*per; c++)
+            entries[c - i*per] = *chunk_at(fs, c);
+        if(write_block_to_disk(fs, fs->map_blocks[i], buf) == 0)
+            fs->map_dirty[i] = 0;
+        else
+            ret = -1;
+    }
+    fs->super_block_buf.inode_count += (fs->chunk_count - fs->super_block_buf.chunk_count) * fs->geo.inodes_each_chunk;
+    fs->super_block_buf.chunk_count = fs->chunk_count;
+    fs->super_block_buf.chunk_map = fs->map_block_num > 0 ? fs->map_blocks[0] : 0;
+    pthread_mutex_unlock(&fs->chunk_lock);
+    return ret;
+}
+
+
+/**
+ * @brief 在引用计数表中查找block
+ * @return 指向表项的链接, 不在表中时指向所在链的末尾(*link为NULL)
+ * @note 调用者需要持有refcount_lock
+ */
+static refcount_node** find_refcount_locked(filesys *fs, uint64_t block)
+{
+    refcount_node **link = &fs->refcounts[block % REFCOUNT_HASH];
+    while(*link != NULL && (*link)->block != block)
+        link = &(*link)->next;
+    return link;
+}
+
+
+/**
+ * @brief 引用数据块block的文件数, 不在引用计数表中的块为1
+ */
+static uint32_t block_refs(filesys *fs, uint64_t block)
+{
+    if(atomic_load(&fs->shared_count) == 0)
+        return 1;
+    pthread_mutex_lock(&fs->refcount_lock);
+    refcount_node *node = *find_refcount_locked(fs, block);
+    uint32_t refs = node != NULL ? node->refs : 1;
+    pthread_mutex_unlock(&fs->refcount_lock);
+    return refs;
+}
+
+
+/**
+ * @brief 增加一个对数据块block的引用
+ * @note 调用者需要持有一个引用该块的文件的锁, 保证它在这期间不会被释放
+ */
+static void ref_block(filesys *fs, uint64_t block)
+{
+    pthread_mutex_lock(&fs->refcount_lock);
+    refcount_node **link = find_refcount_locked(fs, block);
+    if(*link == NULL)
+    {
+        refcount_node *node = malloc(sizeof(refcount_node));
+        node->block = block;
+        node->refs = 1;
+        node->next = NULL;
+        *link = node;
+        atomic_fetch_add(&fs->shared_count, 1);
+    }
+    (*link)->refs++;
+    fs->refcount_dirty = 1;
+    pthread_mutex_unlock(&fs->refcount_lock);
+}
+
+
+/**
+ * @brief 去掉一个对数据块block的引用
+ * @return 这是最后一个引用, 调用者应该释放这个块时返回1, 否则返回0
+ */
+static int unref_block(filesys *fs, uint64_t block)
+{
+    if(atomic_load(&fs->shared_count) == 0)
+        return 1;
+    int last = 1;
+    pthread_mutex_lock(&fs->refcount_lock);
+    refcount_node **link = find_refcount_locked(fs, block);
+    if(*link != NULL)
+    {
+        last = 0;
+        // 只剩一个引用时从表中删除
+        if(--(*link)->refs == 1)
+        {
+            refcount_node *node = *link;
+            *link = node->next;
+            free(node);
+            atomic_fetch_sub(&fs->shared_count, 1);
+        }
+        fs->refcount_dirty = 1;
+    }
+    pthread_mutex_unlock(&fs->refcount_lock);
+    return last;
+}
+
+
+/**
+ * @brief 清空内存中的引用计数表
+ */
+static void reset_refcounts(filesys *fs)
+{
+    for(int h=0; h<REFCOUNT_HASH; h++)
+    {
+        while(fs->refcounts[h] != NULL)
+        {
+            refcount_node *node = fs->refcounts[h];
+            fs->refcounts[h] = node->next;
+            free(node);
+        }
+    }
+    fs->shared_count = 0;
+    fs->refcount_dirty = 0;
+    fs->refcount_block_num = 0;
+}
+
+
+/**
+ * @brief 引用计数表被修改过时整个重写到磁盘, 表块不够时追加, 多出来的释放;
+ *        并把项数和第一个表块记入super_block_buf
+ * @return 写入成功返回0, 失败返回-1, 失败时下一次写回会重试
+ * @note 调用者需要持有sb_lock; 表只记录共享的块, 通常很小
+ */
+static int write_refcounts(filesys *fs)
+{
+    pthread_mutex_lock(&fs->refcount_lock);
+    if(!fs->refcount_dirty)
+    {
+        pthread_mutex_unlock(&fs->refcount_lock);
+        return 0;
+    }
+    uint32_t per = fs->geo.refcounts_each_block;
+    uint32_t count = atomic_load(&fs->shared_count);
+    uint32_t need = (count + per - 1) / per;
+    if(fs->refcount_block_num < need)
+        fs->refcount_blocks = realloc(fs->refcount_blocks, need * sizeof(uint64_t));
+    while(fs->refcount_block_num < need)
+    {
+        uint64_t block;
+        if(claim_blocks(fs, 0, 1, &block) == 0)
+        {
+            pthread_mutex_unlock(&fs->refcount_lock);
+            printf("No enough free blocks for the refcount table\n");
+            return -1;
+        }
+        fs->refcount_blocks[fs->refcount_block_num++] = block;
+    }
+    while(fs->refcount_block_num > need)
+        release_blocks(fs, fs->refcount_blocks[--fs->refcount_block_num], 1);
+
+    char buf[fs->geo.block_size];
+    chunk_map_head *head = (chunk_map_head*)buf;
+    refcount_entry *entries = (refcount_entry*)(head + 1);
+    uint32_t b = 0, k = 0;
+    int ret = 0;
+    memset(buf, 0, fs->geo.block_size);
+    for(int h=0; h<REFCOUNT_HASH; h++)
+    {
+        for(refcount_node *node = fs->refcounts[h]; node != NULL; node = node->next)
+        {
+            entries[k].block = node->block;
+            entries[k].refs = node->refs;
+            if(++k < per)
+                continue;
+            head->next = b+1 < need ? fs->refcount_blocks[b+1] : 0;
+            ret |= write_block_to_disk(fs, fs->refcount_blocks[b++], buf);
+            memset(buf, 0, fs->geo.block_size);
+            k = 0;
+        }
+    }
+    if(k > 0)
+        ret |= write_block_to_disk(fs, fs->refcount_blocks[b], buf);
+    fs->super_block_buf.refcount_count = count;
+    fs->super_block_buf.refcount_map = need > 0 ? fs->refcount_blocks[0] : 0;
+    if(ret == 0)
+        fs->refcount_dirty = 0;
+    pthread_mutex_unlock(&fs->refcount_lock);
+    return ret;
+}
+
+
+/**
+ * @brief 清空内存中的尾块表和尾块缓存
+ */
+static void reset_tails(filesys *fs)
+{
+    for(int h=0; h<TAIL_HASH; h++)
+    {
+        while(fs->tail_hash[h] != NULL)
+        {
+            tail_block *tb = fs->tail_hash[h];
+            fs->tail_hash[h] = tb->hash_next;
+            free(tb);
+        }
+    }
+    for(int c=0; c<TAIL_CLASSES; c++)
+        fs->partial[c] = NULL;
+    for(int i=0; i<TAIL_CACHE; i++)
+    {
+        free(fs->tail_cache[i].data);
+        fs->tail_cache[i].data = NULL;
+        fs->tail_cache[i].block = 0;
+    }
+    fs->tail_count = 0;
+    fs->tail_dirty = 0;
+    fs->tail_map_num = 0;
+}
+
+
+/**
+ * @brief 把尾块tb加入表中, 有空闲槽时挂到所属类别的partial链表上
+ * @note 调用者需要持有tail_lock
+ */
+static void add_tail_locked(filesys *fs, tail_block *tb)
+{
+    tb->hash_next = fs->tail_hash[tb->block % TAIL_HASH];
+    fs->tail_hash[tb->block % TAIL_HASH] = tb;
+    tb->in_partial = 0;
+    if(tb->used_mask != (1u << tb->slots) - 1)
+    {
+        int c = __builtin_ctz(16 / tb->slots);
+        tb->partial_next = fs->partial[c];
+        fs->partial[c] = tb;
+        tb->in_partial = 1;
+    }
+    fs->tail_count++;
+}
+
+
+/**
+ * @brief 尾块表被修改过时整个重写到磁盘, 做法和write_refcounts()相同
+ * @return 写入成功返回0, 失败返回-1
+ * @note 调用者需要持有sb_lock
+ */
+static int write_tail_map(filesys *fs)
+{
+    pthread_mutex_lock(&fs->tail_lock);
+    if(!fs->tail_dirty)
+    {
+        pthread_mutex_unlock(&fs->tail_lock);
+        return 0;
+    }
+    uint32_t per = fs->geo.tails_each_block;
+    uint32_t need = (fs->tail_count + per - 1) / per;
+    if(fs->tail_map_num < need)
+        fs->tail_map_blocks = realloc(fs->tail_map_blocks, need * sizeof(uint64_t));
+    while(fs->tail_map_num < need)
+    {
+        uint64_t block;
+        if(claim_blocks(fs, 0, 1, &block) == 0)
+        {
+            pthread_mutex_unlock(&fs->tail_lock);
+            printf("No enough free blocks for the tail map\n");
+            return -1;
+        }
+        fs->tail_map_blocks[fs->tail_map_num++] = block;
+    }
+    while(fs->tail_map_num > need)
+        release_blocks(fs, fs->tail_map_blocks[--fs->tail_map_num], 1);
+
+    char buf[fs->geo.block_size];
+    chunk_map_head *head = (chunk_map_head*)buf;
+    tail_entry *entries = (tail_entry*)(head + 1);
+    uint32_t b = 0, k = 0;
+    int ret = 0;
+    memset(buf, 0, fs->geo.block_size);
+    for(int h=0; h<TAIL_HASH; h++)
+    {
+        for(tail_block *tb = fs->tail_hash[h]; tb != NULL; tb = tb->hash_next)
+        {
+            entries[k].block = tb->block;
+            entries[k].used_mask = tb->used_mask;
+            entries[k].slots = tb->slots;
+            if(++k < per)
+                continue;
+            head->next = b+1 < need ? fs->tail_map_blocks[b+1] : 0;
+            ret |= write_block_to_disk(fs, fs->tail_map_blocks[b++], buf);
+            memset(buf, 0, fs->geo.block_size);
+            k = 0;
+        }
+    }
+    if(k > 0)
+        ret |= write_block_to_disk(fs, fs->tail_map_blocks[b], buf);
+    fs->super_block_buf.tail_count = fs->tail_count;
+    fs->super_block_buf.tail_map = need > 0 ? fs->tail_map_blocks[0] : 0;
+    if(ret == 0)
+        fs->tail_dirty = 0;
+    pthread_mutex_unlock(&fs->tail_lock);
+    return ret;
+}
+
+
+/**
+ * @brief 将超级块, 以及被修改过的块组的位图和描述符写入到磁盘中,
+ *        写之前把各CPU的空闲计数增量和各块组的空闲摘要折叠进super_block_buf和描述符表
+ * @return 写入成功返回0, 失败返回-1
+ * @note 调用者需要持有sb_lock; 和分配并发时位图与计数可能短暂相差几个, 下一次写回会修正
+ */
+static int write_spblock_once(filesys *fs)
+{
+    char buf[fs->geo.block_size];
+    // 引用计数表, 尾块表和例外表最先写, 它们分配和释放的表块会在下面随位图一起写回
+    int ret = write_refcounts(fs);
+    ret |= write_tail_map(fs);
+    ret |= write_cow_table(fs);
+
+    for(int i=0; i<ALLOC_CPUS; i++)
+    {
+        fs->super_block_buf.free_block_count += atomic_exchange(&fs->free_deltas[i].blocks, 0);
+        fs->super_block_buf.free_inode_count += atomic_exchange(&fs->free_deltas[i].inodes, 0);
+    }
+    atomic_store(&fs->folded_free_blocks, fs->super_block_buf.free_block_count);
+    atomic_store(&fs->folded_free_inodes, fs->super_block_buf.free_inode_count);
+    fs->super_block_buf.dir_inode_count = atomic_load(&fs->dir_total);
+
+    pthread_mutex_lock(&fs->dirty_groups_lock);
+    uint32_t num = fs->dirty_group_num;
+    memcpy(fs->flush_groups, fs->dirty_groups, num*sizeof(uint32_t));
+    fs->dirty_group_num = 0;
+    pthread_mutex_unlock(&fs->dirty_groups_lock);
+
+    // 按组号排序, 同一块描述符只写一次
+    qsort(fs->flush_groups, num, sizeof(uint32_t), cmp_group);
+    for(uint32_t k=0; k<num; k++)
+    {
+        uint32_t g = fs->flush_groups[k];
+        atomic_store(&group_at(fs, g)->dirty, 0);
+        desc_at(fs, g)->free_block_count = atomic_load(&group_at(fs, g)->free_blocks);
+        desc_at(fs, g)->free_inode_count = atomic_load(&group_at(fs, g)->free_inodes);
+        desc_at(fs, g)->dir_count = atomic_load(&group_at(fs, g)->dirs);
+        desc_at(fs, g)->itable_zeroed = atomic_load(&group_at(fs, g)->itable_zeroed);
+
+        // 位图按字存放在位图块的开头, 被修改的位图一定已经加载; 位图写入后才清除未初始化标记
+        uint32_t *words = (uint32_t*)buf;
+        _Atomic uint32_t *map = atomic_load(&group_at(fs, g)->block_map);
+        if(map != NULL)
+        {
+            for(uint32_t i=0; i<fs->geo.blocks_per_group/32; i++)
+                words[i] = atomic_load(&map[i]);
+            if(write_block_to_disk(fs, desc_at(fs, g)->block_bitmap, buf) == 0)
+                desc_at(fs, g)->flags &= ~GROUP_BLOCK_UNINIT;
+            else
+                ret = -1;
+        }
+        map = atomic_load(&group_at(fs, g)->inode_map);
+        if(map != NULL)
+        {
+            memset(buf, 0, fs->geo.block_size);
+            for(uint32_t i=0; i<fs->geo.inodes_per_group/32; i++)
+                words[i] = atomic_load(&map[i]);
+            if(write_block_to_disk(fs, desc_at(fs, g)->inode_bitmap, buf) == 0)
+                desc_at(fs, g)->flags &= ~GROUP_INODE_UNINIT;
+            else
+                ret = -1;
+        }
+    }
+    for(uint32_t k=0; k<num; k++)
+    {
+        if(k + 1 == num || fs->flush_groups[k+1] / fs->geo.descs_each_block != fs->flush_groups[k] / fs->geo.descs_each_block)
+            ret |= write_group_descs(fs, fs->flush_groups[k]);
+    }
+
+    // 映射表在超级块之前写入, 超级块中的chunk数不会超过磁盘上的映射表
+    ret |= write_chunk_map(fs);
+
+    memset(buf, 0, fs->geo.block_size);
+    memcpy(buf, &fs->super_block_buf, sizeof(sp_block));
+    ret |= write_block_to_disk(fs, SUPER_BLOCK_INDEX, buf);
+
+    if(ret != 0)
+        printf("fail to write superblock to disk\n");
+    return ret;
+}
+
+
+/**
+ * @brief 写回超级块和所有被修改过的元数据, 见write_spblock_once
+ * @return 写入成功返回0, 失败返回-1
+ * @note 调用者需要持有sb_lock; 有快照时第一次覆盖写位图, 描述符和超级块也要复制旧内容并记入例外表,
+ *       复制占用的块要随位图写回, 所以再写一轮, 直到例外表没有新项; 每轮新复制的块越来越少, 最多写几轮
+ */
+int write_spblock_to_disk(filesys *fs)
+{
+    int ret = write_spblock_once(fs);
+    for(int round=0; ret == 0 && round<4 && cow_unsynced(fs); round++)
+        ret = write_spblock_once(fs);
+    return ret;
+}
+
+
+/**
+ * @brief 将node写入到inode_id对应的inode块中
+ * @return 写入成功返回0, 失败返回-1
+ * @note 调用者需要持有该inode的写锁(新申请的inode除外)
+ */
+int write_inode(filesys *fs, int inode_id, inode *node)
+{
+    int ret = -1;
+
+    pthread_mutex_lock(inode_block_lock_of(fs, inode_id));
+    cache_buf *block = get_meta_block(fs, inode_block_of(fs, inode_id));
+    if(block != NULL)
+    {
+        ((inode*)block->data)[inode_index_of(fs, inode_id)] = *node;
+        ret = mark_meta_dirty(fs, block);
+        put_meta_block(fs, block);
+    }
+    if(ret == 0)
+        icache_publish(fs, inode_id, node);
+    pthread_mutex_unlock(inode_block_lock_of(fs, inode_id));
+
+    if(ret != 0)
+        printf("fail to write inode %d to disk\n", inode_id);
+    return ret;
+}
+
+
+/**
+ * @brief 将dir_table块写入到磁盘中
+ * @return 写入成功返回0, 失败返回-1
+ */
+int write_dir_table_to_disk(filesys *fs, uint64_t block_id, dir_item *dir_table)
+{
+    if(!write_block_to_disk(fs, block_id, (char*)dir_table))
+        return 0;
+    printf("fail to write dir table %llu to disk\n", (unsigned long long)block_id);
+    return -1;
+}
+
+
+/**
+ * @brief 新建一个使用磁盘d的空实例, 初始化所有的锁; 几何参数和块组等到格式化或挂载时设置
+ */
+static filesys* alloc_fs(disk *d)
+{
+    filesys *fs = calloc(1, sizeof(filesys));
+    fs->disk = d;
+    pthread_mutex_init(&fs->sb_lock, NULL);
+    pthread_mutex_init(&fs->bitmap_load_lock, NULL);
+    pthread_mutex_init(&fs->itable_lock, NULL);
+    pthread_mutex_init(&fs->resize_lock, NULL);
+    pthread_mutex_init(&fs->dirty_groups_lock, NULL);
+    pthread_mutex_init(&fs->chunk_lock, NULL);
+    pthread_mutex_init(&fs->refcount_lock, NULL);
+    pthread_mutex_init(&fs->snapshot_lock, NULL);
+    // 默认读者优先: 持有读锁的写者等待后台写回时, 即使有快照在等写锁, 后台线程也能拿到读锁
+    pthread_rwlock_init(&fs->snapshot_barrier, NULL);
+    pthread_mutex_init(&fs->cow_lock, NULL);
+    pthread_mutex_init(&fs->tail_lock, NULL);
+    pthread_mutex_init(&fs->readahead_lock, NULL);
+    pthread_mutex_init(&fs->flush_lock, NULL);
+    pthread_cond_init(&fs->flush_wake, NULL);
+    pthread_cond_init(&fs->flush_done, NULL);
+    for(int i=0; i<READAHEAD_SLOTS; i++)
+        fs->readahead[i].inode_id = -1;
+    for(int i=0; i<INODE_LOCKS; i++)
+        pthread_rwlock_init(&fs->inode_locks[i], NULL);
+    for(int i=0; i<INODE_BLOCK_LOCKS; i++)
+        pthread_mutex_init(&fs->inode_block_locks[i], NULL);
+    return fs;
+}
+
+
+/**
+ * @brief 释放一个缓存的两级表和其中发布的所有版本
+ * @note 只在卸载时调用, 不会再有读者
+ */
+static void free_slots(_Atomic(cache_slot*) *table)
+{
+    if(table == NULL)
+        return;
+    for(uint32_t c=0; c<0x80000000u / SLOT_CHUNK; c++)
+    {
+        cache_slot *slots = atomic_load(&table[c]);
+        if(slots == NULL)
+            continue;
+        for(int i=0; i<SLOT_CHUNK; i++)
+            free(atomic_load(&slots[i]));
+        free(slots);
+    }
+    free(table);
+}
+
+
+/**
+ * @brief 释放实例占用的所有内存, 不关闭磁盘
+ * @note 调用者需要先停止后台线程并写回所有数据
+ */
+static void free_fs(filesys *fs)
+{
+    for(uint32_t s=0; s<MAX_GROUPS/GROUP_SEG && atomic_load(&fs->desc_table[s]) != NULL; s++)
+    {
+        group_info *infos = atomic_load(&fs->group_table[s]);
+        for(int i=0; i<GROUP_SEG; i++)
+        {
+            free(atomic_load(&infos[i].block_map));
+            free(atomic_load(&infos[i].inode_map));
+        }
+        free(infos);
+        free(atomic_load(&fs->desc_table[s]));
+    }
+    for(uint32_t s=0; s<sizeof(fs->chunk_table)/sizeof(fs->chunk_table[0]); s++)
+        free(atomic_load(&fs->chunk_table[s]));
+    free(fs->map_blocks);
+    free(fs->map_dirty);
+    reset_refcounts(fs);
+    free(fs->refcount_blocks);
+    reset_tails(fs);
+    free(fs->tail_map_blocks);
+    free(fs->dirty_groups);
+    free(fs->flush_groups);
+    free_cow_table(atomic_load(&fs->cow));
+    for(int i=0; i<fs->view_num; i++)
+        free_cow_table(fs->view[i]);
+    free(fs->view);
+    free_slots(fs->icache);
+    free_slots(fs->dcache);
+    if(fs->cache != NULL)
+        cache_free(fs->cache);
+    free(fs);
+}
+
+
+/**
+ * @brief 按块大小和每组inode数计算几何参数
+ * @return 成功返回0, 参数不合法返回-1
+ */
+static int setup_geometry(filesys *fs, uint32_t block_size, uint32_t inodes_per_group)
+{
+    if(block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE || (block_size & (block_size-1)) != 0)
+        return -1;
+    fs->geo.block_size = block_size;
+    fs->geo.blocks_per_group = block_size*8;
+    fs->geo.inodes_each_block = block_size / sizeof(inode);
+    fs->geo.descs_each_block = block_size / sizeof(group_desc);
+    fs->geo.dir_items_each_block = block_size / sizeof(dir_item);
+    fs->geo.inodes_each_chunk = fs->geo.inodes_each_block < CHUNK_STRIDE ? fs->geo.inodes_each_block : CHUNK_STRIDE;
+    fs->geo.chunks_each_map_block = (block_size - sizeof(chunk_map_head)) / sizeof(chunk_entry);
+    fs->geo.refcounts_each_block = (block_size - sizeof(chunk_map_head)) / sizeof(refcount_entry);
+    fs->geo.snapshots_each_block = block_size / sizeof(snapshot_entry);
+    fs->geo.cows_each_block = (block_size - sizeof(chunk_map_head)) / sizeof(cow_entry);
+    fs->geo.tails_each_block = (block_size - sizeof(chunk_map_head)) / sizeof(tail_entry);
+    // inode位图也只占一个块, 并且按整字分配
+    if(inodes_per_group == 0 || inodes_per_group % fs->geo.inodes_each_block != 0 || inodes_per_group % 32 != 0
+        || inodes_per_group > fs->geo.blocks_per_group)
+        return -1;
+    fs->geo.inodes_per_group = inodes_per_group;
+    fs->geo.inode_blocks_per_group = inodes_per_group / fs->geo.inodes_each_block;
+    if(fs->cache != NULL)
+        cache_free(fs->cache);
+    fs->cache = cache_new(block_size);
+    return 0;
+}
+
+
+/**
+ * @brief 为第from到第to-1组分配描述符和空闲摘要所在的段, 并扩大脏组列表
+ * @note 新分配的段已清零; 挂载后调用时调用者需要持有sb_lock
+ */
+static void grow_groups(filesys *fs, uint32_t from, uint32_t to)
+{
+    for(uint32_t s=from/GROUP_SEG; s<(to+GROUP_SEG-1)/GROUP_SEG; s++)
+    {
+        if(atomic_load(&fs->desc_table[s]) == NULL)
+            atomic_store(&fs->desc_table[s], calloc(GROUP_SEG, sizeof(group_desc)));
+        if(atomic_load(&fs->group_table[s]) == NULL)
+            atomic_store(&fs->group_table[s], calloc(GROUP_SEG, sizeof(group_info)));
+    }
+    pthread_mutex_lock(&fs->dirty_groups_lock);
+    fs->dirty_groups = realloc(fs->dirty_groups, to * sizeof(uint32_t));
+    pthread_mutex_unlock(&fs->dirty_groups_lock);
+    fs->flush_groups = realloc(fs->flush_groups, to * sizeof(uint32_t));
+}
+
+
+/**
+ * @brief 按块组数分配块组描述符, 空闲摘要以及inode缓存的一级表
+ */
+static void setup_groups(filesys *fs, uint32_t count)
+{
+    // 重新格式化时清空之前用过的段
+    for(uint32_t s=0; s<MAX_GROUPS/GROUP_SEG && atomic_load(&fs->desc_table[s]) != NULL; s++)
+    {
+        memset(atomic_load(&fs->desc_table[s]), 0, GROUP_SEG * sizeof(group_desc));
+        memset(atomic_load(&fs->group_table[s]), 0, GROUP_SEG * sizeof(group_info));
+    }
+    grow_groups(fs, 0, count);
+    fs->group_count = count;
+    fs->dirty_group_num = 0;
+
+    if(fs->icache == NULL)
+    {
+        fs->icache = calloc(0x80000000u / SLOT_CHUNK, sizeof(*fs->icache));
+        fs->dcache = calloc(0x80000000u / SLOT_CHUNK, sizeof(*fs->dcache));
+    }
+}
+
+
+/**
+ * @brief 按第g组的位置初始化它的描述符, end为组的结束块号; 位图和inode表都标记为未初始化
+ */
+static void init_group_desc(filesys *fs, uint32_t g, uint64_t end)
+{
+    group_desc *desc = desc_at(fs, g);
+    uint64_t meta = group_meta_block(fs, g);
+    desc->block_bitmap = meta;
+    desc->inode_bitmap = meta + 1;
+    desc->inode_table = meta + 2;
+    desc->first_data_block = meta + 2 + fs->geo.inode_blocks_per_group;
+    desc->block_count = end - group_start(fs, g);
+    desc->free_block_count = end - desc->first_data_block;
+    desc->free_inode_count = fs->geo.inodes_per_group;
+    desc->dir_count = 0;
+    desc->flags = GROUP_BLOCK_UNINIT | GROUP_INODE_UNINIT;
+    desc->itable_zeroed = 0;
+}
+
+
+/**
+ * @brief 从第g组的描述符初始化它的空闲摘要
+ */
+static void load_group_info(filesys *fs, uint32_t g)
+{
+    group_info *info = group_at(fs, g);
+    info->free_blocks = desc_at(fs, g)->free_block_count;
+    info->free_inodes = desc_at(fs, g)->free_inode_count;
+    info->dirs = desc_at(fs, g)->dir_count;
+    info->itable_zeroed = desc_at(fs, g)->itable_zeroed;
+}
+
+
+/**
+ * @brief 清空内存中的chunk表
+ */
+static void reset_chunks(filesys *fs)
+{
+    fs->chunk_count = 0;
+    fs->chunk_hint = 0;
+    fs->map_block_num = 0;
+}
+
+
+/**
+ * @brief 沿着映射表块链读取所有chunk
+ * @return 成功返回0, 读取失败或映射表不完整返回-1
+ */
+static int read_chunk_map(filesys *fs)
+{
+    char buf[fs->geo.block_size];
+    chunk_map_head *head = (chunk_map_head*)buf;
+    chunk_entry *entries = (chunk_entry*)(head + 1);
+
+    reset_chunks(fs);
+    uint64_t block = fs->super_block_buf.chunk_map;
+    while(fs->chunk_count < fs->super_block_buf.chunk_count && block != 0)
+    {
+        if(read_block_from_disk(fs, block, buf) != 0)
+            return -1;
+        add_map_block_locked(fs, block, 0);
+        for(uint32_t i=0; i<fs->geo.chunks_each_map_block && fs->chunk_count<fs->super_block_buf.chunk_count; i++)
+        {
+            if(atomic_load(&fs->chunk_table[fs->chunk_count / CHUNK_SEG]) == NULL)
+                atomic_store(&fs->chunk_table[fs->chunk_count / CHUNK_SEG], calloc(CHUNK_SEG, sizeof(chunk_entry)));
+            *chunk_at(fs, fs->chunk_count++) = entries[i];
+        }
+        block = head->next;
+    }
+    if(fs->chunk_count != fs->super_block_buf.chunk_count)
+    {
+        printf("inode chunk map is incomplete\n");
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief 沿着表块链读取引用计数表
+ * @return 成功返回0, 读取失败或表不完整返回-1
+ */
+static int read_refcounts(filesys *fs)
+{
+    char buf[fs->geo.block_size];
+    chunk_map_head *head = (chunk_map_head*)buf;
+    refcount_entry *entries = (refcount_entry*)(head + 1);
+
+    reset_refcounts(fs);
+    uint32_t count = 0;
+    uint64_t block = fs->super_block_buf.refcount_map;
+    while(count < fs->super_block_buf.refcount_count && block != 0)
+    {
+        if(read_block_from_disk(fs, block, buf) != 0)
+            return -1;
+        fs->refcount_blocks = realloc(fs->refcount_blocks, (fs->refcount_block_num+1) * sizeof(uint64_t));
+        fs->refcount_blocks[fs->refcount_block_num++] = block;
+        for(uint32_t i=0; i<fs->geo.refcounts_each_block && count<fs->super_block_buf.refcount_count; i++, count++)
+        {
+            refcount_node *node = malloc(sizeof(refcount_node));
+            node->block = entries[i].block;
+            node->refs = entries[i].refs;
+            node->next = fs->refcounts[node->block % REFCOUNT_HASH];
+            fs->refcounts[node->block % REFCOUNT_HASH] = node;
+        }
+        block = head->next;
+    }
+    fs->shared_count = count;
+    if(count != fs->super_block_buf.refcount_count)
+    {
+        printf("refcount table is incomplete\n");
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief 读取快照表
+ * @return 成功返回快照数, 失败返回-1
+ */
+static int read_snapshot_table(filesys *fs, snapshot_entry *table)
+{
+    uint32_t count = fs->super_block_buf.snapshot_count;
+    if(count == 0)
+        return 0;
+    char buf[fs->geo.block_size];
+    if(read_block_from_disk(fs, fs->super_block_buf.snapshot_table, buf) != 0)
+        return -1;
+    memcpy(table, buf, count * sizeof(snapshot_entry));
+    return count;
+}
+
+
+static int find_snapshot(snapshot_entry *table, int count, char *name)
+{
+    for(int i=0; i<count; i++)
+    {
+        if(!strncmp(table[i].name, name, SNAPSHOT_NAME_MAX))
+            return i;
+    }
+    return -1;
+}
+
+
+/**
+ * @brief 写回快照表, 还没有快照表块时先分配一个, 再更新super_block_buf
+ * @return 成功返回0, 失败返回-1
+ * @note 调用者需要持有sb_lock; 快照表块是创建第一个快照时才分配的, 不在任何快照的视图中, 直接写入
+ */
+static int write_snapshot_table(filesys *fs, snapshot_entry *table, uint32_t count)
+{
+    uint64_t block = fs->super_block_buf.snapshot_table;
+    if(block == 0 && claim_blocks(fs, 0, 1, &block) == 0)
+    {
+        printf("No enough free blocks for the snapshot table\n");
+        return -1;
+    }
+    char buf[fs->geo.block_size];
+    memset(buf, 0, fs->geo.block_size);
+    memcpy(buf, table, count * sizeof(snapshot_entry));
+    if(write_block_nocow(fs, block, buf) != 0)
+    {
+        if(fs->super_block_buf.snapshot_table == 0)
+            release_blocks_nocow(fs, block, 1);
+        return -1;
+    }
+    fs->super_block_buf.snapshot_table = block;
+    fs->super_block_buf.snapshot_count = count;
+    return 0;
+}
+
+
+/**
+ * @brief 沿着表块链读取快照entry的例外表
+ * @return 成功返回例外表, 读取失败或表不完整返回NULL
+ */
+static cow_table* load_cow_table(filesys *fs, snapshot_entry *entry)
+{
+    char buf[fs->geo.block_size];
+    chunk_map_head *head = (chunk_map_head*)buf;
+    cow_entry *entries = (cow_entry*)(head + 1);
+
+    cow_table *t = new_cow_table(fs, entry->block_count);
+    uint64_t block = entry->cow_map;
+    while(t->count < entry->cow_count && block != 0)
+    {
+        if(read_block_from_disk(fs, block, buf) != 0)
+        {
+            free_cow_table(t);
+            return NULL;
+        }
+        t->blocks = realloc(t->blocks, (t->block_num+1) * sizeof(uint64_t));
+        t->blocks[t->block_num++] = block;
+        for(uint32_t i=0; i<fs->geo.cows_each_block && t->count<entry->cow_count; i++)
+            cow_insert(t, entries[i].block, entries[i].copy);
+        block = head->next;
+    }
+    if(t->count != entry->cow_count)
+    {
+        printf("snapshot %s is incomplete\n", entry->name);
+        free_cow_table(t);
+        return NULL;
+    }
+    t->synced = t->count;
+    return t;
+}
+
+
+/**
+ * @brief 把例外表t中还没有写入磁盘的项追加到表块链中, 表块不够时先分配, 成功后记入快照表项entry
+ * @return 成功返回0, 失败返回-1
+ * @note 调用者需要持有cow_lock, 例外表的表块和复制出的块一样不在任何快照的视图中, 直接写入;
+ *       最后一个表块没有写满时追加的项和它原来的项一起重写, 新分配了表块时前一个块的next也要重写
+ */
+static int store_cow_table(filesys *fs, cow_table *t, snapshot_entry *entry)
+{
+    uint32_t per = fs->geo.cows_each_block;
+    uint32_t need = (t->count + per - 1) / per;
+    if(t->block_num < need)
+        t->blocks = realloc(t->blocks, need * sizeof(uint64_t));
+    while(t->block_num < need)
+    {
+        uint64_t block;
+        if(claim_blocks(fs, 0, 1, &block) == 0)
+        {
+            printf("No enough free blocks for the snapshot\n");
+            return -1;
+        }
+        t->blocks[t->block_num++] = block;
+    }
+
+    char buf[fs->geo.block_size];
+    chunk_map_head *head = (chunk_map_head*)buf;
+    for(uint32_t b = t->synced > 0 ? (t->synced-1) / per : 0; b < need; b++)
+    {
+        uint32_t num = t->count - b*per < per ? t->count - b*per : per;
+        memset(buf, 0, fs->geo.block_size);
+        head->next = b+1 < need ? t->blocks[b+1] : 0;
+        memcpy(head + 1, t->entries + b*per, num * sizeof(cow_entry));
+        if(write_block_nocow(fs, t->blocks[b], buf) != 0)
+            return -1;
+    }
+    entry->cow_map = need > 0 ? t->blocks[0] : 0;
+    entry->cow_count = t->count;
+    return 0;
+}
+
+
+/**
+ * @brief 写回最新快照的例外表中新加入的项, 并更新快照表中它的表项
+ * @return 成功返回0, 失败返回-1
+ * @note 调用者需要持有sb_lock
+ */
+static int write_cow_table(filesys *fs)
+{
+    cow_table *t = atomic_load(&fs->cow);
+    if(t == NULL)
+        return 0;
+    pthread_mutex_lock(&fs->cow_lock);
+    int ret = 0;
+    if(t->synced != t->count)
+    {
+        snapshot_entry table[fs->geo.snapshots_each_block];
+        int count = read_snapshot_table(fs, table);
+        ret = count > 0 ? store_cow_table(fs, t, &table[count-1]) : -1;
+        if(ret == 0)
+            ret = write_snapshot_table(fs, table, count);
+        if(ret == 0)
+            t->synced = t->count;
+    }
+    pthread_mutex_unlock(&fs->cow_lock);
+    return ret;
+}
+
+
+/**
+ * @brief 例外表中是否还有没有写入磁盘的项
+ */
+static int cow_unsynced(filesys *fs)
+{
+    cow_table *t = atomic_load(&fs->cow);
+    if(t == NULL)
+        return 0;
+    pthread_mutex_lock(&fs->cow_lock);
+    int unsynced = t->synced != t->count;
+    pthread_mutex_unlock(&fs->cow_lock);
+    return unsynced;
+}
+
+
+/**
+ * @brief 沿着表块链读取尾块表
+ * @return 成功返回0, 读取失败或表不完整返回-1
+ */
+static int read_tail_map(filesys *fs)
+{
+    char buf[fs->geo.block_size];
+    chunk_map_head *head = (chunk_map_head*)buf;
+    tail_entry *entries = (tail_entry*)(head + 1);
+
+    reset_tails(fs);
+    uint32_t total = fs->super_block_buf.tail_count;
+    uint64_t block = fs->super_block_buf.tail_map;
+    while(fs->tail_count < total && block != 0)
+    {
+        if(read_block_from_disk(fs, block, buf) != 0)
+            return -1;
+        fs->tail_map_blocks = realloc(fs->tail_map_blocks, (fs->tail_map_num+1) * sizeof(uint64_t));
+        fs->tail_map_blocks[fs->tail_map_num++] = block;
+        for(uint32_t i=0; i<fs->geo.tails_each_block && fs->tail_count<total; i++)
+        {
+            tail_block *tb = malloc(sizeof(tail_block));
+            tb->block = entries[i].block;
+            tb->used_mask = entries[i].used_mask;
+            tb->slots = entries[i].slots;
+            add_tail_locked(fs, tb);
+        }
+        block = head->next;
+    }
+    if(fs->tail_count != total)
+    {
+        printf("tail map is incomplete\n");
+        return -1;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief 从磁盘读取块组描述符表, 初始化空闲摘要; 位图等到用到时再加载
+ * @return 读取失败返回-1, 成功返回0
+ */
+static int read_groups_from_disk(filesys *fs)
+{
+    if(fs->super_block_buf.inode_size != sizeof(inode) || fs->super_block_buf.desc_size != sizeof(group_desc)
+        || setup_geometry(fs, fs->super_block_buf.block_size, fs->super_block_buf.inodes_per_group) != 0
+        || fs->super_block_buf.blocks_per_group != fs->geo.blocks_per_group
+        || (uint64_t)fs->super_block_buf.group_count * fs->geo.inodes_per_group > DYNAMIC_INODE_BASE)
+    {
+        printf("invalid file system geometry\n");
+        return -1;
+    }
+    char buf[fs->geo.block_size];
+
+    fs->block_count = fs->super_block_buf.block_count;
+    setup_groups(fs, fs->super_block_buf.group_count);
+    for(uint32_t g=0; g<fs->group_count; g+=fs->geo.descs_each_block)
+    {
+        uint32_t num = fs->group_count - g < fs->geo.descs_each_block ? fs->group_count - g : fs->geo.descs_each_block;
+        if(read_block_from_disk(fs, group_desc_block(fs, g), buf) != 0)
+            return -1;
+        memcpy(desc_at(fs, g), buf, num*sizeof(group_desc));
+    }
+    for(uint32_t g=0; g<fs->group_count; g++)
+        load_group_info(fs, g);
+    fs->folded_free_blocks = fs->super_block_buf.free_block_count;
+    fs->folded_free_inodes = fs->super_block_buf.free_inode_count;
+    fs->dir_total = fs->super_block_buf.dir_inode_count;
+    if(read_chunk_map(fs) != 0 || read_refcounts(fs) != 0)
+        return -1;
+    return read_tail_map(fs);
+}
+
+
+/**
+ * @brief 按磁盘大小格式化: 只写入描述符, 根目录和超级块
+ * @note 第0组以外的位图和所有inode表都不写, 在描述符中标记为未初始化, 挂载后按需初始化;
+ *       这样格式化的时间不随镜像大小增长
+ * @param block_size为块大小, inode_ratio为每多少字节的空间分配一个inode,
+ *        journal_blocks为日志区的块数, 日志区紧跟在根目录的数据块之后, 只能在第0组中
+ * @return 成功返回0, 参数不合法或磁盘太小返回-1
+ */
+static int format_fs(filesys *fs, uint32_t block_size, uint32_t inode_ratio, uint64_t journal_blocks)
+{
+    if(inode_ratio < MIN_BLOCK_SIZE)
+    {
+        printf("inode ratio %u is too small\n", inode_ratio);
+        return -1;
+    }
+    if(block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE || (block_size & (block_size-1)) != 0)
+    {
+        printf("invalid block size %u\n", block_size);
+        return -1;
+    }
+
+    // inode总数按inode_ratio折算后平均分到各组, 向上取整到整块和位图的整字, 不超过inode位图的位数
+    fs->block_count = get_disk_size(fs->disk) / block_size;
+    uint64_t blocks_per_group = (uint64_t)block_size * 8;
+    uint32_t count = (fs->block_count + blocks_per_group - 1) / blocks_per_group;
+    uint32_t inodes_align = block_size / sizeof(inode) > 32 ? block_size / sizeof(inode) : 32;
+    uint64_t inodes_per_group = count > 0 ? (fs->block_count * block_size / inode_ratio + count - 1) / count : 0;
+    inodes_per_group = (inodes_per_group + inodes_align - 1) / inodes_align * inodes_align;
+    if(inodes_per_group < inodes_align)
+        inodes_per_group = inodes_align;
+    if(inodes_per_group > blocks_per_group)
+        inodes_per_group = blocks_per_group;
+    setup_geometry(fs, block_size, inodes_per_group);
+
+    char buf[fs->geo.block_size];
+    uint32_t *words = (uint32_t*)buf;
+
+    // 最后一个组放不下元数据和至少一个数据块时舍弃
+    if(count > 0 && fs->block_count <= group_meta_block(fs, count-1) + 2 + fs->geo.inode_blocks_per_group)
+    {
+        count--;
+        fs->block_count = group_start(fs, count);
+    }
+    if(count == 0)
+    {
+        printf("disk is too small to format\n");
+        return -1;
+    }
+    if((uint64_t)count * fs->geo.inodes_per_group > DYNAMIC_INODE_BASE)
+    {
+        printf("disk is too large for %u inodes per group\n", fs->geo.inodes_per_group);
+        return -1;
+    }
+    // 第0组除了元数据还要放根目录的数据块和日志区
+    uint64_t root_block = group_meta_block(fs, 0) + 2 + fs->geo.inode_blocks_per_group;
+    uint64_t group0_end = count > 1 ? group_start(fs, 1) : fs->block_count;
+    if(root_block + 1 + journal_blocks >= group0_end)
+    {
+        printf("journal of %llu blocks does not fit in the first block group\n", (unsigned long long)journal_blocks);
+        return -1;
+    }
+    setup_groups(fs, count);
+    reset_chunks(fs);
+    reset_refcounts(fs);
+    reset_tails(fs);
+
+    memset(&fs->super_block_buf, 0, sizeof(sp_block));
+    fs->super_block_buf.magic_num = SYS_MAGIC_NUM; //180110322
+    fs->super_block_buf.block_count = fs->block_count;
+    fs->super_block_buf.inode_count = count * fs->geo.inodes_per_group;
+    fs->super_block_buf.blocks_per_group = fs->geo.blocks_per_group;
+    fs->super_block_buf.inodes_per_group = fs->geo.inodes_per_group;
+    fs->super_block_buf.group_count = count;
+    fs->super_block_buf.block_size = fs->geo.block_size;
+    fs->super_block_buf.inode_size = sizeof(inode);
+    fs->super_block_buf.desc_size = sizeof(group_desc);
+    fs->super_block_buf.journal_blocks = journal_blocks;
+    fs->super_block_buf.journal_start = journal_blocks > 0 ? root_block + 1 : 0;
+    fs->super_block_buf.inode_ratio = inode_ratio;
+
+    for(uint32_t g=0; g<count; g++)
+    {
+        group_desc *desc = desc_at(fs, g);
+        init_group_desc(fs, g, g+1 < count ? group_start(fs, g+1) : fs->block_count);
+
+        // 第0组要占用根目录的inode, 数据块和日志区, 直接写入它的位图和第一个inode块
+        if(g == 0)
+        {
+            uint32_t used = desc->first_data_block - group_start(fs, g) + 1 + journal_blocks;
+            desc->free_block_count -= 1 + journal_blocks;
+            desc->free_inode_count--;
+            desc->dir_count = 1;
+            desc->flags = 0;
+            desc->itable_zeroed = 1;
+
+            memset(buf, 0, fs->geo.block_size);
+            for(uint32_t b=0; b<used; b++)
+                words[b/32] |= 0x80000000u >> (b%32);
+            write_block_to_disk(fs, desc->block_bitmap, buf);
+
+            memset(buf, 0, fs->geo.block_size);
+            words[0] = 0x80000000u;
+            write_block_to_disk(fs, desc->inode_bitmap, buf);
+
+            memset(buf, 0, fs->geo.block_size);
+            write_block_to_disk(fs, desc->inode_table, buf);
+        }
+
+        fs->super_block_buf.free_block_count += desc->free_block_count;
+        fs->super_block_buf.free_inode_count += desc->free_inode_count;
+    }
+    fs->super_block_buf.dir_inode_count = 1;
+    for(uint32_t g=0; g<count; g+=fs->geo.descs_each_block)
+        write_group_descs(fs, g);
+
+    // init inode block
+    inode root_inode;
+    memset(&root_inode, 0, sizeof(inode));
+    root_inode.size = 1;
+    root_inode.file_type = TYPE_FOLDER;
+    root_inode.link = 0;
+    root_inode.block_point[0] = root_block;
+    write_inode(fs, 0, &root_inode);
+
+    //init root data block
+    dir_item dir_table[fs->geo.dir_items_each_block];
+    memset(dir_table, 0, fs->geo.block_size);
+    write_dir_table_to_disk(fs, root_block, dir_table);
+
+    // 超级块最后写, 格式化中途失败时不会被当成有效的文件系统
+    memset(buf, 0, fs->geo.block_size);
+    memcpy(buf, &fs->super_block_buf, sizeof(sp_block));
+    write_block_to_disk(fs, SUPER_BLOCK_INDEX, buf);
+
+    for(uint32_t g=0; g<count; g++)
+        load_group_info(fs, g);
+    fs->folded_free_blocks = fs->super_block_buf.free_block_count;
+    fs->folded_free_inodes = fs->super_block_buf.free_inode_count;
+    fs->dir_total = fs->super_block_buf.dir_inode_count;
+    return 0;
+}
+
+
+/**
+ * @brief 把第g组的inode表清零到第upto块(不含)为止, 最多清零max_blocks块
+ * @return 成功返回0, 写入失败返回-1
+ * @note 调用者需要持有itable_lock
+ */
+static int zero_itable_locked(filesys *fs, uint32_t g, uint32_t upto, uint32_t max_blocks)
+{
+    uint32_t zeroed = atomic_load(&group_at(fs, g)->itable_zeroed);
+    if(zeroed >= upto)
+        return 0;
+    if(upto - zeroed > max_blocks)
+        upto = zeroed + max_blocks;
+
+    char zero[fs->geo.block_size];
+    memset(zero, 0, fs->geo.block_size);
+    int ret = 0;
+    for(; zeroed<upto; zeroed++)
+    {
+        // 快照中这些inode块还没有清零, 也就没有在用的inode, 不用复制
+        if(write_block_nocow(fs, desc_at(fs, g)->inode_table + zeroed, zero) != 0)
+        {
+            ret = -1;
+            break;
+        }
+    }
+    atomic_store(&group_at(fs, g)->itable_zeroed, zeroed);
+    mark_group_dirty(fs, g);
+    return ret;
+}
+
+
+/**
+ * @brief 后台限速清零所有块组剩下的inode表, 每轮清零ITABLE_ZERO_BYTES后休眠ITABLE_ZERO_INTERVAL毫秒
+ */
+static void* itable_init_main(void *arg)
+{
+    filesys *fs = arg;
+    disk_set_io_class(DISK_IO_BACKGROUND);
+    uint32_t batch = ITABLE_ZERO_BYTES / fs->geo.block_size;
+    if(batch == 0)
+        batch = 1;
+    struct timespec interval = { 0, ITABLE_ZERO_INTERVAL * 1000000L };
+    for(uint32_t g=0; g<fs->group_count && !atomic_load(&fs->itable_stop); )
+    {
+        if(atomic_load(&group_at(fs, g)->itable_zeroed) >= fs->geo.inode_blocks_per_group)
+        {
+            g++;
+            continue;
+        }
+        pthread_mutex_lock(&fs->itable_lock);
+        int ret = zero_itable_locked(fs, g, fs->geo.inode_blocks_per_group, batch);
+        pthread_mutex_unlock(&fs->itable_lock);
+        if(ret != 0)
+            break;
+        nanosleep(&interval, NULL);
+    }
+    // 进度随描述符写回, 没有写回时下次挂载会从上次写回的位置继续
+    sync_spblock(fs);
+    return NULL;
+}
+
+
+/**
+ * @brief 有未清零的inode表时启动后台清零线程
+ */
+static void start_itable_init(filesys *fs)
+{
+    for(uint32_t g=0; g<fs->group_count; g++)
+    {
+        if(atomic_load(&group_at(fs, g)->itable_zeroed) < fs->geo.inode_blocks_per_group)
+        {
+            atomic_store(&fs->itable_stop, 0);
+            fs->itable_thread_running = pthread_create(&fs->itable_thread, NULL, itable_init_main, fs) == 0;
+            return;
+        }
+    }
+}
+
+
+/**
+ * @brief 停止后台清零线程, 等待它退出
+ */
+static void stop_itable_init(filesys *fs)
+{
+    if(!fs->itable_thread_running)
+        return;
+    atomic_store(&fs->itable_stop, 1);
+    pthread_join(fs->itable_thread, NULL);
+    fs->itable_thread_running = 0;
+}
+
+
+/**
+ * @brief 只读挂载的实例不能修改
+ * @return 可以修改返回0, 只读时打印提示并返回-1
+ */
+static int check_writable(filesys *fs)
+{
+    if(!fs->read_only)
+        return 0;
+    printf("read-only file system\n");
+    return -1;
+}
+
+
+/**
+ * @brief 挂载时读出最新快照的例外表, 之后覆盖写和释放它创建时已占用的块都要先查表
+ * @return 成功或没有快照返回0, 失败返回-1
+ */
+static int load_latest_cow(filesys *fs)
+{
+    snapshot_entry table[fs->geo.snapshots_each_block];
+    int count = read_snapshot_table(fs, table);
+    if(count <= 0)
+        return count;
+    cow_table *t = load_cow_table(fs, &table[count-1]);
+    atomic_store(&fs->cow, t);
+    return t != NULL ? 0 : -1;
+}
+
+
+/**
+ * @brief 格式化磁盘d, 参数见format_fs
+ * @return 成功返回0, 参数不合法或磁盘太小返回-1
+ * @note 使用一个临时的实例, 格式化后释放; 磁盘不会被关闭
+ */
+int filesys_format(disk *d, uint32_t block_size, uint32_t inode_ratio, uint64_t journal_blocks)
+{
+    filesys *fs = alloc_fs(d);
+    int ret = format_fs(fs, block_size, inode_ratio, journal_blocks);
+    free_fs(fs);
+    return ret;
+}
+
+
+/**
+ * @brief 挂载磁盘d上的文件系统, 磁盘还没有格式化时按默认参数格式化
+ * @return 成功返回文件系统实例, 失败返回NULL
+ * @note 实例拥有磁盘d, 由filesys_shutdown()关闭; 只有超级块中没有魔数时才格式化,
+ *       已经格式化的磁盘读取失败或元数据不完整时挂载失败, 不会被覆盖
+ */
+filesys* filesys_init(disk *d)
+{
+    filesys *fs = alloc_fs(d);
+
+    // 几何参数从超级块读取
+    int ret;
+    if(read_spblock_from_disk(fs) != 0)
+        ret = -1;
+    else if(fs->super_block_buf.magic_num != SYS_MAGIC_NUM)
+        ret = format_fs(fs, DEFAULT_BLOCK_SIZE, DEFAULT_INODE_RATIO, 0);
+    else if((ret = read_groups_from_disk(fs)) != 0 || (ret = load_latest_cow(fs)) != 0)
+        printf("fail to mount the file system\n");
+    if(ret != 0)
+    {
+        free_fs(fs);
+        return NULL;
+    }
+    start_itable_init(fs);
+    start_flusher(fs);
+    return fs;
+}
+
+
+/**
+ * @brief 以只读方式挂载磁盘d上名为name的快照
+ * @return 成功返回文件系统实例, 磁盘没有格式化或没有这个快照时返回NULL
+ * @note 先按当前的超级块读出快照表和从该快照到最新快照的例外表, 之后所有的读取(包括超级块)都经过例外表,
+ *       看到的是创建快照时的镜像; 不启动后台线程, 也不写磁盘; 实例拥有磁盘d, 由filesys_shutdown()关闭
+ */
+filesys* filesys_open_snapshot(disk *d, char *name)
+{
+    filesys *fs = alloc_fs(d);
+    fs->read_only = 1;
+    if(read_spblock_from_disk(fs) != 0 || fs->super_block_buf.magic_num != SYS_MAGIC_NUM
+        || setup_geometry(fs, fs->super_block_buf.block_size, fs->super_block_buf.inodes_per_group) != 0)
+    {
+        printf("the disk is not formatted\n");
+        free_fs(fs);
+        return NULL;
+    }
+    snapshot_entry table[fs->geo.snapshots_each_block];
+    int count = read_snapshot_table(fs, table);
+    int k = count > 0 ? find_snapshot(table, count, name) : -1;
+    if(k < 0)
+    {
+        printf("snapshot %s is not exist\n", name);
+        free_fs(fs);
+        return NULL;
+    }
+    // 例外表块不在任何快照的视图中, 全部读出之后再启用视图
+    cow_table **view = calloc(count - k, sizeof(cow_table*));
+    int num = 0;
+    while(k + num < count && (view[num] = load_cow_table(fs, &table[k+num])) != NULL)
+        num++;
+    fs->view = view;
+    fs->view_num = num;
+    if(num != count - k || read_spblock_from_disk(fs) != 0 || read_groups_from_disk(fs) != 0)
+    {
+        printf("fail to mount snapshot %s\n", name);
+        free_fs(fs);
+        return NULL;
+    }
+    return fs;
+}
+
+
+/**
+ * @brief 卸载文件系统: 写回所有数据, 关闭磁盘并释放实例
+ * @note 之后不能再使用fs
+ */
+void filesys_shutdown(filesys *fs)
+{
+    printf("shutdown the file system ...\n");
+    stop_itable_init(fs);
+    stop_flusher(fs);
+    filesys_sync(fs);
+    release_all_reservations(fs, -1);
+    int ret = close_disk(fs->disk);
+    free_fs(fs);
+    if(ret >= 0)
+    {
+        printf("Successfully to shutdown the file system\n");
+    }
+    else
+    {
+        printf("fail to shutdown the file system\n");
+    }
+}
+
+
+/**
+ * @brief 在线扩容: 把磁盘镜像扩大到size字节, 扩大原来的最后一组, 再追加新的块组
+ * @note 新组和格式化时一样只写描述符, 位图和inode表标记为未初始化, 所以耗时只和新增的块组数有关;
+ *       新组的描述符和超级块写回之后才对分配器可见, 扩容期间其他线程照常读写
+ * @return 成功返回0, 大小没有增加或写入失败返回-1
+ * @note 调用者需要持有快照屏障的读锁
+ */
+static int do_filesys_resize(filesys *fs, uint64_t size)
+{
+    pthread_mutex_lock(&fs->resize_lock);
+    uint64_t old_blocks = atomic_load(&fs->block_count);
+    uint32_t old_count = atomic_load(&fs->group_count);
+    uint64_t total = size / fs->geo.block_size;
+    if(total <= old_blocks)
+    {
+        printf("new size must be larger than the current size\n");
+        pthread_mutex_unlock(&fs->resize_lock);
+        return -1;
+    }
+    if(grow_disk(fs->disk, size) != 0)
+    {
+        printf("fail to grow the disk to %llu bytes\n", (unsigned long long)size);
+        pthread_mutex_unlock(&fs->resize_lock);
+        return -1;
+    }
+
+    // 和格式化一样舍弃放不下元数据的新的最后一组; 静态inode编号不能超过DYNAMIC_INODE_BASE
+    uint32_t count = (total + fs->geo.blocks_per_group - 1) / fs->geo.blocks_per_group;
+    if(count > old_count && total <= group_meta_block(fs, count-1) + 2 + fs->geo.inode_blocks_per_group)
+    {
+        count--;
+        total = group_start(fs, count);
+    }
+    if((uint64_t)count * fs->geo.inodes_per_group > DYNAMIC_INODE_BASE)
+    {
+        count = DYNAMIC_INODE_BASE / fs->geo.inodes_per_group;
+        total = group_start(fs, count);
+    }
+    if(total <= old_blocks)
+    {
+        printf("no room for a new block group\n");
+        pthread_mutex_unlock(&fs->resize_lock);
+        return -1;
+    }
+
+    // 后台清零线程按组数遍历, 扩容后重新启动
+    stop_itable_init(fs);
+    pthread_mutex_lock(&fs->sb_lock);
+    grow_groups(fs, old_count, count);
+
+    uint32_t last = old_count - 1;
+    uint64_t last_end = count > old_count ? group_start(fs, old_count) : total;
+    int64_t added_blocks = last_end - old_blocks;
+    if(added_blocks > 0)
+    {
+        desc_at(fs, last)->block_count = last_end - group_start(fs, last);
+        atomic_fetch_add(&group_at(fs, last)->free_blocks, added_blocks);
+        mark_group_dirty(fs, last);
+    }
+    for(uint32_t g=old_count; g<count; g++)
+    {
+        init_group_desc(fs, g, g+1 < count ? group_start(fs, g+1) : total);
+        load_group_info(fs, g);
+        mark_group_dirty(fs, g);
+        added_blocks += desc_at(fs, g)->free_block_count;
+    }
+    fs->super_block_buf.block_count = total;
+    fs->super_block_buf.group_count = count;
+    fs->super_block_buf.inode_count += (count - old_count) * fs->geo.inodes_per_group;
+    fs->super_block_buf.free_block_count += added_blocks;
+    fs->super_block_buf.free_inode_count += (int64_t)(count - old_count) * fs->geo.inodes_per_group;
+    int ret = write_spblock_to_disk(fs);
+
+    atomic_store(&fs->block_count, total);
+    atomic_store(&fs->group_count, count);
+    pthread_mutex_unlock(&fs->sb_lock);
+    start_itable_init(fs);
+    pthread_mutex_unlock(&fs->resize_lock);
+    return ret;
+}
+
+
+/**
+ * @brief 持有快照屏障的读锁执行do_filesys_resize, 参数和返回值相同
+ */
+int filesys_resize(filesys *fs, uint64_t size)
+{
+    if(check_writable(fs) != 0)
+        return -1;
+    pthread_rwlock_rdlock(&fs->snapshot_barrier);
+    int ret = do_filesys_resize(fs, size);
+    pthread_rwlock_unlock(&fs->snapshot_barrier);
+    return ret;
+}
+
+
+/**
+ * @brief 标记超级块需要写回, 并尝试写回
+ * @note 同一时间只有一个线程写回; 其他线程发现有人在写回时直接返回, 由写回的线程补写, 不会阻塞分配
+ */
+void sync_spblock(filesys *fs)
+{
+    if(fs->read_only)
+        return;
+    atomic_fetch_add(&fs->sb_dirty, 1);
+    while(atomic_load(&fs->sb_dirty) != 0 && pthread_mutex_trylock(&fs->sb_lock) == 0)
+    {
+        while(atomic_exchange(&fs->sb_dirty, 0) != 0)
+            write_spblock_to_disk(fs);
+        pthread_mutex_unlock(&fs->sb_lock);
+    }
+}
+
+
+/**
+ * @brief 当前CPU的空闲计数增量
+ */
+static free_delta* my_free_delta(filesys *fs)
+{
+    int cpu = sched_getcpu();
+    if(cpu < 0)
+        cpu = 0;
+    return &fs->free_deltas[cpu % ALLOC_CPUS];
+}
+
+
+/**
+ * @brief 记录从start开始的n个块被占用(delta为-1)或释放(delta为1), 更新所在块组的空闲摘要和当前CPU的空闲计数增量
+ */
+static void count_blocks(filesys *fs, uint64_t start, int n, int delta)
+{
+    for(uint64_t b=start; b<start+n; )
+    {
+        uint32_t g = b / fs->geo.blocks_per_group;
+        uint64_t end = group_start(fs, g+1) < start+n ? group_start(fs, g+1) : start+n;
+        atomic_fetch_add(&group_at(fs, g)->free_blocks, delta*(int)(end-b));
+        mark_group_dirty(fs, g);
+        b = end;
+    }
+    atomic_fetch_add(&my_free_delta(fs)->blocks, delta*n);
+}
+
+
+/**
+ * @brief 记录inode_id被占用(delta为-1)或释放(delta为1)
+ * @note 块组的空闲摘要只统计位图中的inode, claim_inode靠它跳过用满的组; 动态inode只计入超级块的空闲数
+ */
+static void count_inode(filesys *fs, int inode_id, int delta)
+{
+    if(inode_id < DYNAMIC_INODE_BASE)
+    {
+        uint32_t g = inode_id / fs->geo.inodes_per_group;
+        atomic_fetch_add(&group_at(fs, g)->free_inodes, delta);
+        mark_group_dirty(fs, g);
+    }
+    atomic_fetch_add(&my_free_delta(fs)->inodes, delta);
+}
+
+
+/**
+ * @brief 新建(delta为1)或删除(delta为-1)了目录inode_id, 更新目录计数
+ */
+static void count_dir(filesys *fs, int inode_id, int delta)
+{
+    uint32_t g = inode_group(fs, inode_id);
+    atomic_fetch_add(&group_at(fs, g)->dirs, delta);
+    mark_group_dirty(fs, g);
+    atomic_fetch_add(&fs->dir_total, delta);
+}
+
+
+/**
+ * @brief 当前的空闲块数, 只在计数折叠的瞬间可能偏差几个
+ */
+static int64_t free_block_total(filesys *fs)
+{
+    int64_t total = atomic_load(&fs->folded_free_blocks);
+    for(int i=0; i<ALLOC_CPUS; i++)
+        total += atomic_load(&fs->free_deltas[i].blocks);
+    return total;
+}
+
+
+/**
+ * @brief 当前的空闲inode数
+ */
+static int64_t free_inode_total(filesys *fs)
+{
+    int64_t total = atomic_load(&fs->folded_free_inodes);
+    for(int i=0; i<ALLOC_CPUS; i++)
+        total += atomic_load(&fs->free_deltas[i].inodes);
+    return total;
+}
+
+
+/**
+ * @brief 第g组的块位图(is_inode为0)或inode位图(is_inode为1), 还没有加载时从磁盘加载
+ * @return 成功返回位图, 读取失败返回NULL
+ */
+static _Atomic uint32_t* load_bitmap(filesys *fs, uint32_t g, int is_inode)
+{
+    _Atomic(_Atomic uint32_t*) *slot = is_inode ? &group_at(fs, g)->inode_map : &group_at(fs, g)->block_map;
+    _Atomic uint32_t *map = atomic_load(slot);
+    if(map != NULL)
+        return map;
+
+    pthread_mutex_lock(&fs->bitmap_load_lock);
+    map = atomic_load(slot);
+    if(map == NULL)
+    {
+        char buf[fs->geo.block_size];
+        uint64_t block_id = is_inode ? desc_at(fs, g)->inode_bitmap : desc_at(fs, g)->block_bitmap;
+        uint32_t uninit = is_inode ? GROUP_INODE_UNINIT : GROUP_BLOCK_UNINIT;
+        int ret = 0;
+        if(desc_at(fs, g)->flags & uninit)
+        {
+            // 未初始化的位图在内存中构造: inode都空闲, 只有组开头的元数据块被占用
+            if(is_inode)
+                memset(buf, 0, fs->geo.block_size);
+            else
+                build_uninit_bitmap(fs, g, desc_at(fs, g)->first_data_block, buf);
+        }
+        else
+            ret = read_block_from_disk(fs, block_id, buf);
+        if(ret == 0)
+        {
+            map = malloc(fs->geo.block_size);
+            uint32_t *words = (uint32_t*)buf;
+            for(uint32_t i=0; i<fs->geo.block_size/4; i++)
+                atomic_init(&map[i], words[i]);
+            atomic_store(slot, map);
+        }
+    }
+    pthread_mutex_unlock(&fs->bitmap_load_lock);
+    return map;
+}
+
+
+/**
+ * @brief 在位图map的第start_word到第end_word-1个字中用CAS占用第一个空闲位
+ * @return 成功返回位号, 这些字已满返回-1
+ */
+static int claim_bit(_Atomic uint32_t *map, int start_word, int end_word)
+{
+    for(int i=start_word; i<end_word; i++)
+    {
+        uint32_t old = atomic_load_explicit(&map[i], memory_order_relaxed);
+        while(old != ~0u)
+        {
+            int j = __builtin_clz(~old);   // 从最高位开始第一个为0的位
+            if(atomic_compare_exchange_weak(&map[i], &old, old | (0x80000000u >> j)))
+                return i*32+j;
+        }
+    }
+    return -1;
+}
+
+
+/**
+ * @brief 在位图map的第start_word到第end_word-1个字中占用最多want个空闲位,
+ *        同一个字中要占用的位用一次CAS一起占用
+ * @return 返回占用的位数, 位号按从小到大存放到bits中
+ */
+static int claim_bits(_Atomic uint32_t *map, int start_word, int end_word, int want, int *bits)
+{
+    int num = 0;
+    for(int i=start_word; i<end_word && num<want; i++)
+    {
+        uint32_t old = atomic_load_explicit(&map[i], memory_order_relaxed);
+        uint32_t mask;
+        do
+        {
+            // 从最高位开始取还需要的空闲位
+            mask = 0;
+            uint32_t free_bits = ~old;
+            for(int n=num; n<want && free_bits != 0; n++)
+            {
+                uint32_t bit = 0x80000000u >> __builtin_clz(free_bits);
+                mask |= bit;
+                free_bits &= ~bit;
+            }
+        } while(mask != 0 && !atomic_compare_exchange_weak(&map[i], &old, old | mask));
+        while(mask != 0)
+        {
+            int j = __builtin_clz(mask);
+            bits[num++] = i*32+j;
+            mask &= ~(0x80000000u >> j);
+        }
+    }
+    return num;
+}
+
+
+/**
+ * @brief 释放位图map中的第bit位
+ */
+static void release_bit(_Atomic uint32_t *map, int bit)
+{
+    atomic_fetch_and(&map[bit/32], ~(0x80000000u >> (bit%32)));
+}
+
+
+/**
+ * @brief 用CAS占用位图map中指定的第bit位
+ * @return 成功返回1, 该位已被占用返回0
+ */
+static int claim_this_bit(_Atomic uint32_t *map, int bit)
+{
+    uint32_t mask = 0x80000000u >> (bit%32);
+    uint32_t old = atomic_load_explicit(&map[bit/32], memory_order_relaxed);
+    while(!(old & mask))
+    {
+        if(atomic_compare_exchange_weak(&map[bit/32], &old, old | mask))
+            return 1;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief 从goal开始找到第一个空闲位, 从它开始连续占用最多want个空闲位
+ * @return 占用的位数, 起始位号存放到start中; goal之后没有空闲位返回0
+ */
+static int claim_run(_Atomic uint32_t *map, int bits, int goal, int want, int *start)
+{
+    int bit = goal;
+    while(bit < bits)
+    {
+        uint32_t word = atomic_load_explicit(&map[bit/32], memory_order_relaxed);
+        if(word == ~0u)
+        {
+            bit = (bit/32 + 1) * 32;
+            continue;
+        }
+        int n = 0;
+        while(n < want && bit + n < bits && claim_this_bit(map, bit + n))
+            n++;
+        if(n > 0)
+        {
+            *start = bit;
+            return n;
+        }
+        bit++;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief 从goal开始连续占用最多want个空闲块, 依次尝试goal所在的组和之后的组,
+ *        空闲摘要为0的组直接跳过, 不加载它的位图
+ * @return 占用的块数, 起始块号存放到start中; 没有空闲块返回0
+ */
+static int claim_blocks(filesys *fs, uint64_t goal, int want, uint64_t *start)
+{
+    // 扩容可能同时在追加块组, 只在读到的组数之内查找
+    uint32_t count = atomic_load(&fs->group_count);
+    if(goal >= group_start(fs, count))
+        goal = 0;
+    uint32_t first = goal / fs->geo.blocks_per_group;
+    // 最后一轮回到goal所在的组, 从组的开头找
+    for(uint32_t i=0; i<=count; i++)
+    {
+        uint32_t g = (first + i) % count;
+        if(atomic_load(&group_at(fs, g)->free_blocks) <= 0)
+            continue;
+        _Atomic uint32_t *map = load_bitmap(fs, g, 0);
+        if(map == NULL)
+            continue;
+        int bit;
+        int from = i == 0 ? goal - group_start(fs, g) : 0;
+        // 最后一组可能不满, 扩容时会变大, 按当前的总块数计算组内的块数
+        uint64_t bits = atomic_load(&fs->block_count) - group_start(fs, g);
+        if(bits > fs->geo.blocks_per_group)
+            bits = fs->geo.blocks_per_group;
+        int n = claim_run(map, bits, from, want, &bit);
+        if(n > 0)
+        {
+            *start = group_start(fs, g) + bit;
+            count_blocks(fs, *start, n, -1);
+            return n;
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * @brief 把从start开始的n个块放回位图, 不检查快照
+ * @note 快照自己的块(复制出的旧内容, 例外表块)不在任何快照的视图中, 直接用它释放
+ */
+static void release_blocks_nocow(filesys *fs, uint64_t start, int n)
+{
+    for(uint64_t b=start; b<start+n; b++)
+    {
+        _Atomic uint32_t *map = load_bitmap(fs, b / fs->geo.blocks_per_group, 0);
+        if(map != NULL)
+            release_bit(map, b % fs->geo.blocks_per_group);
+    }
+    count_blocks(fs, start, n, 1);
+}
+
+
+/**
+ * @brief 释放从start开始的n个块, 还在最新快照中的块留给快照
+ */
+static void release_blocks(filesys *fs, uint64_t start, int n)
+{
+    for(uint64_t b=start; b<start+n; )
+    {
+        uint64_t end = b;
+        while(end < start+n && !cow_keep(fs, end))
+            end++;
+        if(end > b)
+            release_blocks_nocow(fs, b, end - b);
+        b = end + 1;
+    }
+}
+
+
+/**
+ * @brief 查找inode_id的预留窗口, 没有时create为1则新建
+ * @note 调用者需要持有该inode的写锁
+ */
+static reservation* find_reservation(filesys *fs, int inode_id, int create)
+{
+    reservation **p = &fs->reservations[(uint32_t)inode_id % INODE_LOCKS];
+    for(; *p != NULL; p = &(*p)->link)
+    {
+        if((*p)->inode_id == inode_id)
+            return *p;
+    }
+    if(!create)
+        return NULL;
+    *p = calloc(1, sizeof(reservation));
+    (*p)->inode_id = inode_id;
+    return *p;
+}
+
+
+/**
+ * @brief 释放inode_id文件预留窗口中还没有使用的块
+ * @note 调用者需要持有该文件的inode写锁
+ */
+static void release_reservation_locked(filesys *fs, int inode_id)
+{
+    reservation **p = &fs->reservations[(uint32_t)inode_id % INODE_LOCKS];
+    while(*p != NULL && (*p)->inode_id != inode_id)
+        p = &(*p)->link;
+    if(*p == NULL)
+        return;
+
+    reservation *r = *p;
+    int unused = r->start + r->len - r->next;
+    if(unused > 0)
+    {
+        release_blocks(fs, r->next, unused);
+        sync_spblock(fs);
+    }
+    *p = r->link;
+    free(r);
+}
+
+
+/**
+ * @brief 空间不足时回收所有文件的预留窗口, except_id为调用者自己持有写锁的文件(没有则为-1)
+ * @note 正在被其他线程使用的锁拿不到, 直接跳过; except_id所在的锁由调用者持有, 可以直接回收其中的其他文件
+ */
+static void release_all_reservations(filesys *fs, int except_id)
+{
+    int own = except_id >= 0 ? (int)((uint32_t)except_id % INODE_LOCKS) : -1;
+    for(int i=0; i<INODE_LOCKS; i++)
+    {
+        if(i != own && pthread_rwlock_trywrlock(&fs->inode_locks[i]) != 0)
+            continue;
+        reservation *r = fs->reservations[i];
+        while(r != NULL)
+        {
+            reservation *next = r->link;
+            if(r->inode_id != except_id)
+                release_reservation_locked(fs, r->inode_id);
+            r = next;
+        }
+        if(i != own)
+            pthread_rwlock_unlock(&fs->inode_locks[i]);
+    }
+}
+
+
+/**
+ * @brief inode_id的第index个块的分配目标: 前一个已分配块之后的块, 没有时为inode所在块组的第一个数据块
+ * @note 这样数据块靠近它的inode, 同一个文件或目录的块尽量连续
+ */
+static uint64_t block_goal(filesys *fs, int inode_id, inode *node, int index)
+{
+    for(int i=index-1; i>=0; i--)
+    {
+        if(node->block_point[i] != 0)
+            return node->block_point[i] + 1;
+    }
+    return desc_at(fs, inode_group(fs, inode_id))->first_data_block;
+}
+
+
+/**
+ * @brief 为inode_id文件的第index个数据块分配块, want为从index开始还要分配的块数
+ * @note 优先使用文件的预留窗口; 窗口用完时在文件上一个数据块之后预留一段新的连续块,
+ *       这样多个文件同时增长时各自的块仍然是连续的
+ * @return 成功返回0, 块号存放到block_id中, 失败返回-1
+ * @note 调用者需要持有该文件的inode写锁
+ */
+static int get_file_block(filesys *fs, int inode_id, inode *file_inode, int index, int want, uint64_t *block_id)
+{
+    reservation *r = find_reservation(fs, inode_id, 0);
+    if(r != NULL && r->next < r->start + r->len)
+    {
+        *block_id = r->next++;
+        return 0;
+    }
+
+    uint64_t goal = block_goal(fs, inode_id, file_inode, index);
+    if(want < RESERVE_WINDOW)
+        want = RESERVE_WINDOW;
+    if(want > 6 - index)
+        want = 6 - index;
+    uint64_t start;
+    int n = claim_blocks(fs, goal, want, &start);
+    if(n == 0)
+    {
+        release_all_reservations(fs, inode_id);
+        n = claim_blocks(fs, goal, want, &start);
+    }
+    if(n == 0)
+    {
+        printf("No enough free blocks\n");
+        return -1;
+    }
+    sync_spblock(fs);
+
+    r = find_reservation(fs, inode_id, 1);
+    r->start = start;
+    r->len = n;
+    r->next = start + 1;
+    *block_id = start;
+    return 0;
+}
+
+
+/**
+ * @brief 为parent_id目录下新建的type类型inode选择块组
+ * @note 文件放在父目录所在的组, 只需要看该组的空闲摘要;
+ *       目录分散到空闲inode不少于平均值且目录最少的组, 给它下面的文件留出空间,
+ *       块组很多时只比较父目录之后的DIR_GROUP_SCAN个组
+ * @return 选中的组号
+ */
+static uint32_t find_inode_group(filesys *fs, int parent_id, int type)
+{
+    uint32_t parent_group = inode_group(fs, parent_id);
+    if(type != TYPE_FOLDER)
+        return parent_group;
+
+    int64_t total = free_inode_total(fs);
+    uint32_t count = atomic_load(&fs->group_count);
+    int best = -1;
+    for(uint32_t i=0; i<count && i<DIR_GROUP_SCAN; i++)
+    {
+        uint32_t g = (parent_group + i) % count;
+        int64_t free_inodes = atomic_load(&group_at(fs, g)->free_inodes);
+        if(free_inodes > 0 && free_inodes*count >= total
+            && (best < 0 || atomic_load(&group_at(fs, g)->dirs) < atomic_load(&group_at(fs, best)->dirs)))
+            best = g;
+    }
+    return best >= 0 ? (uint32_t)best : parent_group;
+}
+
+
+/**
+ * @brief 确保第g组第bit个inode所在的inode块已经清零
+ * @return 成功返回0, 清零失败返回-1
+ */
+static int init_inode_table(filesys *fs, uint32_t g, int bit)
+{
+    uint32_t upto = bit / fs->geo.inodes_each_block + 1;
+    if(atomic_load(&group_at(fs, g)->itable_zeroed) >= upto)
+        return 0;
+    pthread_mutex_lock(&fs->itable_lock);
+    int ret = zero_itable_locked(fs, g, upto, upto);
+    pthread_mutex_unlock(&fs->itable_lock);
+    return ret;
+}
+
+
+/**
+ * @brief 在第g组附近追加一个chunk, 映射表块满时先追加一个映射表块
+ * @return 成功返回0, 空间不足返回-1
+ * @note 调用者需要持有chunk_lock; 这里只用claim_blocks分配, 不会写回超级块
+ */
+static int append_chunk_locked(filesys *fs, uint32_t g)
+{
+    uint32_t seg = fs->chunk_count / CHUNK_SEG;
+    if(seg == sizeof(fs->chunk_table)/sizeof(fs->chunk_table[0]))
+        return -1;
+    // 和get_free_block一样, 预留给延迟分配的块不能用
+    if(free_block_total(fs) - atomic_load(&fs->delalloc_blocks) < 2)
+        return -1;
+
+    uint64_t goal = desc_at(fs, g)->first_data_block;
+    if(fs->chunk_count == fs->map_block_num * fs->geo.chunks_each_map_block)
+    {
+        uint64_t map_block;
+        if(claim_blocks(fs, goal, 1, &map_block) == 0)
+            return -1;
+        // 上一个映射表块的next指向新块
+        if(fs->map_block_num > 0)
+            fs->map_dirty[fs->map_block_num-1] = 1;
+        add_map_block_locked(fs, map_block, 1);
+    }
+
+    // chunk块清零后才能在其中分配inode
+    uint64_t block;
+    char zero[fs->geo.block_size];
+    memset(zero, 0, fs->geo.block_size);
+    if(claim_blocks(fs, goal, 1, &block) == 0)
+        return -1;
+    if(write_block_to_disk(fs, block, zero) != 0)
+    {
+        release_blocks(fs, block, 1);
+        return -1;
+    }
+
+    if(atomic_load(&fs->chunk_table[seg]) == NULL)
+        atomic_store(&fs->chunk_table[seg], calloc(CHUNK_SEG, sizeof(chunk_entry)));
+    chunk_entry *chunk = chunk_at(fs, fs->chunk_count);
+    chunk->block = block;
+    // 块中放不下的编号一开始就标记为已使用
+    chunk->used_mask = fs->geo.inodes_each_chunk < 64 ? ~0ull << fs->geo.inodes_each_chunk : 0;
+    fs->map_dirty[fs->chunk_count / fs->geo.chunks_each_map_block] = 1;
+    fs->chunk_count++;
+    atomic_fetch_add(&my_free_delta(fs)->inodes, fs->geo.inodes_each_chunk);
+    return 0;
+}
+
+
+/**
+ * @brief 块组中的inode用完时分配一个动态inode, 所有chunk都满时在第g组附近追加一个chunk
+ * @return 成功返回inode_id, 空间不足返回-1
+ */
+static int claim_chunk_inode(filesys *fs, uint32_t g)
+{
+    pthread_mutex_lock(&fs->chunk_lock);
+    uint32_t c = fs->chunk_hint;
+    while(c < fs->chunk_count && chunk_at(fs, c)->used_mask == ~0ull)
+        c++;
+    fs->chunk_hint = c;
+    if(c == fs->chunk_count && append_chunk_locked(fs, g) != 0)
+    {
+        pthread_mutex_unlock(&fs->chunk_lock);
+        return -1;
+    }
+    chunk_entry *chunk = chunk_at(fs, c);
+    int k = __builtin_ctzll(~chunk->used_mask);
+    chunk->used_mask |= 1ull << k;
+    fs->map_dirty[c / fs->geo.chunks_each_map_block] = 1;
+    pthread_mutex_unlock(&fs->chunk_lock);
+    count_inode(fs, DYNAMIC_INODE_BASE + c*CHUNK_STRIDE + k, -1);
+    return DYNAMIC_INODE_BASE + c*CHUNK_STRIDE + k;
+}
+
+
+/**
+ * @brief 释放动态分配的inode_id
+ * @note chunk用空后也不回收它的块
+ */
+static void release_chunk_inode(filesys *fs, int inode_id)
+{
+    uint32_t c = (inode_id - DYNAMIC_INODE_BASE) / CHUNK_STRIDE;
+    pthread_mutex_lock(&fs->chunk_lock);
+    chunk_at(fs, c)->used_mask &= ~(1ull << ((inode_id - DYNAMIC_INODE_BASE) % CHUNK_STRIDE));
+    fs->map_dirty[c / fs->geo.chunks_each_map_block] = 1;
+    if(c < fs->chunk_hint)
+        fs->chunk_hint = c;
+    pthread_mutex_unlock(&fs->chunk_lock);
+    count_inode(fs, inode_id, 1);
+}
+
+
+/**
+ * @brief 从第g组开始依次在各组中占用一个空闲inode, 空闲摘要为0的组直接跳过
+ * @return 成功返回inode_id, 没有空闲inode返回-1
+ */
+static int claim_inode(filesys *fs, uint32_t g)
+{
+    uint32_t count = atomic_load(&fs->group_count);
+    for(uint32_t i=0; i<count; i++)
+    {
+        uint32_t cur = (g + i) % count;
+        if(atomic_load(&group_at(fs, cur)->free_inodes) <= 0)
+            continue;
+        _Atomic uint32_t *map = load_bitmap(fs, cur, 1);
+        if(map == NULL)
+            continue;
+        int bit = claim_bit(map, 0, fs->geo.inodes_per_group/32);
+        if(bit >= 0 && init_inode_table(fs, cur, bit) != 0)
+        {
+            release_bit(map, bit);
+            printf("fail to initialize inode table of group %u\n", cur);
+            return -1;
+        }
+        if(bit >= 0)
+        {
+            int inode_id = cur*fs->geo.inodes_per_group + bit;
+            count_inode(fs, inode_id, -1);
+            return inode_id;
+        }
+    }
+    return claim_chunk_inode(fs, g);
+}
+
+
+/**
+ * @brief 从第g组开始依次在各组中占用want个空闲inode, 每组的位图只扫描一遍, 各组都用完时从chunk中分配
+ * @return 返回占用的inode数, 不足want个时说明空间不足或inode表清零失败; inode_id存放到inode_ids中
+ */
+static int claim_inodes(filesys *fs, uint32_t g, int want, int *inode_ids)
+{
+    uint32_t count = atomic_load(&fs->group_count);
+    int num = 0;
+    for(uint32_t i=0; i<count && num<want; i++)
+    {
+        uint32_t cur = (g + i) % count;
+        if(atomic_load(&group_at(fs, cur)->free_inodes) <= 0)
+            continue;
+        _Atomic uint32_t *map = load_bitmap(fs, cur, 1);
+        if(map == NULL)
+            continue;
+        // 位号先放在inode_ids中, 再换算成inode_id
+        int *bits = inode_ids + num;
+        int got = claim_bits(map, 0, fs->geo.inodes_per_group/32, want - num, bits);
+        if(got > 0 && init_inode_table(fs, cur, bits[got-1]) != 0)
+        {
+            for(int k=0; k<got; k++)
+                release_bit(map, bits[k]);
+            printf("fail to initialize inode table of group %u\n", cur);
+            return num;
+        }
+        for(int k=0; k<got; k++)
+        {
+            bits[k] += cur*fs->geo.inodes_per_group;
+            count_inode(fs, bits[k], -1);
+        }
+        num += got;
+    }
+    for(; num<want; num++)
+    {
+        int inode_id = claim_chunk_inode(fs, g);
+        if(inode_id < 0)
+            break;
+        inode_ids[num] = inode_id;
+    }
+    return num;
+}
+
+
+static int cmp_inode_id(const void *a, const void *b)
+{
+    int x = *(const int*)a, y = *(const int*)b;
+    return x < y ? -1 : x > y;
+}
+
+
+/**
+ * @brief 为parent_id目录获取一个type类型的空闲inode
+ * @return 成功初始化返回inode的id,失败返回-1
+ */
+int get_free_inode(filesys *fs, int parent_id, int type)
+{
+    int inode_id = claim_inode(fs, find_inode_group(fs, parent_id, type));
+    if(inode_id < 0)
+    {
+        printf("No more inodes\n");
+        return -1;
+    }
+    sync_spblock(fs);
+    return inode_id;
+}
+
+
+/**
+ * @brief 为parent_id目录获取inode_num个文件的空闲inode, 获得的inode_id按从小到大存到inodes_index中
+ * @note 优先放在父目录所在的块组
+ * @return 成功返回0, 失败返回-1
+ */
+int get_free_inodes(filesys *fs, int parent_id, int inode_num, int* inodes_index)
+{
+    if(inode_num <= 0)
+        return 0;
+
+    int num = claim_inodes(fs, find_inode_group(fs, parent_id, TYPE_FILE), inode_num, inodes_index);
+    if(num < inode_num)
+    {
+        for(int k=0; k<num; k++)
+            put_free_inode(fs, inodes_index[k]);
+        printf("No more inodes\n");
+        return -1;
+    }
+    // 每组内是有序的, 从后面的组绕回前面的组时才需要排序
+    qsort(inodes_index, num, sizeof(int), cmp_inode_id);
+    sync_spblock(fs);
+    return 0;
+}
+
+
+/**
+ * @brief 释放inode_id对应的inode
+ */
+void put_free_inode(filesys *fs, int inode_id)
+{
+    if(inode_id >= DYNAMIC_INODE_BASE)
+    {
+        release_chunk_inode(fs, inode_id);
+        sync_spblock(fs);
+        return;
+    }
+    _Atomic uint32_t *map = load_bitmap(fs, inode_id / fs->geo.inodes_per_group, 1);
+    if(map != NULL)
+        release_bit(map, inode_id % fs->geo.inodes_per_group);
+    count_inode(fs, inode_id, 1);
+    sync_spblock(fs);
+}
+
+
+/**
+ * @brief 获取空闲块, 从goal附近开始找, block_num为要获取的块数, 获得的block_id存到block_index中
+ * @return 成功返回0, 失败返回-1
+ */
+int get_free_block(filesys *fs, uint64_t goal, int block_num, uint64_t* blocks_index)
+{
+    // 预留给延迟分配的块不能再分配出去
+    if(free_block_total(fs) - atomic_load(&fs->delalloc_blocks) < block_num)
+    {
+        release_all_reservations(fs, -1);
+        if(free_block_total(fs) - atomic_load(&fs->delalloc_blocks) < block_num)
+        {
+            printf("No enough free blocks\n");
+            return -1;
+        }
+    }
+
+    int retried = 0;
+    for(int k=0; k<block_num; k++)
+    {
+        int n = claim_blocks(fs, goal, 1, &blocks_index[k]);
+        if(n == 0 && !retried)
+        {
+            // 空间不足时先回收预留窗口再重试一次
+            retried = 1;
+            release_all_reservations(fs, -1);
+            n = claim_blocks(fs, goal, 1, &blocks_index[k]);
+        }
+        if(n == 0)
+        {
+            for(int l=0; l<k; l++)
+                release_blocks(fs, blocks_index[l], 1);
+            sync_spblock(fs);
+            printf("No enough free blocks\n");
+            return -1;
+        }
+        goal = blocks_index[k] + 1;
+    }
+    sync_spblock(fs);
+    return 0;
+}
+
+
+/**
+ * @brief 为一个延迟分配的块预留额度, 保证刷回时一定能分配到块
+ * @return 成功返回0, 空间不足返回-1
+ * @note 调用者需要持有inode_id文件的写锁
+ */
+static int reserve_delalloc(filesys *fs, int inode_id)
+{
+    if(atomic_fetch_add(&fs->delalloc_blocks, 1) < free_block_total(fs))
+        return 0;
+    // 空间不足时先回收其他文件的预留窗口再检查一次
+    release_all_reservations(fs, inode_id);
+    if(atomic_load(&fs->delalloc_blocks) <= free_block_total(fs))
+        return 0;
+    atomic_fetch_sub(&fs->delalloc_blocks, 1);
+    printf("No enough free blocks\n");
+    return -1;
+}
+
+
+/**
+ * @brief 从path的*pos处取出下一级的名字存放到name中, 并将*pos移动到该名字之后
+ * @return 取到名字返回1, 已经到达路径末尾返回0
+ */
+static int next_name(char *path, int *pos, char *name)
+{
+    int i = *pos;
+    int j = 0;
+    while(path[i] == '/')
+        i++;
+    if(path[i] == '\0')
+    {
+        *pos = i;
+        return 0;
+    }
+    while(path[i] != '/' && path[i] != '\0')
+    {
+        if(j < 120)
+            name[j++] = path[i];
+        i++;
+    }
+    name[j] = '\0';
+    *pos = i;
+    return 1;
+}
+
+
+/**
+ * @brief 在目录dir_inode的目录块中查找名字为name, 类型为type的目录项
+ * @return 找到返回其inode_id, 否则返回-1
+ * @note 调用者需要持有该目录的锁
+ */
+static int scan_dir(filesys *fs, inode *dir_inode, char *name, int type)
+{
+    for(int i=0; i<6; i++)
+    {
+        if(dir_inode->block_point[i] == 0)
+            continue;
+        cache_buf *block = get_meta_block(fs, dir_inode->block_point[i]);
+        if(block == NULL)
+            return -1;
+        dir_item *dir_table = (dir_item*)block->data;
+        int inode_id = -1;
+        for(uint32_t j=0; j<fs->geo.dir_items_each_block && inode_id<0; j++)
+        {
+            if(dir_table[j].valid==DIR_VALID
+                && dir_table[j].type==type
+                && !strcmp(dir_table[j].name, name))
+                inode_id = dir_table[j].inode_id;
+        }
+        put_meta_block(fs, block);
+        if(inode_id >= 0)
+            return inode_id;
+    }
+    return -1;
+}
+
+
+/**
+ * @brief 把table中num个目录项中的有效项追加到快照snap中
+ */
+static void collect_dir_items(dir_snapshot *snap, dir_item *table, int num)
+{
+    for(int j=0; j<num; j++)
+    {
+        if(table[j].valid==DIR_VALID && table[j].name[0]!='\0')
+            snap->items[snap->num++] = table[j];
+    }
+}
+
+
+/**
+ * @brief 从磁盘读取dir_id目录的所有有效目录项, 构建目录快照
+ * @return 成功返回快照, dir_id不是目录或读取失败返回NULL
+ * @note 调用者需要持有该目录的锁
+ */
+static dir_snapshot* build_dir_snapshot(filesys *fs, int dir_id)
+{
+    inode dir_inode;
+    if(read_inode(fs, dir_id, &dir_inode) != 0 || dir_inode.file_type != TYPE_FOLDER)
+        return NULL;
+
+    // 目录块都在缓存中时直接从缓存块中收集目录项; 否则整个目录一次读入, 连续的目录块合并成一次读取后放入缓存
+    int per = fs->geo.dir_items_each_block;
+    dir_snapshot *snap = malloc(sizeof(dir_snapshot) + 6*per*sizeof(dir_item));
+    snap->num = 0;
+    cache_buf *blocks[6] = { NULL };
+    int missing = 0;
+    for(int i=0; i<6 && !missing; i++)
+    {
+        if(dir_inode.block_point[i] != 0)
+            missing = (blocks[i] = cache_lookup(fs->cache, CACHE_META_OWNER, dir_inode.block_point[i])) == NULL;
+    }
+    for(int i=0; i<6; i++)
+    {
+        if(blocks[i] == NULL)
+            continue;
+        if(!missing)
+            collect_dir_items(snap, (dir_item*)blocks[i]->data, per);
+        put_meta_block(fs, blocks[i]);
+    }
+    if(!missing)
+        return snap;
+
+    // 没有目录块的位置读出全0, 都是无效项
+    uint32_t bs = fs->geo.block_size;
+    dir_item *tables = malloc(6 * bs);
+    if(read_blocks_from_disk(fs, dir_inode.block_point, 6, (char*)tables) != 0)
+    {
+        free(tables);
+        free(snap);
+        return NULL;
+    }
+    for(int i=0; i<6; i++)
+    {
+        if(dir_inode.block_point[i] != 0)
+            cache_insert(fs->cache, CACHE_META_OWNER, dir_inode.block_point[i], dir_inode.block_point[i], (char*)tables + (size_t)i*bs);
+    }
+    collect_dir_items(snap, tables, 6*per);
+    free(tables);
+    return snap;
+}
+
+
+/**
+ * @brief 获取dir_id目录的快照, 未缓存时持有目录读锁从磁盘构建
+ * @return 成功返回快照, 失败返回NULL
+ * @note 调用者需要在epoch_enter()/epoch_exit()之间调用, 并且不能持有该目录的锁
+ */
+static dir_snapshot* get_dir_snapshot(filesys *fs, int dir_id)
+{
+    cache_slot *slot = inode_slot(fs->dcache, dir_id, 1);
+    dir_snapshot *snap = atomic_load(slot);
+    if(snap != NULL)
+        return snap;
+
+    inode_rdlock(fs, dir_id);
+    snap = atomic_load(slot);
+    if(snap == NULL)
+    {
+        dir_snapshot *built = build_dir_snapshot(fs, dir_id);
+        // 多个读者可能同时构建, 只发布第一个
+        if(built != NULL && !atomic_compare_exchange_strong(slot, (void**)&snap, built))
+            free(built);
+        else
+            snap = built;
+    }
+    inode_unlock(fs, dir_id);
+    return snap;
+}
+
+
+/**
+ * @brief 把新建的num个目录项加入dir_id目录的快照, 发布新版本
+ * @note 调用者需要持有该目录的写锁; 目录还没有快照时什么也不做, 等读者按需构建
+ */
+static void dir_snapshot_add(filesys *fs, int dir_id, dir_item *items, int num)
+{
+    cache_slot *slot = inode_slot(fs->dcache, dir_id, 0);
+    dir_snapshot *old = slot != NULL ? atomic_load(slot) : NULL;
+    if(old == NULL)
+        return;
+    dir_snapshot *snap = malloc(sizeof(dir_snapshot) + (old->num + num)*sizeof(dir_item));
+    memcpy(snap->items, old->items, old->num*sizeof(dir_item));
+    memcpy(snap->items + old->num, items, num*sizeof(dir_item));
+    snap->num = old->num + num;
+    atomic_store(slot, snap);
+    epoch_retire(old);
+}
+
+
+/**
+ * @brief 从dir_id目录的快照中去掉inode_id的目录项, 发布新版本
+ * @note 调用者需要持有该目录的写锁; 目录还没有快照时什么也不做
+ */
+static void dir_snapshot_remove(filesys *fs, int dir_id, int inode_id)
+{
+    cache_slot *slot = inode_slot(fs->dcache, dir_id, 0);
+    dir_snapshot *old = slot != NULL ? atomic_load(slot) : NULL;
+    if(old == NULL)
+        return;
+    dir_snapshot *snap = malloc(sizeof(dir_snapshot) + old->num*sizeof(dir_item));
+    snap->num = 0;
+    for(int i=0; i<old->num; i++)
+    {
+        if(old->items[i].inode_id != (uint32_t)inode_id)
+            snap->items[snap->num++] = old->items[i];
+    }
+    atomic_store(slot, snap);
+    epoch_retire(old);
+}
+
+
+/**
+ * @brief 在dir_id目录中查找名字为name, 类型为type的目录项
+ * @return 找到返回其inode_id, 否则返回-1
+ * @note 在目录快照上查找, 命中缓存时不加锁
+ */
+static int find_in_dir(filesys *fs, int dir_id, char *name, int type)
+{
+    int inode_id = -1;
+
+    epoch_enter();
+    dir_snapshot *snap = get_dir_snapshot(fs, dir_id);
+    for(int i=0; snap!=NULL && i<snap->num; i++)
+    {
+        if(snap->items[i].type==type && !strcmp(snap->items[i].name, name))
+        {
+            inode_id = snap->items[i].inode_id;
+            break;
+        }
+    }
+    epoch_exit();
+    return inode_id;
+}
+
+
+/**
+ * @brief 找到上一级目录的inode_id, 最后一级的名字存放到name中
+ * @return 成功初始化返回inode_id, 失败返回-1
+ */
+int find_prev_path(filesys *fs, char *path, char *name)
+{
+    int pos = 0;
+    int inode_id = 0;
+    char next[121];
+
+    if(!next_name(path, &pos, name))
+    {
+        name[0] = '\0';
+        return 0;
+    }
+    while(next_name(path, &pos, next))
+    {
+        inode_id = find_in_dir(fs, inode_id, name, TYPE_FOLDER);
+        if(inode_id < 0)
+            return -1;
+        strcpy(name, next);
+    }
+    return inode_id;
+}
+
+
+/**
+ * @brief 找到当前目录的inode_id
+ * @return 成功初始化返回inode_id, 失败返回-1
+ */
+int find_cur_path(filesys *fs, char *path, char *name)
+{
+    int pos = 0;
+    int inode_id = 0;
+
+    while(next_name(path, &pos, name))
+    {
+        inode_id = find_in_dir(fs, inode_id, name, TYPE_FOLDER);
+        if(inode_id < 0)
+            return -1;
+    }
+    return inode_id;
+}
+
+
+/**
+ * @brief 找到file的inode_id
+ * @return 成功初始化返回inode_id, 失败返回-1
+ */
+int find_cur_file(filesys *fs, char *path, char *name)
+{
+    int prev_path_inode_id = find_prev_path(fs, path, name);
+    if(prev_path_inode_id < 0 || name[0] == '\0')
+        return -1;
+    return find_in_dir(fs, prev_path_inode_id, name, TYPE_FILE);
+}
+
+
+/**
+ * @brief 给目标文件或文件夹创建dir_item
+ * @param prev_path_inode_id为上一级目录的inode_id
+ * @param inode_prev_path为上一级目录的inode
+ * @param dir_item_index为创建的dir_item在目录快的位置
+ * @param dir_block为dir_item所在目录块的句柄, 调用者直接在其中填写dir_item, 用完后调用put_meta_block()
+ * @return 成功初始化返回0, 失败返回-1
+ * @note 调用者需要持有上一级目录的写锁
+ */
+int create_dir_item(filesys *fs, int prev_path_inode_id, inode *inode_prev_path, int*dir_item_index, cache_buf **dir_block)
+{
+    //优先从上一级目录中已有的目录块找到空闲的dir_item.
+    for(int i=0; i<6; i++)
+    {
+        if(inode_prev_path->block_point[i] != 0)
+        {
+            cache_buf *block = get_meta_block(fs, inode_prev_path->block_point[i]);
+            if(block == NULL)
+                return -1;
+            dir_item *dir_table = (dir_item*)block->data;
+            for(uint32_t j=0; j<fs->geo.dir_items_each_block; j++)
+            {
+                if(dir_table[j].valid==DIR_INVALID)
+                {
+                    inode_prev_path->size++;
+                    write_inode(fs, prev_path_inode_id, inode_prev_path);
+                    *dir_block = block;
+                    *dir_item_index = j;
+                    return 0;
+                }
+            }
+            put_meta_block(fs, block);
+        }
+    }
+
+    //如果上一级目录的目录块已经没有空闲的dir_item
+    for(int i=0; i<6; i++)
+    {
+        if(inode_prev_path->block_point[i] == 0)
+        {
+            //如果上一级目录有空闲的block_point
+            //则申请新的目录块
+            //并且让空闲的block_point指向目标文件夹的block
+            uint64_t block_id;
+            if(get_free_block(fs, block_goal(fs, prev_path_inode_id, inode_prev_path, i), 1, &block_id) < 0)
+                return -1;
+            inode_prev_path->block_point[i] = block_id;
+            inode_prev_path->size++ ;
+            write_inode(fs, prev_path_inode_id, inode_prev_path);
+            *dir_block = get_new_meta_block(fs, block_id);
+            *dir_item_index = 0;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+
+/**
+ * @brief 读取path文件夹中的目录项, 最多读取max_items个, 存放到items中
+ * @return 成功返回目录项数, 失败返回-1
+ */
+int read_dir(filesys *fs, char *path, dir_item *items, int max_items)
+{
+    char name[121];
+    memset(name, 0, 121);
+
+    //找到path文件夹对应的inode_id
+    int inode_id = find_cur_path(fs, path, name);
+    if(inode_id < 0)
+    {
+        printf("Folder %s is not exist\n", name);
+        return -1;
+    }
+
+    //从目录快照中复制目录项, 命中缓存时不加锁
+    int num = -1;
+    epoch_enter();
+    dir_snapshot *snap = get_dir_snapshot(fs, inode_id);
+    if(snap != NULL)
+    {
+        num = snap->num < max_items ? snap->num : max_items;
+        memcpy(items, snap->items, num*sizeof(dir_item));
+    }
+    epoch_exit();
+    return num;
+}
+
+
+/**
+ * @brief 打印出path中的文件和文件夹
+ * @return
+ */
+void ls(filesys *fs, char *path)
+{
+    dir_item *items = malloc(6*fs->geo.dir_items_each_block*sizeof(dir_item));
+    int num = read_dir(fs, path, items, 6*fs->geo.dir_items_each_block);
+    if(num >= 0)
+    {
+        printf(".\n");
+        printf("..\n");
+        for(int i=0; i<num; i++)
+            printf("%s\n", items[i].name);
+    }
+    free(items);
+}
+
+
+/**
+ * @brief 查找path对应的文件或文件夹, 并将其inode存放到stat中
+ * @return 成功返回inode_id, 失败返回-1
+ */
+int lookup(filesys *fs, char *path, inode *stat)
+{
+    char name[121];
+    memset(name, 0, 121);
+
+    int inode_id = find_cur_file(fs, path, name);
+    if(inode_id < 0)
+    {
+        memset(name, 0, 121);
+        inode_id = find_cur_path(fs, path, name);
+    }
+    if(inode_id < 0)
+        return -1;
+
+    return read_inode(fs, inode_id, stat) == 0 ? inode_id : -1;
+}
+
+
+/**
+ * @brief 在path的上一级目录中创建类型为type的目录项及其inode
+ * @return 成功返回新的inode_id, 失败返回-1
+ * @note 调用者需要持有快照屏障的读锁
+ */
+static int do_create_entry(filesys *fs, char *path, int type)
+{
+    char name[121];
+    memset(name, 0, 121);
+
+    int prev_path_inode_id = find_prev_path(fs, path, name);
+    if(prev_path_inode_id < 0)
+    {
+        printf("%s %s doesn't exist\n", type==TYPE_FOLDER ? "Folder" : "File", name);
+        return -1;
+    }
+    if(name[0]=='\0')
+        return -1;
+
+    // 持有上一级目录的写锁, 检查是否重名和创建dir_item是原子的
+    inode_wrlock(fs, prev_path_inode_id);
+    inode prev_path_inode;
+    if(read_inode(fs, prev_path_inode_id, &prev_path_inode) != 0)
+    {
+        inode_unlock(fs, prev_path_inode_id);
+        return -1;
+    }
+    if(scan_dir(fs, &prev_path_inode, name, type) >= 0)
+    {
+        inode_unlock(fs, prev_path_inode_id);
+        printf("%s %s is already exist\n", type==TYPE_FOLDER ? "Folder" : "file", path);
+        return -1;
+    }
+
+    //为目标申请inode
+    int inode_new_id = get_free_inode(fs, prev_path_inode_id, type);
+    if(inode_new_id < 0)
+    {
+        inode_unlock(fs, prev_path_inode_id);
+        return -1;
+    }
+
+    //为目标创建dir_item
+    cache_buf *dir_block; // dir_item所在的目录块
+    int dir_item_index; //dir_item在块中的位置
+    if(create_dir_item(fs, prev_path_inode_id, &prev_path_inode, &dir_item_index, &dir_block) < 0)
+    {
+        inode_unlock(fs, prev_path_inode_id);
+        put_free_inode(fs, inode_new_id);
+        printf("cannot create dir_item for %s\n", path);
+        return -1;
+    }
+
+    //设置目标的inode, 文件的size为字节数
+    inode inode_new;
+    memset(&inode_new, 0, sizeof(inode));
+    inode_new.size = type==TYPE_FOLDER ? 1 : 0;
+    inode_new.file_type = type;
+    inode_new.link = 1;
+    write_inode(fs, inode_new_id, &inode_new);
+    if(type == TYPE_FOLDER)
+    {
+        count_dir(fs, inode_new_id, 1);
+        sync_spblock(fs);
+    }
+
+    //设置目标的dir_item
+    dir_item *item = (dir_item*)dir_block->data + dir_item_index;
+    item->inode_id = inode_new_id;
+    item->valid = DIR_VALID;
+    item->type = type;
+    strcpy(item->name, name);
+    mark_meta_dirty(fs, dir_block);
+    dir_snapshot_add(fs, prev_path_inode_id, item, 1);
+    put_meta_block(fs, dir_block);
+
+    inode_unlock(fs, prev_path_inode_id);
+    return inode_new_id;
+}
+
+
+/**
+ * @brief 持有快照屏障的读锁执行do_create_entry, 参数和返回值相同
+ */
+static int create_entry(filesys *fs, char *path, int type)
+{
+    if(check_writable(fs) != 0)
+        return -1;
+    pthread_rwlock_rdlock(&fs->snapshot_barrier);
+    int ret = do_create_entry(fs, path, type);
+    pthread_rwlock_unlock(&fs->snapshot_barrier);
+    return ret;
+}
+
+
+/**
+ * @brief 创建新的文件夹
+ * @return 成功则返回文件夹的inode_id,否则返回-1
+ */
+int mkdir(filesys *fs, char *path)
+{
+    return create_entry(fs, path, TYPE_FOLDER);
+}
+
+
+/**
+ * @brief 创建文件
+ * @return 成功初始化返回文件的inode_id, 失败返回-1
+ */
+int touch(filesys *fs, char *path)
+{
+    return create_entry(fs, path, TYPE_FILE);
+}
+
+
+/**
+ * @brief 在表中查找尾块block
+ * @note 调用者需要持有tail_lock
+ */
+static tail_block* find_tail_locked(filesys *fs, uint64_t block)
+{
+    tail_block *tb = fs->tail_hash[block % TAIL_HASH];
+    while(tb != NULL && tb->block != block)
+        tb = tb->hash_next;
+    return tb;
+}
+
+
+/**
+ * @brief 取得尾块block的内容, 不在尾块缓存中时从磁盘读入, 替换掉同一位置的旧块
+ * @return 成功返回缓存中的内容, 读取失败返回NULL
+ * @note 调用者需要持有tail_lock
+ */
+static char* tail_data_locked(filesys *fs, uint64_t block)
+{
+    tail_cached *tc = &fs->tail_cache[block % TAIL_CACHE];
+    if(tc->block == block && tc->data != NULL)
+        return tc->data;
+    if(tc->data == NULL)
+        tc->data = malloc(fs->geo.block_size);
+    tc->block = 0;
+    if(read_block_from_disk(fs, block, tc->data) != 0)
+        return NULL;
+    tc->block = block;
+    return tc->data;
+}
+
+
+/**
+ * @brief 为len个字节的数据分配一个尾块槽并写入
+ * @note 从能放下len的最小一类中有空闲槽的尾块分配, 没有时在goal附近分配一个新的尾块
+ * @return 成功返回0, 尾块号和槽号存放到block和slot中; len太大或空间不足返回-1
+ */
+static int tail_alloc(filesys *fs, const char *data, uint32_t len, uint64_t goal, uint64_t *block, int *slot)
+{
+    int c = 0;
+    while(c < TAIL_CLASSES && len > fs->geo.block_size / (16 >> c))
+        c++;
+    if(c == TAIL_CLASSES)
+        return -1;
+
+    // 分配新块时不能持有tail_lock, 写回超级块时要加这个锁
+    uint64_t new_block = 0;
+    pthread_mutex_lock(&fs->tail_lock);
+    if(fs->partial[c] == NULL)
+    {
+        pthread_mutex_unlock(&fs->tail_lock);
+        if(get_free_block(fs, goal, 1, &new_block) < 0)
+            return -1;
+        pthread_mutex_lock(&fs->tail_lock);
+        tail_block *tb = malloc(sizeof(tail_block));
+        tb->block = new_block;
+        tb->used_mask = 0;
+        tb->slots = 16 >> c;
+        add_tail_locked(fs, tb);
+        // 新块不用从磁盘读入
+        tail_cached *tc = &fs->tail_cache[new_block % TAIL_CACHE];
+        if(tc->data == NULL)
+            tc->data = malloc(fs->geo.block_size);
+        memset(tc->data, 0, fs->geo.block_size);
+        tc->block = new_block;
+    }
+
+    tail_block *tb = fs->partial[c];
+    char *page = tail_data_locked(fs, tb->block);
+    int k = __builtin_ctz(~tb->used_mask);
+    uint32_t slot_size = fs->geo.block_size / tb->slots;
+    int ret = -1;
+    if(page != NULL)
+    {
+        memcpy(page + k*slot_size, data, len);
+        memset(page + k*slot_size + len, 0, slot_size - len);
+        ret = write_block_to_disk(fs, tb->block, page);
+    }
+    if(ret == 0)
+    {
+        tb->used_mask |= 1u << k;
+        if(tb->used_mask == (1u << tb->slots) - 1)
+        {
+            fs->partial[c] = tb->partial_next;
+            tb->in_partial = 0;
+        }
+        fs->tail_dirty = 1;
+        *block = tb->block;
+        *slot = k;
+    }
+    pthread_mutex_unlock(&fs->tail_lock);
+    return ret;
+}
+
+
+/**
+ * @brief 释放尾块block的第slot个槽, 尾块全空时释放这个块
+ * @return 释放了尾块返回1, 否则返回0
+ */
+static int tail_free(filesys *fs, uint64_t block, int slot)
+{
+    int freed = 0;
+    pthread_mutex_lock(&fs->tail_lock);
+    tail_block *tb = find_tail_locked(fs, block);
+    if(tb != NULL)
+    {
+        int c = __builtin_ctz(16 / tb->slots);
+        tb->used_mask &= ~(1u << slot);
+        if(tb->used_mask == 0)
+        {
+            tail_block **p = &fs->tail_hash[block % TAIL_HASH];
+            while(*p != tb)
+                p = &(*p)->hash_next;
+            *p = tb->hash_next;
+            p = &fs->partial[c];
+            while(tb->in_partial && *p != tb)
+                p = &(*p)->partial_next;
+            if(tb->in_partial)
+                *p = tb->partial_next;
+            if(fs->tail_cache[block % TAIL_CACHE].block == block)
+                fs->tail_cache[block % TAIL_CACHE].block = 0;
+            free(tb);
+            fs->tail_count--;
+            freed = 1;
+        }
+        else if(!tb->in_partial)
+        {
+            tb->partial_next = fs->partial[c];
+            fs->partial[c] = tb;
+            tb->in_partial = 1;
+        }
+        fs->tail_dirty = 1;
+    }
+    pthread_mutex_unlock(&fs->tail_lock);
+    if(freed)
+        release_blocks(fs, block, 1);
+    return freed;
+}
+
+
+/**
+ * @brief 从尾块block的第slot个槽读取len个字节到buf中
+ * @return 成功返回0, 失败返回-1
+ */
+static int tail_read(filesys *fs, uint64_t block, int slot, char *buf, uint32_t len)
+{
+    int ret = -1;
+    pthread_mutex_lock(&fs->tail_lock);
+    tail_block *tb = find_tail_locked(fs, block);
+    char *page = tb != NULL ? tail_data_locked(fs, block) : NULL;
+    if(page != NULL)
+    {
+        memcpy(buf, page + slot * (fs->geo.block_size / tb->slots), len);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&fs->tail_lock);
+    return ret;
+}
+
+
+static int tail_slot_of(inode *node)
+{
+    return (node->flags & TAIL_SLOT_MASK) >> TAIL_SLOT_SHIFT;
+}
+
+
+/**
+ * @brief 释放node的所有数据: 共享的块去掉一个引用, 打包存放的文件释放它的槽
+ * @return 有块被释放返回1, 否则返回0
+ * @note 调用者负责写回node
+ */
+static int drop_file_data(filesys *fs, inode *node)
+{
+    int freed = 0;
+    if(node->flags & INODE_TAIL)
+        freed = tail_free(fs, node->block_point[0], tail_slot_of(node));
+    else
+    {
+        for(int i=0; i<6; i++)
+        {
+            if(node->block_point[i] != 0 && unref_block(fs, node->block_point[i]))
+            {
+                release_blocks(fs, node->block_point[i], 1);
+                freed = 1;
+            }
+        }
+    }
+    memset(node->block_point, 0, sizeof(node->block_point));
+    node->flags &= ~(INODE_COMPRESSED | INODE_TAIL | TAIL_SLOT_MASK);
+    return freed;
+}
+
+
+/**
+ * @brief 让node的副本也拥有这些数据: 数据块增加引用计数; 打包存放的文件很小, 直接复制到一个新的槽中
+ * @return 成功返回0, 失败返回-1; 复制槽时node改为指向新的槽
+ * @note 调用者需要持有原文件的锁
+ */
+static int share_file_data(filesys *fs, inode *node)
+{
+    if(node->flags & INODE_TAIL)
+    {
+        char data[fs->geo.block_size];
+        uint64_t block;
+        int slot;
+        if(tail_read(fs, node->block_point[0], tail_slot_of(node), data, node->size) != 0
+            || tail_alloc(fs, data, node->size, node->block_point[0], &block, &slot) != 0)
+            return -1;
+        node->block_point[0] = block;
+        node->flags = (node->flags & ~TAIL_SLOT_MASK) | slot << TAIL_SLOT_SHIFT;
+        return 0;
+    }
+    for(int i=0; i<6; i++)
+    {
+        if(node->block_point[i] != 0)
+            ref_block(fs, node->block_point[i]);
+    }
+    return 0;
+}
+
+
+/**
+ * @brief 检查len个字节的数据是否全为0
+ * @note 每次把32个字按位或到一起再判断, 编译器可以向量化内层循环; 不足256字节的尾部逐字节检查
+ */
+static int block_is_zero(const char *data, uint32_t len)
+{
+    uint32_t i = 0;
+    for(; i+256<=len; i+=256)
+    {
+        uint64_t words[32];
+        uint64_t acc = 0;
+        memcpy(words, data + i, 256);
+        for(int k=0; k<32; k++)
+            acc |= words[k];
+        if(acc != 0)
+            return 0;
+    }
+    for(; i<len; i++)
+    {
+        if(data[i] != 0)
+            return 0;
+    }
+    return 1;
+}
+
+
+/**
+ * @brief 读取压缩存放的文件的簇, 解压到raw中(6个块大小), 文件之后的部分填0
+ * @return 成功返回0, 失败返回-1
+ */
+static int load_cluster(filesys *fs, inode *file_inode, char *raw)
+{
+    uint32_t bs = fs->geo.block_size;
+    char *packed = malloc(6 * bs);
+    int ret = 0;
+    int k = 0;
+    while(k<6 && file_inode->block_point[k]!=0)
+        k++;
+    ret = read_blocks_from_disk(fs, file_inode->block_point, k, packed);
+    cluster_head *head = (cluster_head*)packed;
+    memset(raw, 0, 6 * bs);
+    if(ret == 0 && (k == 0 || head->packed_len > k*bs - sizeof(cluster_head)
+        || lz_decompress(packed + sizeof(cluster_head), head->packed_len, raw, 6*bs) != (int)head->raw_len))
+    {
+        printf("compressed cluster is corrupted\n");
+        ret = -1;
+    }
+    free(packed);
+    return ret;
+}
+
+
+/**
+ * @brief 第index块没有命中缓存时, 根据inode_id文件的顺序读状态决定连同这一块一起读入的块数
+ * @note 从上次预读结束的位置继续读时是顺序读, 预读窗口加倍, 否则减半;
+ *       只预读紧跟在这一块后面, 磁盘块号也连续的块, 它们合并成一次读取
+ * @return 要读入的块数, 至少为1
+ */
+static int readahead_blocks(filesys *fs, int inode_id, inode *file_inode, int index)
+{
+    readahead_state *ra = &fs->readahead[(uint32_t)inode_id % READAHEAD_SLOTS];
+    pthread_mutex_lock(&fs->readahead_lock);
+    if(ra->inode_id != inode_id)
+    {
+        // 第一次读这个文件, 从头开始读时才预读
+        ra->inode_id = inode_id;
+        ra->window = index == 0 ? READAHEAD_INIT : 0;
+    }
+    else if(index == ra->next)
+        ra->window = ra->window == 0 ? 1 : ra->window * 2;
+    else
+        ra->window /= 2;
+    if(ra->window > READAHEAD_MAX)
+        ra->window = READAHEAD_MAX;
+
+    int num = 1;
+    uint64_t block_id = file_inode->block_point[index];
+    while(num <= ra->window && index + num < 6 && file_inode->block_point[index + num] == block_id + num)
+        num++;
+    ra->next = index + num;
+    pthread_mutex_unlock(&fs->readahead_lock);
+    return num;
+}
+
+
+/**
+ * @brief 读取inode_id文件的第index块到buf中, 优先从缓存读取
+ * @note 压缩存放的文件没有命中时解压整个簇, 把所有块都放入缓存, 之后读其他块不用再解压
+ * @return 成功返回0, 该块是没有数据块也不在缓存中的洞时读出全0并返回1, 失败返回-1
+ * @note 调用者需要持有该文件的锁
+ */
+static int read_file_block(filesys *fs, int inode_id, inode *file_inode, int index, char *buf)
+{
+    cache_buf *cached = cache_lookup(fs->cache, inode_id, index);
+    if(cached != NULL)
+    {
+        memcpy(buf, cached->data, fs->geo.block_size);
+        cache_release(fs->cache, cached);
+        return 0;
+    }
+
+    // 打包存放的文件只有第0块, 从共用的尾块缓存中读取, 不占用文件的缓存块
+    if(file_inode->flags & INODE_TAIL)
+    {
+        memset(buf, 0, fs->geo.block_size);
+        if(index != 0)
+            return 1;
+        return tail_read(fs, file_inode->block_point[0], tail_slot_of(file_inode), buf, file_inode->size);
+    }
+
+    if(file_inode->flags & INODE_COMPRESSED)
+    {
+        char *raw = malloc(6 * fs->geo.block_size);
+        int ret = load_cluster(fs, file_inode, raw);
+        if(ret == 0)
+        {
+            // 解压出的块没有对应的磁盘块, block_id为0; 写之前整个文件会先解压成普通文件
+            for(int i=0; i<6; i++)
+                cache_insert(fs->cache, inode_id, i, 0, raw + i*fs->geo.block_size);
+            memcpy(buf, raw + index*fs->geo.block_size, fs->geo.block_size);
+        }
+        free(raw);
+        return ret;
+    }
+
+    uint64_t block_id = file_inode->block_point[index];
+    if(block_id == 0)
+    {
+        memset(buf, 0, fs->geo.block_size);
+        return 1;
+    }
+    int num = readahead_blocks(fs, inode_id, file_inode, index);
+    if(num == 1)
+    {
+        if(read_block_from_disk(fs, block_id, buf) != 0)
+            return -1;
+        cache_insert(fs->cache, inode_id, index, block_id, buf);
+        return 0;
+    }
+
+    // 预读的块和这一块一起读入, 都放入缓存
+    uint32_t bs = fs->geo.block_size;
+    char *run = malloc((size_t)num * bs);
+    int ret = read_blocks_from_disk(fs, file_inode->block_point + index, num, run);
+    if(ret == 0)
+    {
+        for(int i=0; i<num; i++)
+            cache_insert(fs->cache, inode_id, index + i, block_id + i, run + (size_t)i*bs);
+        memcpy(buf, run, bs);
+    }
+    free(run);
+    return ret;
+}
+
+
+/**
+ * @brief 将data中的n个字节写入inode_id文件第index块的block_off处, 只写到缓存中
+ * @note 还没有数据块的位置不分配磁盘块, 只预留额度, 等刷回时再一起分配; 向洞中写0什么也不用做
+ * @return 成功返回0, 失败返回-1
+ * @note 调用者需要持有该文件的写锁
+ */
+static int write_file_block(filesys *fs, int inode_id, inode *file_inode, int index, uint32_t block_off, char *data, uint32_t n)
+{
+    cache_buf *buf = cache_lookup(fs->cache, inode_id, index);
+    if(buf == NULL && file_inode->block_point[index] == 0 && block_is_zero(data, n))
+        return 0;
+    if(buf != NULL && !buf->dirty && buf->block_id == 0 && reserve_delalloc(fs, inode_id) != 0)
+    {
+        // 刷回时被省略的全0块又要写入数据, 重新预留额度
+        cache_release(fs->cache, buf);
+        return -1;
+    }
+    if(buf == NULL)
+    {
+        // 部分写已有的块时先读出旧内容
+        char old[fs->geo.block_size];
+        uint64_t block_id = file_inode->block_point[index];
+        if(block_id != 0 && n < fs->geo.block_size && read_block_from_disk(fs, block_id, old) != 0)
+            return -1;
+        if(block_id == 0 && reserve_delalloc(fs, inode_id) != 0)
+            return -1;
+
+        buf = cache_create(fs->cache, inode_id, index, block_id);
+        if(block_id == 0)
+            memset(buf->data, 0, fs->geo.block_size);
+        else if(n < fs->geo.block_size)
+            memcpy(buf->data, old, fs->geo.block_size);
+    }
+    memcpy(buf->data + block_off, data, n);
+    cache_mark_dirty(fs->cache, buf);
+    cache_release(fs->cache, buf);
+    return 0;
+}
+
+
+/**
+ * @brief 压缩存放或打包存放的文件要写入之前, 先把整个文件展开到缓存中作为延迟分配的脏块, 释放压缩簇或尾块槽
+ * @return 成功或者文件是普通存放的返回0, 空间不足或读取失败返回-1
+ * @note 调用者需要持有该文件的写锁
+ */
+static int expand_file_locked(filesys *fs, int inode_id, inode *file_inode)
+{
+    uint32_t bs = fs->geo.block_size;
+    if(file_inode->flags & INODE_TAIL)
+    {
+        char data[bs];
+        memset(data, 0, bs);
+        if(tail_read(fs, file_inode->block_point[0], tail_slot_of(file_inode), data, file_inode->size) != 0
+            || reserve_delalloc(fs, inode_id) != 0)
+            return -1;
+        cache_drop(fs->cache, inode_id);
+        cache_buf *buf = cache_create(fs->cache, inode_id, 0, 0);
+        memcpy(buf->data, data, bs);
+        cache_mark_dirty(fs->cache, buf);
+        cache_release(fs->cache, buf);
+        if(drop_file_data(fs, file_inode))
+            sync_spblock(fs);
+        write_inode(fs, inode_id, file_inode);
+        return 0;
+    }
+    if(!(file_inode->flags & INODE_COMPRESSED))
+        return 0;
+    char *raw = malloc(6 * bs);
+    if(load_cluster(fs, file_inode, raw) != 0)
+    {
+        free(raw);
+        return -1;
+    }
+
+    // 先为所有非0的块预留额度, 预留不到时什么也不改
+    int zero[6];
+    int reserved = 0;
+    for(int i=0; i<6; i++)
+    {
+        zero[i] = block_is_zero(raw + i*bs, bs);
+        if(zero[i])
+            continue;
+        if(reserve_delalloc(fs, inode_id) != 0)
+        {
+            atomic_fetch_sub(&fs->delalloc_blocks, reserved);
+            free(raw);
+            return -1;
+        }
+        reserved++;
+    }
+
+    // 缓存中只有解压出的干净块
+    cache_drop(fs->cache, inode_id);
+    for(int i=0; i<6; i++)
+    {
+        if(zero[i])
+            continue;
+        cache_buf *buf = cache_create(fs->cache, inode_id, i, 0);
+        memcpy(buf->data, raw + i*bs, bs);
+        cache_mark_dirty(fs->cache, buf);
+        cache_release(fs->cache, buf);
+    }
+    drop_file_data(fs, file_inode);
+    write_inode(fs, inode_id, file_inode);
+    sync_spblock(fs);
+    free(raw);
+    return 0;
+}
+
+
+/**
+ * @brief 把启用了压缩的文件整个压缩成一个簇写回, 替换原来的数据块
+ * @param force为0时只在有脏块时压缩, 为1时也压缩还没有压缩的干净文件
+ * @return 按压缩格式写回了返回1; 不需要写回, 文件太小, 压缩省不下一个块或分配失败时返回0, 由调用者按普通文件写回
+ * @note 调用者需要持有该文件的写锁
+ */
+static int flush_compressed_locked(filesys *fs, int inode_id, inode *file_inode, int force)
+{
+    uint32_t bs = fs->geo.block_size;
+    int nblocks = (file_inode->size + bs - 1) / bs;
+    cache_buf *bufs[6];
+    int num = cache_dirty_bufs(fs->cache, inode_id, bufs, 6);
+    int delayed = 0;
+    for(int i=0; i<num; i++)
+    {
+        if(bufs[i]->block_id == 0)
+            delayed++;
+    }
+    if(nblocks < 2 || (num == 0 && (!force || (file_inode->flags & INODE_COMPRESSED))))
+    {
+        for(int i=0; i<num; i++)
+            cache_release(fs->cache, bufs[i]);
+        return 0;
+    }
+
+    int ret = 0;
+    char *raw = malloc(6 * bs);
+    char *packed = malloc(6 * bs);
+    for(int i=0; i<nblocks && ret==0; i++)
+    {
+        if(read_file_block(fs, inode_id, file_inode, i, raw + i*bs) < 0)
+            ret = -1;
+    }
+    int packed_len = -1;
+    if(ret == 0)
+        packed_len = lz_compress(raw, file_inode->size, packed + sizeof(cluster_head), (nblocks-1)*bs - sizeof(cluster_head));
+    if(packed_len < 0)
+        ret = -1;
+
+    // 脏块的预留额度先还回去, 压缩后的簇用get_free_block()一次分配
+    uint64_t blocks[6];
+    int k = (sizeof(cluster_head) + packed_len + bs - 1) / bs;
+    if(ret == 0)
+    {
+        cluster_head *head = (cluster_head*)packed;
+        head->raw_len = file_inode->size;
+        head->packed_len = packed_len;
+        atomic_fetch_sub(&fs->delalloc_blocks, delayed);
+        ret = get_free_block(fs, block_goal(fs, inode_id, file_inode, 0), k, blocks);
+        for(int i=0; i<k && ret==0; i++)
+        {
+            if(write_block_to_disk(fs, blocks[i], packed + i*bs) != 0)
+            {
+                for(int j=0; j<k; j++)
+                    release_blocks(fs, blocks[j], 1);
+                ret = -1;
+            }
+        }
+        if(ret != 0)
+            atomic_fetch_add(&fs->delalloc_blocks, delayed);
+    }
+    free(raw);
+    free(packed);
+    if(ret != 0)
+    {
+        for(int i=0; i<num; i++)
+            cache_release(fs->cache, bufs[i]);
+        return 0;
+    }
+
+    // 新簇写好之后再换掉旧的数据块
+    drop_file_data(fs, file_inode);
+    memcpy(file_inode->block_point, blocks, k * sizeof(uint64_t));
+    file_inode->flags |= INODE_COMPRESSED;
+    write_inode(fs, inode_id, file_inode);
+    for(int i=0; i<num; i++)
+    {
+        cache_mark_clean(fs->cache, bufs[i], 0);
+        cache_release(fs->cache, bufs[i]);
+    }
+    sync_spblock(fs);
+    return 1;
+}
+
+
+/**
+ * @brief 不超过半个块的文件写回时打包到尾块中, 替换原来的数据块
+ * @return 打包写回了返回1; 文件太大, 没有脏块, 数据全为0或分配失败时返回0, 由调用者按普通文件写回
+ * @note 调用者需要持有该文件的写锁
+ */
+static int flush_tail_locked(filesys *fs, int inode_id, inode *file_inode)
+{
+    if(file_inode->size == 0 || file_inode->size > fs->geo.block_size / 2)
+        return 0;
+    cache_buf *bufs[6];
+    int num = cache_dirty_bufs(fs->cache, inode_id, bufs, 6);
+    uint64_t block;
+    int slot;
+    int ret = num == 1 && bufs[0]->index == 0 && !block_is_zero(bufs[0]->data, file_inode->size)
+        && tail_alloc(fs, bufs[0]->data, file_inode->size, block_goal(fs, inode_id, file_inode, 0), &block, &slot) == 0;
+    if(ret)
+    {
+        if(bufs[0]->block_id == 0)
+            atomic_fetch_sub(&fs->delalloc_blocks, 1);
+        drop_file_data(fs, file_inode);
+        file_inode->block_point[0] = block;
+        file_inode->flags |= INODE_TAIL | slot << TAIL_SLOT_SHIFT;
+        write_inode(fs, inode_id, file_inode);
+        cache_mark_clean(fs->cache, bufs[0], 0);
+    }
+    for(int i=0; i<num; i++)
+        cache_release(fs->cache, bufs[i]);
+    if(ret)
+    {
+        // 之后从尾块缓存读取
+        cache_drop(fs->cache, inode_id);
+        sync_spblock(fs);
+    }
+    return ret;
+}
+
+
+/**
+ * @brief 将inode_id文件的脏块写回磁盘
+ * @note 延迟分配的块在这里才分配, 此时已经知道要分配的总块数, 可以一次预留一段连续的块
+ * @note 全0的块不写磁盘: 还没有数据块时不分配, 已有的数据块释放掉, 变成洞
+ * @return 成功返回0, 失败返回-1
+ * @note 调用者需要持有该文件的写锁
+ */
+static int flush_file_locked(filesys *fs, int inode_id, inode *file_inode)
+{
+    if((file_inode->flags & INODE_COMPRESS) && flush_compressed_locked(fs, inode_id, file_inode, 0))
+        return 0;
+    if(flush_tail_locked(fs, inode_id, file_inode))
+        return 0;
+
+    cache_buf *bufs[6];
+    int zero[6];
+    int num = cache_dirty_bufs(fs->cache, inode_id, bufs, 6);
+    int delayed = 0;
+    for(int i=0; i<num; i++)
+    {
+        zero[i] = block_is_zero(bufs[i]->data, fs->geo.block_size);
+        if(bufs[i]->block_id == 0 && !zero[i])
+            delayed++;
+    }
+
+    int ret = 0;
+    int allocated = 0;
+    int punched = 0;
+    uint64_t ids[6];
+    for(int i=0; i<num; i++)
+    {
+        uint64_t block_id = bufs[i]->block_id;
+        ids[i] = 0;
+        if(zero[i])
+        {
+            if(block_id == 0)
+                atomic_fetch_sub(&fs->delalloc_blocks, 1);
+            else
+            {
+                if(unref_block(fs, block_id))
+                    release_blocks(fs, block_id, 1);
+                file_inode->block_point[bufs[i]->index] = 0;
+                allocated = 1;
+                punched = 1;
+            }
+            cache_mark_clean(fs->cache, bufs[i], 0);
+            continue;
+        }
+        if(block_id == 0 && ret == 0)
+        {
+            if(get_file_block(fs, inode_id, file_inode, bufs[i]->index, delayed, &block_id) == 0)
+            {
+                delayed--;
+                atomic_fetch_sub(&fs->delalloc_blocks, 1);
+                file_inode->block_point[bufs[i]->index] = block_id;
+                bufs[i]->block_id = block_id;
+                allocated = 1;
+            }
+            else
+                ret = -1;
+        }
+        else if(block_id != 0 && block_refs(fs, block_id) > 1)
+        {
+            // 和其他文件共享的块第一次写回时复制到新块, 不能原地写
+            uint64_t copy_id;
+            if(ret == 0 && get_file_block(fs, inode_id, file_inode, bufs[i]->index, 1, &copy_id) == 0)
+            {
+                if(unref_block(fs, block_id))
+                    release_blocks(fs, block_id, 1);
+                block_id = copy_id;
+                file_inode->block_point[bufs[i]->index] = block_id;
+                bufs[i]->block_id = block_id;
+                allocated = 1;
+            }
+            else
+            {
+                // 分配失败时保持脏块, 下次刷回时重试
+                block_id = 0;
+                ret = -1;
+            }
+        }
+        ids[i] = block_id;
+    }
+
+    // 块号连续的脏块合并成一次写入
+    for(int i=0; i<num; )
+    {
+        int n = 1;
+        while(ids[i] != 0 && i+n < num && ids[i+n] == ids[i] + n)
+            n++;
+        if(ids[i] != 0 && write_bufs_to_disk(fs, ids[i], bufs + i, n) == 0)
+        {
+            for(int k=i; k<i+n; k++)
+                cache_mark_clean(fs->cache, bufs[k], ids[k]);
+        }
+        else if(ids[i] != 0)
+            ret = -1;
+        i += n;
+    }
+    for(int i=0; i<num; i++)
+        cache_release(fs->cache, bufs[i]);
+    // 先写数据块再写指向它们的inode
+    if(allocated)
+        write_inode(fs, inode_id, file_inode);
+    if(punched)
+        sync_spblock(fs);
+    return ret;
+}
+
+
+/**
+ * @brief 释放inode_id文件的所有数据块, 丢弃它的缓存块, 文件大小变为0
+ * @note 还没有刷回的延迟分配的块直接丢弃, 不经过分配器也不写磁盘; 调用者负责写回inode
+ * @note 调用者需要持有该文件的写锁
+ */
+static void truncate_file_locked(filesys *fs, int inode_id, inode *file_inode)
+{
+    atomic_fetch_sub(&fs->delalloc_blocks, cache_drop(fs->cache, inode_id));
+    release_reservation_locked(fs, inode_id);
+
+    // 共享的块只去掉一个引用
+    if(drop_file_data(fs, file_inode))
+        sync_spblock(fs);
+    file_inode->size = 0;
+}
+
+
+/**
+ * @brief 将src文件复制到dest文件中
+ * @note dest原有的数据块先释放; 复制的数据只写到缓存中, 刷回时才分配块, src中的洞和全0的块不复制
+ * @return 成功返回dest的inode_id, 失败返回-1
+ * @note 调用者需要持有快照屏障的读锁
+ */
+static int do_copy(filesys *fs, char *dest, char *src)
+{
+    char src_name[121];
+    memset(src_name, 0, 121);
+    int src_inode_id = find_cur_file(fs, src, src_name);
+    if(src_inode_id < 0)
+    {
+        printf("%s is not exist\n", src_name);
+        return -1;
+    }
+
+    // 持有src的读锁把数据读到内存中; 块大小最大64K, 从堆上分配
+    uint32_t bs = fs->geo.block_size;
+    char *data = malloc(6 * bs);
+    int hole[6];
+    inode src_inode;
+    inode_rdlock(fs, src_inode_id);
+    int ret = read_inode(fs, src_inode_id, &src_inode);
+    if(ret == 0 && src_inode.file_type != TYPE_FILE)
+    {
+        inode_unlock(fs, src_inode_id);
+        free(data);
+        printf("%s is not a file\n", src_name);
+        return -1;
+    }
+    for(int i=0; i<6 && ret==0; i++)
+    {
+        hole[i] = read_file_block(fs, src_inode_id, &src_inode, i, data + (size_t)i*bs);
+        if(hole[i] < 0)
+            ret = -1;
+        else if(!hole[i] && block_is_zero(data + (size_t)i*bs, bs))
+            hole[i] = 1;
+    }
+    inode_unlock(fs, src_inode_id);
+    if(ret != 0)
+    {
+        free(data);
+        return -1;
+    }
+
+    char dest_name[121];
+    memset(dest_name, 0, 121);
+    int dest_inode_id;
+    // 检测dest文件是否已经存在,如果没有则新建一个
+    if((dest_inode_id = find_cur_file(fs, dest, dest_name)) < 0)
+    {
+        dest_inode_id = touch(fs, dest);
+        if(dest_inode_id < 0)
+        {
+            free(data);
+            return -1;
+        }
+    }
+    if(dest_inode_id == src_inode_id)
+    {
+        free(data);
+        return dest_inode_id;
+    }
+
+    //获取dest文件的inode
+    inode dest_inode;
+    inode_wrlock(fs, dest_inode_id);
+    if(read_inode(fs, dest_inode_id, &dest_inode) != 0 || dest_inode.file_type != TYPE_FILE)
+    {
+        inode_unlock(fs, dest_inode_id);
+        free(data);
+        return -1;
+    }
+
+    truncate_file_locked(fs, dest_inode_id, &dest_inode);
+    for(int i=0; i<6 && ret==0; i++)
+    {
+        if(!hole[i])
+            ret = write_file_block(fs, dest_inode_id, &dest_inode, i, 0, data + (size_t)i*bs, bs);
+    }
+    dest_inode.size = ret == 0 ? src_inode.size : 0;
+    dest_inode.link = src_inode.link;
+    if(ret != 0)
+        truncate_file_locked(fs, dest_inode_id, &dest_inode);
+    write_inode(fs, dest_inode_id, &dest_inode);
+    inode_unlock(fs, dest_inode_id);
+    free(data);
+    return ret == 0 ? dest_inode_id : -1;
+}
+
+
+/**
+ * @brief 持有快照屏障的读锁执行do_copy, 参数和返回值相同
+ */
+int copy(filesys *fs, char *dest, char *src)
+{
+    if(check_writable(fs) != 0)
+        return -1;
+    pthread_rwlock_rdlock(&fs->snapshot_barrier);
+    int ret = do_copy(fs, dest, src);
+    pthread_rwlock_unlock(&fs->snapshot_barrier);
+    return ret;
+}
+
+
+/**
+ * @brief 将src文件以共享数据块的方式复制到dest文件中
+ * @note 只复制块指针并增加这些块的引用计数, 不复制数据; 任一个文件写某个共享块时才复制出新块
+ * @return 成功返回dest的inode_id, 失败返回-1
+ * @note 调用者需要持有快照屏障的读锁
+ */
+static int do_copy_reflink(filesys *fs, char *dest, char *src)
+{
+    char src_name[121];
+    memset(src_name, 0, 121);
+    int src_inode_id = find_cur_file(fs, src, src_name);
+    if(src_inode_id < 0)
+    {
+        printf("%s is not exist\n", src_name);
+        return -1;
+    }
+
+    // 先刷回src的脏块, 延迟分配的块这时才有块号, 之后src的数据都在磁盘上
+    inode src_inode;
+    inode_wrlock(fs, src_inode_id);
+    int ret = read_inode(fs, src_inode_id, &src_inode);
+    if(ret == 0 && src_inode.file_type != TYPE_FILE)
+    {
+        inode_unlock(fs, src_inode_id);
+        printf("%s is not a file\n", src_name);
+        return -1;
+    }
+    if(ret == 0)
+        ret = flush_file_locked(fs, src_inode_id, &src_inode);
+    if(ret == 0)
+        ret = share_file_data(fs, &src_inode);
+    inode_unlock(fs, src_inode_id);
+    if(ret != 0)
+        return -1;
+
+    char dest_name[121];
+    memset(dest_name, 0, 121);
+    inode dest_inode;
+    int dest_inode_id = find_cur_file(fs, dest, dest_name);
+    if(dest_inode_id < 0)
+        dest_inode_id = touch(fs, dest);
+    if(dest_inode_id >= 0 && dest_inode_id != src_inode_id)
+    {
+        inode_wrlock(fs, dest_inode_id);
+        if(read_inode(fs, dest_inode_id, &dest_inode) == 0 && dest_inode.file_type == TYPE_FILE)
+        {
+            truncate_file_locked(fs, dest_inode_id, &dest_inode);
+            memcpy(dest_inode.block_point, src_inode.block_point, sizeof(dest_inode.block_point));
+            dest_inode.size = src_inode.size;
+            dest_inode.flags = src_inode.flags;
+            dest_inode.link = src_inode.link;
+            write_inode(fs, dest_inode_id, &dest_inode);
+            inode_unlock(fs, dest_inode_id);
+            sync_spblock(fs);
+            return dest_inode_id;
+        }
+        inode_unlock(fs, dest_inode_id);
+        dest_inode_id = -1;
+    }
+
+    // 没有复制成功或者复制到自身时去掉前面增加的引用或复制出的槽
+    drop_file_data(fs, &src_inode);
+    sync_spblock(fs);
+    return dest_inode_id;
+}
+
+
+/**
+ * @brief 持有快照屏障的读锁执行do_copy_reflink, 参数和返回值相同
+ */
+int copy_reflink(filesys *fs, char *dest, char *src)
+{
+    if(check_writable(fs) != 0)
+        return -1;
+    pthread_rwlock_rdlock(&fs->snapshot_barrier);
+    int ret = do_copy_reflink(fs, dest, src);
+    pthread_rwlock_unlock(&fs->snapshot_barrier);
+    return ret;
+}
+
+
+/**
+ * @brief 启用(enable为1)或关闭path文件的压缩
+ * @note 启用时立即按压缩格式写回, 关闭时解压到缓存中, 之后按普通文件写回
+ * @return 成功返回0, 失败返回-1
+ * @note 调用者需要持有快照屏障的读锁
+ */
+static int do_set_compress(filesys *fs, char *path, int enable)
+{
+    char name[121];
+    memset(name, 0, 121);
+    int inode_id = find_cur_file(fs, path, name);
+    if(inode_id < 0)
+    {
+        printf("%s is not exist\n", name);
+        return -1;
+    }
+
+    inode file_inode;
+    int ret = -1;
+    inode_wrlock(fs, inode_id);
+    if(read_inode(fs, inode_id, &file_inode) == 0 && file_inode.file_type == TYPE_FILE)
+    {
+        if(enable)
+        {
+            file_inode.flags |= INODE_COMPRESS;
+            write_inode(fs, inode_id, &file_inode);
+            // 压缩省不下空间时照常写回脏块
+            ret = flush_compressed_locked(fs, inode_id, &file_inode, 1) ? 0 : flush_file_locked(fs, inode_id, &file_inode);
+        }
+        else if(expand_file_locked(fs, inode_id, &file_inode) == 0)
+        {
+            file_inode.flags &= ~INODE_COMPRESS;
+            write_inode(fs, inode_id, &file_inode);
+            ret = 0;
+        }
+    }
+    inode_unlock(fs, inode_id);
+    return ret;
+}
+
+
+/**
+ * @brief 持有快照屏障的读锁执行do_set_compress, 参数和返回值相同
+ */
+int set_compress(filesys *fs, char *path, int enable)
+{
+    if(check_writable(fs) != 0)
+        return -1;
+    pthread_rwlock_rdlock(&fs->snapshot_barrier);
+    int ret = do_set_compress(fs, path, enable);
+    pthread_rwlock_unlock(&fs->snapshot_barrier);
+    return ret;
+}
+
+
+/**
+ * @brief 从path文件的offset处读取len个字节到data中
+ * @return 成功返回读取的字节数, 失败返回-1
+ */
+int read_file(filesys *fs, char *path, uint32_t offset, char *data, uint32_t len)
+{
+    char name[121];
+    memset(name, 0, 121);
+    int inode_id = find_cur_file(fs, path, name);
+    if(inode_id < 0)
+    {
+        printf("%s is not exist\n", name);
+        return -1;
+    }
+
+    // 查找和加锁之间文件可能已经被删除
+    inode file_inode;
+    inode_rdlock(fs, inode_id);
+    if(read_inode(fs, inode_id, &file_inode) != 0 || file_inode.file_type != TYPE_FILE)
+    {
+        inode_unlock(fs, inode_id);
+        return -1;
+    }
+
+    if(offset >= file_inode.size)
+        len = 0;
+    else if(len > file_inode.size - offset)
+        len = file_inode.size - offset;
+
+    char buf[fs->geo.block_size];
+    uint32_t done = 0;
+    while(done < len)
+    {
+        uint32_t pos = offset + done;
+        uint32_t block_off = pos % fs->geo.block_size;
+        uint32_t n = fs->geo.block_size - block_off;
+        if(n > len - done)
+            n = len - done;
+
+        if(read_file_block(fs, inode_id, &file_inode, pos / fs->geo.block_size, buf) < 0)
+        {
+            inode_unlock(fs, inode_id);
+            return -1;
+        }
+        memcpy(data + done, buf + block_off, n);
+        done += n;
+    }
+    inode_unlock(fs, inode_id);
+    return done;
+}
+
+
+// 要写回的文件和它的数据所在的位置
+typedef struct flush_item {
+    uint64_t block;
+    int owner;
+} flush_item;
+
+
+static int cmp_flush_item(const void *a, const void *b)
+{
+    const flush_item *x = a, *y = b;
+    return x->block < y->block ? -1 : x->block > y->block;
+}
+
+
+/**
+ * @brief 写回owners中num个文件的脏块, 然后写回超级块
+ * @note 文件按数据所在的块号排序后依次写回: 已有数据块的按第一个数据块, 还没有的按分配目标,
+ *       这样各文件的写入和延迟分配都按块号从小到大进行
+ */
+static void flush_owners(filesys *fs, int *owners, int num)
+{
+    flush_item *items = malloc(num * sizeof(flush_item));
+    for(int k=0; k<num; k++)
+    {
+        inode file_inode;
+        items[k].owner = owners[k];
+        items[k].block = 0;
+        if(read_inode(fs, owners[k], &file_inode) == 0)
+            items[k].block = file_inode.block_point[0] != 0 ? file_inode.block_point[0] : block_goal(fs, owners[k], &file_inode, 0);
+    }
+    qsort(items, num, sizeof(flush_item), cmp_flush_item);
+    for(int k=0; k<num; k++)
+    {
+        inode file_inode;
+        inode_wrlock(fs, items[k].owner);
+        if(read_inode(fs, items[k].owner, &file_inode) == 0 && file_inode.file_type == TYPE_FILE)
+            flush_file_locked(fs, items[k].owner, &file_inode);
+        inode_unlock(fs, items[k].owner);
+    }
+    free(items);
+    sync_spblock(fs);
+}
+
+
+/**
+ * @brief 计算从现在起FLUSH_INTERVAL_MS之后的时刻, 用于pthread_cond_timedwait
+ */
+static void flush_deadline(struct timespec *deadline)
+{
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_nsec += FLUSH_INTERVAL_MS * 1000000L;
+    deadline->tv_sec += deadline->tv_nsec / 1000000000L;
+    deadline->tv_nsec %= 1000000000L;
+}
+
+
+/**
+ * @brief 后台写回线程: 脏块超过DIRTY_BACKGROUND时写回所有脏块, 否则只写回变脏超过DIRTY_EXPIRE_MS的块
+ */
+static void* flusher_main(void *arg)
+{
+    filesys *fs = arg;
+    disk_set_io_class(DISK_IO_BACKGROUND);
+    int owners[CACHE_BLOCKS];
+    pthread_mutex_lock(&fs->flush_lock);
+    while(!fs->flusher_stop)
+    {
+        struct timespec deadline;
+        flush_deadline(&deadline);
+        pthread_cond_timedwait(&fs->flush_wake, &fs->flush_lock, &deadline);
+        if(fs->flusher_stop)
+            break;
+        pthread_mutex_unlock(&fs->flush_lock);
+
+        uint32_t age = cache_dirty_count(fs->cache) > DIRTY_BACKGROUND ? 0 : DIRTY_EXPIRE_MS;
+        // 写回也会修改磁盘, 和文件操作一样在快照屏障内进行
+        pthread_rwlock_rdlock(&fs->snapshot_barrier);
+        int num = cache_expired_owners(fs->cache, age, owners, CACHE_BLOCKS);
+        if(num > 0)
+            flush_owners(fs, owners, num);
+        pthread_rwlock_unlock(&fs->snapshot_barrier);
+
+        pthread_mutex_lock(&fs->flush_lock);
+        pthread_cond_broadcast(&fs->flush_done);
+    }
+    pthread_mutex_unlock(&fs->flush_lock);
+
+    // 退出前写回所有脏块, 包括还没有分配磁盘块的延迟分配块
+    pthread_rwlock_rdlock(&fs->snapshot_barrier);
+    int num = cache_dirty_owners(fs->cache, owners, CACHE_BLOCKS);
+    if(num > 0)
+        flush_owners(fs, owners, num);
+    pthread_rwlock_unlock(&fs->snapshot_barrier);
+    return NULL;
+}
+
+
+/**
+ * @brief 启动后台写回线程
+ */
+static void start_flusher(filesys *fs)
+{
+    fs->flusher_stop = 0;
+    fs->flusher_running = pthread_create(&fs->flusher_thread, NULL, flusher_main, fs) == 0;
+}
+
+
+/**
+ * @brief 停止后台写回线程, 等待它写回所有脏块后退出
+ */
+static void stop_flusher(filesys *fs)
+{
+    if(!fs->flusher_running)
+        return;
+    pthread_mutex_lock(&fs->flush_lock);
+    fs->flusher_stop = 1;
+    pthread_cond_signal(&fs->flush_wake);
+    // 唤醒所有还在等待的写者
+    pthread_cond_broadcast(&fs->flush_done);
+    pthread_mutex_unlock(&fs->flush_lock);
+    pthread_join(fs->flusher_thread, NULL);
+    fs->flusher_running = 0;
+}
+
+
+/**
+ * @brief 写者写入之后检查脏块数: 超过DIRTY_BACKGROUND时唤醒后台写回线程,
+ *        超过DIRTY_LIMIT时再等待它写回一轮, 最多等待FLUSH_INTERVAL_MS
+ * @note 调用者不能持有任何inode锁, 否则后台线程可能写回不了
+ */
+static void balance_dirty(filesys *fs)
+{
+    int dirty = cache_dirty_count(fs->cache);
+    if(!fs->flusher_running || dirty <= DIRTY_BACKGROUND)
+        return;
+    pthread_mutex_lock(&fs->flush_lock);
+    pthread_cond_signal(&fs->flush_wake);
+    if(dirty > DIRTY_LIMIT && !fs->flusher_stop)
+    {
+        struct timespec deadline;
+        flush_deadline(&deadline);
+        pthread_cond_timedwait(&fs->flush_done, &fs->flush_lock, &deadline);
+    }
+    pthread_mutex_unlock(&fs->flush_lock);
+}
+
+
+/**
+ * @brief 将data中的len个字节写入path文件的offset处
+ * @note 数据只写到缓存中, 新的数据块延迟到刷回时再分配, 由后台线程写回; 脏块太多时等待后台线程写回一轮
+ * @return 成功返回写入的字节数, 失败返回-1
+ * @note 调用者需要持有快照屏障的读锁
+ */
+static int do_write_file(filesys *fs, char *path, uint32_t offset, char *data, uint32_t len)
+{
+    char name[121];
+    memset(name, 0, 121);
+    int inode_id = find_cur_file(fs, path, name);
+    if(inode_id < 0)
+    {
+        printf("%s is not exist\n", name);
+        return -1;
+    }
+    // 在64位中比较, offset和len都来自客户端, 相加可能回绕
+    uint64_t max = 6*(uint64_t)fs->geo.block_size;
+    if(offset > max || len > max - offset)
+    {
+        printf("file %s is too large\n", path);
+        return -1;
+    }
+
+    inode file_inode;
+    inode_wrlock(fs, inode_id);
+    if(read_inode(fs, inode_id, &file_inode) != 0 || file_inode.file_type != TYPE_FILE
+        || expand_file_locked(fs, inode_id, &file_inode) != 0)
+    {
+        inode_unlock(fs, inode_id);
+        return -1;
+    }
+
+    uint32_t done = 0;
+    int ret = 0;
+    while(done < len)
+    {
+        uint32_t pos = offset + done;
+        uint32_t block_off = pos % fs->geo.block_size;
+        uint32_t n = fs->geo.block_size - block_off;
+        if(n > len - done)
+            n = len - done;
+
+        if(write_file_block(fs, inode_id, &file_inode, pos / fs->geo.block_size, block_off, data + done, n) != 0)
+        {
+            ret = -1;
+            break;
+        }
+        done += n;
+    }
+
+    if((uint64_t)offset + done > file_inode.size)
+    {
+        file_inode.size = (uint64_t)offset + done;
+        write_inode(fs, inode_id, &file_inode);
+    }
+    // 没有后台写回线程时写者自己写回
+    if(!fs->flusher_running && cache_dirty_count(fs->cache) > DIRTY_LIMIT)
+        flush_file_locked(fs, inode_id, &file_inode);
+    inode_unlock(fs, inode_id);
+    balance_dirty(fs);
+    return ret == 0 ? (int)done : -1;
+}
+
+
+/**
+ * @brief 持有快照屏障的读锁执行do_write_file, 参数和返回值相同
+ */
+int write_file(filesys *fs, char *path, uint32_t offset, char *data, uint32_t len)
+{
+    if(check_writable(fs) != 0)
+        return -1;
+    pthread_rwlock_rdlock(&fs->snapshot_barrier);
+    int ret = do_write_file(fs, path, offset, data, len);
+    pthread_rwlock_unlock(&fs->snapshot_barrier);
+    return ret;
+}
+
+
+/**
+ * @brief 关闭path文件, 写回它的脏块, 释放它的预留窗口中还没有使用的块
+ * @return 成功返回0, 失败返回-1
+ * @note 调用者需要持有快照屏障的读锁
+ */
+static int do_close_file(filesys *fs, char *path)
+{
+    char name[121];
+    memset(name, 0, 121);
+    int inode_id = find_cur_file(fs, path, name);
+    if(inode_id < 0)
+    {
+        printf("%s is not exist\n", name);
+        return -1;
+    }
+
+    inode file_inode;
+    int ret = -1;
+    inode_wrlock(fs, inode_id);
+    if(read_inode(fs, inode_id, &file_inode) == 0 && file_inode.file_type == TYPE_FILE)
+    {
+        ret = flush_file_locked(fs, inode_id, &file_inode);
+        release_reservation_locked(fs, inode_id);
+    }
+    inode_unlock(fs, inode_id);
+    return ret;
+}
+
+
+/**
+ * @brief 持有快照屏障的读锁执行do_close_file, 参数和返回值相同
+ */
+int close_file(filesys *fs, char *path)
+{
+    pthread_rwlock_rdlock(&fs->snapshot_barrier);
+    int ret = do_close_file(fs, path);
+    pthread_rwlock_unlock(&fs->snapshot_barrier);
+    return ret;
+}
+
+
+/**
+ * @brief 释放文件inode_id的数据块和inode
+ * @note 调用者已经删除了指向它的目录项
+ */
+static void free_file_inode(filesys *fs, int inode_id)
+{
+    inode file_inode;
+    inode_wrlock(fs, inode_id);
+    if(read_inode(fs, inode_id, &file_inode) == 0)
+        truncate_file_locked(fs, inode_id, &file_inode);
+    memset(&file_inode, 0, sizeof(inode));
+    write_inode(fs, inode_id, &file_inode);
+    inode_unlock(fs, inode_id);
+    put_free_inode(fs, inode_id);
+}
+
+
+/**
+ * @brief 删除path文件
+ * @note 还没有刷回的数据直接丢弃, 不会分配块也不会写磁盘
+ * @return 成功返回0, 失败返回-1
+ * @note 调用者需要持有快照屏障的读锁
+ */
+static int do_remove_file(filesys *fs, char *path)
+{
+    char name[121];
+    memset(name, 0, 121);
+    int dir_id = find_prev_path(fs, path, name);
+    if(dir_id < 0 || name[0] == '\0')
+    {
+        printf("%s is not exist\n", path);
+        return -1;
+    }
+
+    inode_wrlock(fs, dir_id);
+    inode dir_inode;
+    if(read_inode(fs, dir_id, &dir_inode) != 0 || dir_inode.file_type != TYPE_FOLDER)
+    {
+        inode_unlock(fs, dir_id);
+        return -1;
+    }
+
+    // 先删除目录项, 再释放inode, 这样释放的inode不会再被新的查找找到
+    int inode_id = -1;
+    for(int i=0; i<6 && inode_id<0; i++)
+    {
+        cache_buf *block = dir_inode.block_point[i] != 0 ? get_meta_block(fs, dir_inode.block_point[i]) : NULL;
+        if(block == NULL)
+            continue;
+        dir_item *dir_table = (dir_item*)block->data;
+        for(uint32_t j=0; j<fs->geo.dir_items_each_block; j++)
+        {
+            if(dir_table[j].valid==DIR_VALID && dir_table[j].type==TYPE_FILE && !strcmp(dir_table[j].name, name))
+            {
+                inode_id = dir_table[j].inode_id;
+                memset(&dir_table[j], 0, sizeof(dir_item));
+                mark_meta_dirty(fs, block);
+                break;
+            }
+        }
+        put_meta_block(fs, block);
+    }
+    if(inode_id < 0)
+    {
+        inode_unlock(fs, dir_id);
+        printf("%s is not exist\n", path);
+        return -1;
+    }
+    dir_inode.size--;
+    write_inode(fs, dir_id, &dir_inode);
+    dir_snapshot_remove(fs, dir_id, inode_id);
+    inode_unlock(fs, dir_id);
+
+    free_file_inode(fs, inode_id);
+    return 0;
+}
+
+
+/**
+ * @brief 持有快照屏障的读锁执行do_remove_file, 参数和返回值相同
+ */
+int remove_file(filesys *fs, char *path)
+{
+    if(check_writable(fs) != 0)
+        return -1;
+    pthread_rwlock_rdlock(&fs->snapshot_barrier);
+    int ret = do_remove_file(fs, path);
+    pthread_rwlock_unlock(&fs->snapshot_barrier);
+    return ret;
+}
 
-    //如果上一级目录的目录块已经没有空闲的dir_item
-    for(int i=1; i<6; i++)
+
+/**
+ * @brief 将所有文件的脏块写回磁盘
+ * @note 调用者需要持有快照屏障的读锁
+ */
+static void sync_all(filesys *fs)
+{
+    int owners[CACHE_BLOCKS];
+    int num = cache_dirty_owners(fs->cache, owners, CACHE_BLOCKS);
+    flush_owners(fs, owners, num);
+}
+
+
+/**
+ * @brief 持有快照屏障的读锁将所有文件的脏块写回磁盘
+ */
+void filesys_sync(filesys *fs)
+{
+    pthread_rwlock_rdlock(&fs->snapshot_barrier);
+    sync_all(fs);
+    pthread_rwlock_unlock(&fs->snapshot_barrier);
+}
+
+
+// 去重时收集的一个文件数据块的引用
+typedef struct dedupe_ref {
+    uint64_t hash;
+    uint64_t block;
+    int inode_id;
+    int index;
+} dedupe_ref;
+
+typedef struct dedupe_job {
+    filesys *fs;
+    dedupe_ref *refs;
+    int *uniq;          // 每个不同块第一次出现的下标
+    int begin, end;     // 本线程负责的uniq区间
+    int ret;
+} dedupe_job;
+
+
+static uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+
+/**
+ * @brief 计算一个数据块的64位哈希
+ * @note 每32字节分给4个互不依赖的通道, 编译器可以把这个循环向量化; len是32的倍数
+ */
+static uint64_t hash_block(const char *data, uint32_t len)
+{
+    const uint64_t p1 = 0x9E3779B185EBCA87ULL, p2 = 0xC2B2AE3D27D4EB4FULL;
+    uint64_t lane[4] = { p1 + p2, p2, 0, -p1 };
+    for(uint32_t i=0; i<len; i+=32)
     {
-        if(inode_prev_path->block_point[i] == 0 && !success)
+        for(int k=0; k<4; k++)
         {
-            //如果上一级目录有空闲的block_point
-            //则申请新的目录块
-            //并且让空闲的block_point指向目标文件夹的block
-            get_free_block(1, block_id);
-            inode_prev_path->block_point[i] = *block_id;
-            inode_prev_path->size++ ;
-            write_inode_block_to_disk(prev_path_inode_id);
-            dir_item_index = 0;
-            success = 1;
-            return 0;
+            uint64_t v;
+            memcpy(&v, data + i + 8*k, 8);
+            lane[k] = rotl64(lane[k] + v * p2, 31) * p1;
+        }
+    }
+    uint64_t h = rotl64(lane[0], 1) + rotl64(lane[1], 7) + rotl64(lane[2], 12) + rotl64(lane[3], 18) + len;
+    h ^= h >> 33;
+    h *= p2;
+    h ^= h >> 29;
+    return h;
+}
+
+
+static int cmp_ref_block(const void *a, const void *b)
+{
+    const dedupe_ref *x = a, *y = b;
+    return x->block < y->block ? -1 : x->block > y->block;
+}
+
+
+static int cmp_ref_hash(const void *a, const void *b)
+{
+    const dedupe_ref *x = a, *y = b;
+    if(x->hash != y->hash)
+        return x->hash < y->hash ? -1 : 1;
+    return cmp_ref_block(a, b);
+}
+
+
+/**
+ * @brief 从根目录开始遍历整棵目录树, 收集所有文件的数据块引用
+ * @return 成功返回引用数, 失败返回-1, 引用数组存放到refs中, 由调用者释放
+ * @note 快照中的块不用管: 去重释放的块如果还在快照中, 会留给快照
+ */
+static int collect_file_blocks(filesys *fs, dedupe_ref **refs)
+{
+    int num = 0, cap = 1024;
+    int top = 0, stack_cap = 64;
+    int *stack = malloc(stack_cap * sizeof(int));
+    dir_item dir_table[fs->geo.dir_items_each_block];
+    *refs = malloc(cap * sizeof(dedupe_ref));
+    stack[top++] = 0;
+    while(top > 0)
+    {
+        int dir_id = stack[--top];
+        inode dir_inode;
+        if(read_inode(fs, dir_id, &dir_inode) != 0)
+            goto fail;
+        for(int i=0; i<6; i++)
+        {
+            if(dir_inode.block_point[i] == 0)
+                continue;
+            if(read_dir_table_from_disk(fs, dir_inode.block_point[i], dir_table) != 0)
+                goto fail;
+            for(uint32_t j=0; j<fs->geo.dir_items_each_block; j++)
+            {
+                if(dir_table[j].valid != DIR_VALID || dir_table[j].name[0] == '\0')
+                    continue;
+                int id = dir_table[j].inode_id;
+                if(dir_table[j].type == TYPE_FOLDER)
+                {
+                    if(top == stack_cap)
+                        stack = realloc(stack, (stack_cap *= 2) * sizeof(int));
+                    stack[top++] = id;
+                    continue;
+                }
+                inode file_inode;
+                if(read_inode(fs, id, &file_inode) != 0)
+                    goto fail;
+                // 尾块由多个文件共用, 不参与去重
+                for(int k=0; k<6 && !(file_inode.flags & INODE_TAIL); k++)
+                {
+                    if(file_inode.block_point[k] == 0)
+                        continue;
+                    if(num == cap)
+                        *refs = realloc(*refs, (cap *= 2) * sizeof(dedupe_ref));
+                    (*refs)[num].block = file_inode.block_point[k];
+                    (*refs)[num].inode_id = id;
+                    (*refs)[num].index = k;
+                    num++;
+                }
+            }
         }
     }
+    free(stack);
+    return num;
+
+fail:
+    free(stack);
+    free(*refs);
+    *refs = NULL;
     return -1;
 }
 
 
+static void* dedupe_hash_main(void *arg)
+{
+    dedupe_job *job = arg;
+    disk_set_io_class(DISK_IO_BACKGROUND);
+    char buf[job->fs->geo.block_size];
+    for(int i=job->begin; i<job->end && job->ret==0; i++)
+    {
+        dedupe_ref *ref = &job->refs[job->uniq[i]];
+        if(read_block_from_disk(job->fs, ref->block, buf) != 0)
+            job->ret = -1;
+        else
+            ref->hash = hash_block(buf, job->fs->geo.block_size);
+    }
+    return NULL;
+}
+
+
 /**
- * @brief 打印出path中的文件和文件夹
- * @return 
+ * @brief 把ref引用的块换成内容相同的块target
+ * @return 换掉后旧块没有引用被释放时返回1, 没有释放返回0, 文件已经改变或失败返回-1
  */
-void ls(char *path)
+static int remap_block(filesys *fs, dedupe_ref *ref, uint64_t target)
 {
-    char name[121];
-    memset(name, 0, 121);
+    inode file_inode;
+    int ret = -1;
+    inode_wrlock(fs, ref->inode_id);
+    // 先写回脏块, 之后这个文件的缓存块可以直接丢弃
+    if(read_inode(fs, ref->inode_id, &file_inode) == 0
+        && flush_file_locked(fs, ref->inode_id, &file_inode) == 0
+        && file_inode.block_point[ref->index] == ref->block)
+    {
+        ref_block(fs, target);
+        file_inode.block_point[ref->index] = target;
+        write_inode(fs, ref->inode_id, &file_inode);
+        cache_drop(fs->cache, ref->inode_id);
+        ret = 0;
+    }
+    inode_unlock(fs, ref->inode_id);
+    if(ret == 0 && unref_block(fs, ref->block))
+    {
+        release_blocks(fs, ref->block, 1);
+        ret = 1;
+    }
+    return ret;
+}
 
-    //找到path文件夹对应的inode_id
-    int inode_id = find_cur_path(path, name);
-    if(inode_id < 0)
+
+/**
+ * @brief 离线去重: 用threads个线程并行计算所有文件数据块的哈希,
+ *        哈希相同的块逐字节比较确认后, 让所有引用指向同一个块并增加它的引用计数, 释放多余的块
+ * @return 成功返回0, 失败返回-1, 统计信息存放到stat中
+ * @note 遍历期间目录树不能被修改, 只能在没有其他用户时运行
+ * @note 调用者需要持有快照屏障的读锁
+ */
+static int do_filesys_dedupe(filesys *fs, int threads, dedupe_stat *stat)
+{
+    sync_all(fs);
+    dedupe_ref *refs;
+    int num = collect_file_blocks(fs, &refs);
+    if(num < 0)
+        return -1;
+
+    // 共享的块只读一次, 哈希复制给它的其他引用
+    qsort(refs, num, sizeof(dedupe_ref), cmp_ref_block);
+    int *uniq = malloc((num + 1) * sizeof(int));
+    int uniq_num = 0;
+    for(int i=0; i<num; i++)
     {
-        printf("Folder %s is not exist\n", name);
-        return;
+        if(i == 0 || refs[i].block != refs[i-1].block)
+            uniq[uniq_num++] = i;
     }
-    // inode_id = 0;
-    printf(".\n");
-    printf("..\n");
+    stat->scanned = uniq_num;
 
-    //根据inode_id读取path文件夹对应的inode
-    inode* inode_path = read_inode_block_from_disk(inode_id);
+    if(threads <= 0)
+        threads = 1;
+    if(threads > DEDUPE_MAX_THREADS)
+        threads = DEDUPE_MAX_THREADS;
+    pthread_t tids[DEDUPE_MAX_THREADS];
+    dedupe_job jobs[DEDUPE_MAX_THREADS];
+    int ret = 0;
+    for(int t=0; t<threads; t++)
+    {
+        jobs[t] = (dedupe_job){ fs, refs, uniq, (int64_t)uniq_num*t/threads, (int64_t)uniq_num*(t+1)/threads, 0 };
+        pthread_create(&tids[t], NULL, dedupe_hash_main, &jobs[t]);
+    }
+    for(int t=0; t<threads; t++)
+    {
+        pthread_join(tids[t], NULL);
+        ret |= jobs[t].ret;
+    }
+    for(int i=1; i<num && ret==0; i++)
+    {
+        if(refs[i].block == refs[i-1].block)
+            refs[i].hash = refs[i-1].hash;
+    }
+    free(uniq);
+    if(ret != 0)
+    {
+        free(refs);
+        return -1;
+    }
 
-    //遍历inode_path的block_point指向的block
-    //打印block中存储的文件和文件夹的名字
-    for(int i=0; i<inode_path->size; i++)
+    // 哈希相同的一组中, 每个不同的块和这组已经保留的块逐字节比较, 相同时合并到保留的块上
+    qsort(refs, num, sizeof(dedupe_ref), cmp_ref_hash);
+    uint32_t bs = fs->geo.block_size;
+    int keep_cap = 4;
+    uint64_t *keep = malloc(keep_cap * sizeof(uint64_t));
+    char *keep_data = malloc(keep_cap * bs);
+    char buf[bs];
+    for(int i=0, group_end; i<num && ret==0; i=group_end)
     {
-        read_dir_table_from_disk(inode_path->block_point[i]);
-        for(int j=0; j<8; j++)
+        group_end = i;
+        while(group_end < num && refs[group_end].hash == refs[i].hash)
+            group_end++;
+        // 组内只有一个不同的块(排序后首尾相同)时不用比较
+        if(refs[group_end-1].block == refs[i].block)
+            continue;
+        int keep_num = 0;
+        for(int r=i, run_end; r<group_end && ret==0; r=run_end)
         {
-            if(dir_table[j].valid==DIR_VALID)
+            run_end = r;
+            while(run_end < group_end && refs[run_end].block == refs[r].block)
+                run_end++;
+            if(read_block_from_disk(fs, refs[r].block, buf) != 0)
             {
-                if(dir_table[j].name[0]=='\0')
-                    continue;
-                else
-                    printf("%s\n",dir_table[j].name);         
+                ret = -1;
+                break;
+            }
+            int k = 0;
+            while(k < keep_num && memcmp(keep_data + (size_t)k*bs, buf, bs) != 0)
+                k++;
+            if(k < keep_num)
+            {
+                for(int j=r; j<run_end; j++)
+                {
+                    int freed = remap_block(fs, &refs[j], keep[k]);
+                    if(freed >= 0)
+                        stat->duplicates++;
+                    if(freed > 0)
+                        stat->freed++;
+                }
+                continue;
+            }
+            if(keep_num == keep_cap)
+            {
+                keep_cap *= 2;
+                keep = realloc(keep, keep_cap * sizeof(uint64_t));
+                keep_data = realloc(keep_data, (size_t)keep_cap * bs);
             }
+            keep[keep_num] = refs[r].block;
+            memcpy(keep_data + (size_t)keep_num*bs, buf, bs);
+            keep_num++;
         }
     }
+    free(keep);
+    free(keep_data);
+    free(refs);
+    sync_spblock(fs);
+    return ret;
 }
 
 
 /**
- * @brief 创建新的文件夹
- * @return 成功则返回文件夹的inode_id,否则返回-1
+ * @brief 持有快照屏障的读锁执行do_filesys_dedupe, 参数和返回值相同
  */
-int mkdir(char *path)
+int filesys_dedupe(filesys *fs, int threads, dedupe_stat *stat)
 {
-    char name[121];
-    memset(name, 0, 121);
+    memset(stat, 0, sizeof(dedupe_stat));
+    if(check_writable(fs) != 0)
+        return -1;
+    pthread_rwlock_rdlock(&fs->snapshot_barrier);
+    int ret = do_filesys_dedupe(fs, threads, stat);
+    pthread_rwlock_unlock(&fs->snapshot_barrier);
+    return ret;
+}
+
+
+/**
+ * @brief 创建和删除快照之前写回所有文件的脏块, 释放所有预留窗口, 再持有sb_lock写回所有元数据,
+ *        之后磁盘上就是当前时刻完整的镜像
+ * @return 成功返回0, 写入失败返回-1; 都返回时持有sb_lock
+ * @note 调用者需要持有快照屏障的写锁, 这时没有其他修改, 后台写回线程也在屏障外等待
+ */
+static int quiesce_fs(filesys *fs)
+{
+    int owners[CACHE_BLOCKS];
+    int num = cache_dirty_owners(fs->cache, owners, CACHE_BLOCKS);
+    if(num > 0)
+        flush_owners(fs, owners, num);
+    release_all_reservations(fs, -1);
+    pthread_mutex_lock(&fs->sb_lock);
+    return write_spblock_to_disk(fs);
+}
+
 
-    // 检查文件夹是否已经存在
-    if(find_cur_path(path, name) >= 0)
+/**
+ * @brief 创建名为name的快照: 写回所有数据后在快照表中加一项, 换上一个空的例外表, 不复制任何块
+ * @note 之后第一次覆盖写或释放创建时已占用的块时才复制或保留它, 所以创建的耗时和镜像大小无关
+ * @return 成功返回0, 失败返回-1
+ */
+int filesys_snapshot(filesys *fs, char *name)
+{
+    if(check_writable(fs) != 0)
+        return -1;
+    if(name[0] == '\0' || strlen(name) >= SNAPSHOT_NAME_MAX)
     {
-        printf("Folder %s is already exist\n", path);
+        printf("invalid snapshot name %s\n", name);
         return -1;
     }
 
-    memset(name, 0, 121);
-    int prev_path_inode_id = find_prev_path(path, name);
-    if(prev_path_inode_id < 0)
+    pthread_mutex_lock(&fs->snapshot_lock);
+    pthread_rwlock_wrlock(&fs->snapshot_barrier);
+    snapshot_entry table[fs->geo.snapshots_each_block];
+    int count = quiesce_fs(fs) == 0 ? read_snapshot_table(fs, table) : -1;
+    int ret = -1;
+    if(count < 0)
+        printf("fail to create snapshot %s\n", name);
+    else if(find_snapshot(table, count, name) >= 0)
+        printf("snapshot %s is already exist\n", name);
+    else if(count == (int)fs->geo.snapshots_each_block)
+        printf("too many snapshots\n");
+    else
     {
-        printf("Folder %s doesn't exist\n", name);
-        return -1;
+        memset(&table[count], 0, sizeof(snapshot_entry));
+        table[count].block_count = atomic_load(&fs->block_count);
+        table[count].created = time(NULL);
+        strcpy(table[count].name, name);
+        ret = write_snapshot_table(fs, table, count + 1);
+        if(ret == 0)
+        {
+            // 上一个快照的例外表已经全部写回, 换下来就不再修改
+            pthread_mutex_lock(&fs->cow_lock);
+            cow_table *old = atomic_exchange(&fs->cow, new_cow_table(fs, table[count].block_count));
+            pthread_mutex_unlock(&fs->cow_lock);
+            free_cow_table(old);
+            // 超级块也在快照中, 这次写回时复制出的旧超级块里还没有这个快照
+            ret = write_spblock_to_disk(fs);
+        }
+        else
+            printf("fail to create snapshot %s\n", name);
     }
-    if(prev_path_inode_id<0 || name[0]=='\0')
-        return -1;
-    
-    // 找到上一级目录对应的inode
-    inode* prev_path_inode = read_inode_block_from_disk(prev_path_inode_id);
+    pthread_mutex_unlock(&fs->sb_lock);
+    pthread_rwlock_unlock(&fs->snapshot_barrier);
+    pthread_mutex_unlock(&fs->snapshot_lock);
+    return ret;
+}
 
 
-    //为目标文件夹创建dir_item
-    int block_id; // dir_item所在的块号
-    int dir_item_index; //dir_item在块中的位置
-    if(create_dir_item(prev_path_inode_id, prev_path_inode, &block_id, &dir_item_index) < 0)
+/**
+ * @brief 从快照表中去掉第k个快照: 它的例外表中前一个快照也需要的项移到前一个快照的例外表中,
+ *        其余复制出的块和保留的块, 以及它的例外表块都释放
+ * @return 成功返回0, 失败返回-1, 失败时磁盘上的快照表和例外表都没有变
+ * @note 调用者需要持有sb_lock和快照屏障的写锁, 所有例外表都已经写回
+ */
+static int drop_snapshot(filesys *fs, snapshot_entry *table, int count, int k)
+{
+    // chain为从前一个快照(没有时从第k个)到最新快照的例外表, 最新的就是fs->cow
+    int first = k > 0 ? k-1 : k;
+    int num = count - first;
+    cow_table **chain = calloc(num, sizeof(cow_table*));
+    int ret = 0;
+    for(int i=0; i<num && ret == 0; i++)
     {
-        printf("cannot create dir_item for %s\n", path);
-        return -1;
+        chain[i] = first+i == count-1 ? atomic_load(&fs->cow) : load_cow_table(fs, &table[first+i]);
+        if(chain[i] == NULL)
+            ret = -1;
     }
 
-    //为目标文件夹申请inode
-    int inode_new_id = get_free_inode();
-
-    //设置目标文件夹的dir_item
-    read_dir_table_from_disk(block_id);
-    dir_table[dir_item_index].inode_id = inode_new_id;
-    dir_table[dir_item_index].valid = DIR_VALID;
-    dir_table[dir_item_index].type = TYPE_FOLDER;
-    strcpy(dir_table[dir_item_index].name, name);
-    write_dir_table_to_disk(block_id);
+    pthread_mutex_lock(&fs->cow_lock);
+    cow_table *prev = k > 0 ? chain[0] : NULL;
+    cow_table *victim = chain[k - first];
+    uint64_t *freed = NULL;
+    uint32_t freed_num = 0;
+    if(ret == 0)
+    {
+        // 前一个快照中没有这个块并且创建它时块已占用, 说明两个快照之间这个块没有变, 旧内容也是前一个快照的
+        freed = malloc((victim->count + 1) * sizeof(uint64_t));
+        for(uint32_t i=0; i<victim->count; i++)
+        {
+            cow_entry e = victim->entries[i];
+            if(prev != NULL && cow_lookup(prev, e.block) == 0 && cow_was_used(fs, chain, num, e.block))
+                cow_insert(prev, e.block, e.copy);
+            else
+                freed[freed_num++] = e.copy;
+        }
+        if(prev != NULL && (ret = store_cow_table(fs, prev, &table[k-1])) == 0)
+            prev->synced = prev->count;
+    }
+    if(ret == 0)
+    {
+        memmove(&table[k], &table[k+1], (count-k-1) * sizeof(snapshot_entry));
+        ret = write_snapshot_table(fs, table, count - 1);
+    }
+    if(ret == 0)
+    {
+        // 快照表写入之后才释放, 这些块不在任何快照的视图中
+        for(uint32_t i=0; i<freed_num; i++)
+            release_blocks_nocow(fs, freed[i], 1);
+        for(uint32_t i=0; i<victim->block_num; i++)
+            release_blocks_nocow(fs, victim->blocks[i], 1);
+        if(victim == atomic_load(&fs->cow))
+            atomic_store(&fs->cow, prev);
+    }
+    pthread_mutex_unlock(&fs->cow_lock);
 
-    //设置目标文件夹的inode
-    inode* inode_new = read_inode_block_from_disk(inode_new_id);
-    inode_new->size += 1;
-    inode_new->file_type = TYPE_FOLDER;
-    inode_new->link += 1;
-    inode_new->block_point[0] = 0;
-    write_inode_block_to_disk(inode_new_id);
-    return inode_new_id;
+    for(int i=0; i<num; i++)
+    {
+        if(chain[i] != atomic_load(&fs->cow))
+            free_cow_table(chain[i]);
+    }
+    free(chain);
+    free(freed);
+    return ret;
 }
 
 
 /**
- * @brief 创建文件
- * @return 成功初始化返回文件的inode_id, 失败返回-1
+ * @brief 删除名为name的快照, 释放只有它还在使用的块
+ * @return 成功返回0, 失败返回-1
  */
-int touch(char *path)
+int filesys_snapshot_delete(filesys *fs, char *name)
 {
-    char name[121];
-    memset(name, 0, 121);
+    if(check_writable(fs) != 0)
+        return -1;
+
+    pthread_mutex_lock(&fs->snapshot_lock);
+    pthread_rwlock_wrlock(&fs->snapshot_barrier);
+    snapshot_entry table[fs->geo.snapshots_each_block];
+    int count = quiesce_fs(fs) == 0 ? read_snapshot_table(fs, table) : -1;
+    int k = count > 0 ? find_snapshot(table, count, name) : -1;
+    int ret = -1;
+    if(count < 0)
+        printf("fail to delete snapshot %s\n", name);
+    else if(k < 0)
+        printf("snapshot %s is not exist\n", name);
+    else if((ret = drop_snapshot(fs, table, count, k)) == 0)
+        ret = write_spblock_to_disk(fs);
+    else
+        printf("fail to delete snapshot %s\n", name);
+    pthread_mutex_unlock(&fs->sb_lock);
+    pthread_rwlock_unlock(&fs->snapshot_barrier);
+    pthread_mutex_unlock(&fs->snapshot_lock);
+    return ret;
+}
 
-    // 检查文件是否已经存在
-    if(find_cur_file(path, name) >= 0)
+
+/**
+ * @brief 打印所有快照的名字和创建时间
+ */
+void ls_snapshots(filesys *fs)
+{
+    pthread_mutex_lock(&fs->snapshot_lock);
+    snapshot_entry table[fs->geo.snapshots_each_block];
+    int count = read_snapshot_table(fs, table);
+    pthread_mutex_unlock(&fs->snapshot_lock);
+    for(int i=0; i<count; i++)
     {
-        printf("file %s is already exist\n", path);
-        return -1;
+        time_t created = table[i].created;
+        printf("%s\t%s", table[i].name, ctime(&created));
     }
+}
 
-    memset(name, 0, 121);
-    int prev_path_inode_id = find_prev_path(path, name);
-    if(prev_path_inode_id < 0)
+
+/**
+ * @brief 切换缓冲区缓存中文件数据的替换策略, name为"lru"或"2q"
+ * @return 成功返回0, 策略名错误返回-1
+ */
+int set_cache_policy(filesys *fs, char *name)
+{
+    if(!strcmp(name, "lru"))
+        cache_set_policy(fs->cache, CACHE_LRU);
+    else if(!strcmp(name, "2q"))
+        cache_set_policy(fs->cache, CACHE_2Q);
+    else
     {
-        printf("File %s doesn't exist\n", name);
+        printf("unknown cache policy %s\n", name);
         return -1;
     }
-    if(prev_path_inode_id<0 || name[0]=='\0')
-        return -1;
-    
-    inode* prev_path_inode = read_inode_block_from_disk(prev_path_inode_id);
+    return 0;
+}
 
-    //为目标文件创建dir_item
-    int block_id; // dir_item所在的块号
-    int dir_item_index; //dir_item在块中的位置
-    if(create_dir_item(prev_path_inode_id, prev_path_inode, &block_id, &dir_item_index) < 0)
+
+/**
+ * @brief 打印缓冲区缓存的替换策略和各类别的命中率
+ */
+void cache_info(filesys *fs)
+{
+    static const char *class_names[] = { "data", "meta" };
+    cache_stat st;
+    cache_get_stat(fs->cache, &st);
+    printf("policy %s, %d dirty\n", cache_get_policy(fs->cache) == CACHE_2Q ? "2q" : "lru", cache_dirty_count(fs->cache));
+    for(int c=CACHE_CLASS_DATA; c<=CACHE_CLASS_META; c++)
     {
-        printf("cannot create dir_item for %s\n", path);
-        return -1;
+        uint64_t total = st.hits[c] + st.misses[c];
+        printf("%s\t%llu hits, %llu misses, hit rate %.1f%%\n", class_names[c], (unsigned long long)st.hits[c],
+               (unsigned long long)st.misses[c], total > 0 ? 100.0 * st.hits[c] / total : 0.0);
     }
-    
-    //为目标文件申请inode
-    int inode_new_id = get_free_inode();
-
-    //设置目标文件的dir_item
-    read_dir_table_from_disk(block_id);
-    dir_table[dir_item_index].inode_id = inode_new_id;
-    dir_table[dir_item_index].valid = DIR_VALID;
-    dir_table[dir_item_index].type = TYPE_FILE;
-    strcpy(dir_table[dir_item_index].name, name);
-    write_dir_table_to_disk(block_id);
-
-    //设置目标文件的inode
-    inode* inode_new = read_inode_block_from_disk(inode_new_id);
-    inode_new->size += 1;
-    inode_new->file_type = TYPE_FILE;
-    inode_new->link += 1;
-    inode_new->block_point[0] = 0;
-    write_inode_block_to_disk(inode_new_id);
-    return inode_new_id;
 }
 
 
 /**
- * @brief 将src文件复制到dest文件中
- * @return 成功初始化返回inode_id, 失败返回-1
+ * @brief 在dir目录下批量创建names中的num个文件
+ * @note 上一级目录只解析一次, inode和数据块各只扫描一次位图,
+ *       目录块按顺序填充, 每个被修改的目录块和inode块只写一次
+ * @return 成功返回0, 失败返回-1
+ * @note 调用者需要持有快照屏障的读锁
  */
-void copy(char *dest, char *src)
+static int do_touch_bulk(filesys *fs, char *dir, char *names[], int num)
 {
-    char src_name[121];
-    int src_inode_id = find_cur_file(src, src_name);
-    if(src_inode_id < 0)
+    char name[121];
+    memset(name, 0, 121);
+
+    int dir_inode_id = find_cur_path(fs, dir, name);
+    if(dir_inode_id < 0)
     {
-        printf("%s is not exist\n", src_name);
-        return;
+        printf("Folder %s is not exist\n", dir);
+        return -1;
     }
-    inode* tmp_inode = read_inode_block_from_disk(src_inode_id);
-    inode src_inode = *tmp_inode;
-    if(src_inode.file_type != TYPE_FILE)
+
+    // 检查文件名是否合法以及是否重复
+    for(int k=0; k<num; k++)
     {
-        printf("%s is not a file\n", src_name);
-        return ;
+        if(names[k][0]=='\0' || strchr(names[k], '/') || strlen(names[k]) > 120)
+        {
+            printf("invalid file name %s\n", names[k]);
+            return -1;
+        }
+        for(int l=0; l<k; l++)
+        {
+            if(!strcmp(names[k], names[l]))
+            {
+                printf("file %s is duplicated\n", names[k]);
+                return -1;
+            }
+        }
     }
 
-    char dest_name[121];
-    memset(dest_name, 0, 121);
-    int dest_inode_id;
-    // 检测dest文件是否已经存在,如果没有则新建一个
-    if((dest_inode_id = find_cur_file(dest, dest_name)) < 0)
+    inode_wrlock(fs, dir_inode_id);
+    inode dir_inode;
+    if(read_inode(fs, dir_inode_id, &dir_inode) != 0 || dir_inode.file_type != TYPE_FOLDER)
     {
-        dest_inode_id = touch(dest);
+        inode_unlock(fs, dir_inode_id);
+        printf("%s is not a folder\n", dir);
+        return -1;
     }
-    //获取dest文件的inode
-    char tmp[BLOCK_SIZE];
-    inode dest_inode;
-    memcpy(&dest_inode, read_inode_block_from_disk(dest_inode_id), sizeof(inode));
-
-    //复制src_inode的内容给dest_inode
-    dest_inode.size = src_inode.size;
-    dest_inode.link = src_inode.link;
-    dest_inode.file_type = TYPE_FILE;
 
-    //遍历src_inode的block, 复制给dest_inode
+    // 扫描一遍目录块: 统计空闲的dir_item和block_point, 同时检查文件是否已经存在
+    int free_items = 0;
+    int free_points = 0;
     for(int i=0; i<6; i++)
     {
-        if(src_inode.block_point[i] != 0)
+        if(dir_inode.block_point[i] == 0)
         {
-            int dest_block_index;
-            read_block_from_disk(src_inode.block_point[i]);
-            memcpy(tmp, buf, BLOCK_SIZE);
-            get_free_block(1, &dest_block_index);
-            memcpy(buf, tmp, BLOCK_SIZE);
-            write_block_to_disk(dest_block_index);
-            
-            dest_inode.block_point[i] = dest_block_index;
+            free_points++;
+            continue;
         }
-        else
+        cache_buf *block = get_meta_block(fs, dir_inode.block_point[i]);
+        if(block == NULL)
+        {
+            inode_unlock(fs, dir_inode_id);
+            return -1;
+        }
+        dir_item *dir_table = (dir_item*)block->data;
+        for(uint32_t j=0; j<fs->geo.dir_items_each_block; j++)
+        {
+            if(dir_table[j].valid == DIR_INVALID)
+            {
+                free_items++;
+                continue;
+            }
+            for(int k=0; k<num; k++)
+            {
+                if(dir_table[j].type==TYPE_FILE && !strcmp(dir_table[j].name, names[k]))
+                {
+                    put_meta_block(fs, block);
+                    inode_unlock(fs, dir_inode_id);
+                    printf("file %s is already exist\n", names[k]);
+                    return -1;
+                }
+            }
+        }
+        put_meta_block(fs, block);
+    }
+
+    int new_block_num = 0;
+    if(num > free_items)
+        new_block_num = (num - free_items + fs->geo.dir_items_each_block - 1) / fs->geo.dir_items_each_block;
+    if(new_block_num > free_points)
+    {
+        inode_unlock(fs, dir_inode_id);
+        printf("cannot create %d dir_items in %s\n", num, dir);
+        return -1;
+    }
+
+    // 一次性申请所需的inode和目录块; num不超过目录能放下的项数, 数组按num从堆上分配
+    int *inode_ids = malloc(num * sizeof(int));
+    uint64_t new_blocks[6];
+    if(get_free_inodes(fs, dir_inode_id, num, inode_ids) < 0)
+    {
+        inode_unlock(fs, dir_inode_id);
+        free(inode_ids);
+        return -1;
+    }
+    uint64_t goal = block_goal(fs, dir_inode_id, &dir_inode, 6);
+    if(new_block_num > 0 && get_free_block(fs, goal, new_block_num, new_blocks) < 0)
+    {
+        inode_unlock(fs, dir_inode_id);
+        for(int k=0; k<num; k++)
+            put_free_inode(fs, inode_ids[k]);
+        free(inode_ids);
+        return -1;
+    }
+
+    // inode_ids是有序的, 同一个inode块中的inode一起设置后只写一次;
+    // 读不到inode块时放弃, 释放所有申请到的inode和目录块, 已经设置的inode没有目录项指向, 释放后可以重新分配
+    for(int k=0; k<num; )
+    {
+        uint64_t block_id = inode_block_of(fs, inode_ids[k]);
+        int first = k;
+        pthread_mutex_t *lock = inode_block_lock_of(fs, inode_ids[first]);
+        pthread_mutex_lock(lock);
+        cache_buf *block = get_meta_block(fs, block_id);
+        if(block == NULL)
+        {
+            pthread_mutex_unlock(lock);
+            inode_unlock(fs, dir_inode_id);
+            for(int l=0; l<num; l++)
+                put_free_inode(fs, inode_ids[l]);
+            for(int l=0; l<new_block_num; l++)
+                release_blocks(fs, new_blocks[l], 1);
+            sync_spblock(fs);
+            free(inode_ids);
+            return -1;
+        }
+        inode *inode_table = (inode*)block->data;
+        for(; k<num && inode_block_of(fs, inode_ids[k]) == block_id; k++)
+        {
+            inode* inode_new = &inode_table[inode_index_of(fs, inode_ids[k])];
+            memset(inode_new, 0, sizeof(inode));
+            inode_new->size = 0;
+            inode_new->file_type = TYPE_FILE;
+            inode_new->link = 1;
+        }
+        mark_meta_dirty(fs, block);
+        for(int l=first; l<k; l++)
+            icache_publish(fs, inode_ids[l], &inode_table[inode_index_of(fs, inode_ids[l])]);
+        put_meta_block(fs, block);
+        pthread_mutex_unlock(lock);
+    }
+
+    // 按顺序填充目录块, 每个被修改的目录块只写一次
+    dir_item *new_items = malloc(num * sizeof(dir_item));
+    int created = 0;
+    int used_blocks = 0;
+    for(int i=0; i<6 && created<num; i++)
+    {
+        cache_buf *block;
+        if(dir_inode.block_point[i] == 0)
         {
-            dest_inode.block_point[i] = 0;
+            if(used_blocks == new_block_num)
+                continue;
+            dir_inode.block_point[i] = new_blocks[used_blocks++];
+            block = get_new_meta_block(fs, dir_inode.block_point[i]);
+        }
+        else if((block = get_meta_block(fs, dir_inode.block_point[i])) == NULL)
+            continue;
+
+        dir_item *dir_table = (dir_item*)block->data;
+        int dirty = 0;
+        for(uint32_t j=0; j<fs->geo.dir_items_each_block && created<num; j++)
+        {
+            if(dir_table[j].valid == DIR_VALID)
+                continue;
+            dir_table[j].inode_id = inode_ids[created];
+            dir_table[j].valid = DIR_VALID;
+            dir_table[j].type = TYPE_FILE;
+            strcpy(dir_table[j].name, names[created]);
+            new_items[created++] = dir_table[j];
+            dirty = 1;
         }
+        if(dirty)
+            mark_meta_dirty(fs, block);
+        put_meta_block(fs, block);
+    }
+    dir_inode.size += created;
+    write_inode(fs, dir_inode_id, &dir_inode);
+    dir_snapshot_add(fs, dir_inode_id, new_items, created);
+    inode_unlock(fs, dir_inode_id);
+
+    // 有目录块读取失败时, 没有放进目录的inode和没有用到的目录块都释放
+    for(int k=created; k<num; k++)
+        put_free_inode(fs, inode_ids[k]);
+    for(int l=used_blocks; l<new_block_num; l++)
+        release_blocks(fs, new_blocks[l], 1);
+    if(created < num)
+    {
+        sync_spblock(fs);
+        printf("created %d of %d files in %s\n", created, num, dir);
     }
-    write_inode_block_to_disk(dest_inode_id);
-}
\ No newline at end of file
+    free(inode_ids);
+    free(new_items);
+    return created == num ? 0 : -1;
+}
+
+
+/**
+ * @brief 持有快照屏障的读锁执行do_touch_bulk, 参数和返回值相同
+ */
+int touch_bulk(filesys *fs, char *dir, char *names[], int num)
+{
+    if(check_writable(fs) != 0)
+        return -1;
+    pthread_rwlock_rdlock(&fs->snapshot_barrier);
+    int ret = do_touch_bulk(fs, dir, names, num);
+    pthread_rwlock_unlock(&fs->snapshot_barrier);
+    return ret;
+}
@@ -0,0 +1,151 @@
+#include "lz.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_LAST_LITERALS 5 //结尾的几个字节总是作为字面量, 解压时不用检查越界的匹配
+
+
+static uint32_t read32(const char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+
+/**
+ * @brief 写出一个扩展长度: 每个255字节表示加255, 最后一个小于255的字节结束
+ * @return 成功返回写出后的位置, 超过cap时返回-1
+ */
+static int put_length(char *dst, int out, int cap, int n)
+{
+    for(; n >= 255; n -= 255)
+    {
+        if(out >= cap)
+            return -1;
+        dst[out++] = (char)255;
+    }
+    if(out >= cap)
+        return -1;
+    dst[out++] = n;
+    return out;
+}
+
+
+/**
+ * @brief 写出一个序列: 字面量src[0..lit_len)和一个匹配, match_len为0时没有匹配(最后一个序列)
+ * @return 成功返回写出后的位置, 超过cap时返回-1
+ */
+static int put_sequence(char *dst, int out, int cap, const char *lit, int lit_len, int offset, int match_len)
+{
+    if(out >= cap)
+        return -1;
+    int m = match_len > 0 ? match_len - LZ_MIN_MATCH : 0;
+    int token = out++;
+    dst[token] = (lit_len < 15 ? lit_len : 15) << 4 | (m < 15 ? m : 15);
+    if(lit_len >= 15 && (out = put_length(dst, out, cap, lit_len - 15)) < 0)
+        return -1;
+    if(out + lit_len > cap)
+        return -1;
+    memcpy(dst + out, lit, lit_len);
+    out += lit_len;
+    if(match_len == 0)
+        return out;
+    if(out + 2 > cap)
+        return -1;
+    dst[out++] = offset & 0xff;
+    dst[out++] = offset >> 8;
+    if(m >= 15 && (out = put_length(dst, out, cap, m - 15)) < 0)
+        return -1;
+    return out;
+}
+
+
+int lz_compress(const char *src, int len, char *dst, int cap)
+{
+    // 表中存放位置加1, 0表示空
+    uint32_t *table = calloc(1 << LZ_HASH_BITS, sizeof(uint32_t));
+    int anchor = 0, out = 0;
+    int i = 0;
+    while(i + LZ_MIN_MATCH + LZ_LAST_LITERALS <= len && out >= 0)
+    {
+        uint32_t seq = read32(src + i);
+        uint32_t h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        int cand = (int)table[h] - 1;
+        table[h] = i + 1;
+        if(cand < 0 || i - cand > LZ_MAX_OFFSET || read32(src + cand) != seq)
+        {
+            i++;
+            continue;
+        }
+        int m = LZ_MIN_MATCH;
+        while(i + m < len - LZ_LAST_LITERALS && src[cand + m] == src[i + m])
+            m++;
+        out = put_sequence(dst, out, cap, src + anchor, i - anchor, i - cand, m);
+        i += m;
+        anchor = i;
+    }
+    if(out >= 0)
+        out = put_sequence(dst, out, cap, src + anchor, len - anchor, 0, 0);
+    free(table);
+    return out;
+}
+
+
+/**
+ * @brief 读取一个扩展长度, 加到*n上
+ * @return 成功返回读取后的位置, 数据不完整时返回-1
+ */
+static int get_length(const unsigned char *src, int in, int len, int *n)
+{
+    for(;;)
+    {
+        if(in >= len)
+            return -1;
+        int b = src[in++];
+        *n += b;
+        if(b < 255)
+            return in;
+    }
+}
+
+
+int lz_decompress(const char *src, int len, char *dst, int cap)
+{
+    const unsigned char *s = (const unsigned char*)src;
+    int in = 0, out = 0;
+    while(in < len)
+    {
+        int token = s[in++];
+        int lit_len = token >> 4;
+        if(lit_len == 15 && (in = get_length(s, in, len, &lit_len)) < 0)
+            return -1;
+        if(in + lit_len > len || out + lit_len > cap)
+            return -1;
+        memcpy(dst + out, src + in, lit_len);
+        in += lit_len;
+        out += lit_len;
+        if(in == len)
+            break;
+
+        if(in + 2 > len)
+            return -1;
+        int offset = s[in] | s[in+1] << 8;
+        in += 2;
+        int match_len = token & 15;
+        if(match_len == 15 && (in = get_length(s, in, len, &match_len)) < 0)
+            return -1;
+        match_len += LZ_MIN_MATCH;
+        if(offset == 0 || offset > out || out + match_len > cap)
+            return -1;
+        // 匹配可能和要写的位置重叠, 逐字节复制
+        for(int k=0; k<match_len; k++, out++)
+            dst[out] = dst[out - offset];
+    }
+    return out;
+}
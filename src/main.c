@@ -1,32 +1,126 @@
 #include "disk.h"
 #include "filesys.h"
+#include "server.h"
+
+#include <pthread.h>
 
 #define MAXLINE 100
 #define MAXARG 100
+#define MAXBULK 48
 char whitespace[] = " \t\r\n\v";
 
 int getcmd(char *cmd, int nbuf);
 void parsecmd(char *cmd, char* argv[], int* argc);
-void runcmd(char* argv[], int argc);
+void runcmd(filesys *fs, char* argv[], int argc);
 void execpipe(char* argv[], int argc);
+char* split_path(char* path, char* dir);
+
+// 服务端模式下每个镜像一个实例, 各自在一个线程中运行
+typedef struct volume {
+    pthread_t thread;
+    char *image;
+    char sock_path[108];
+    int workers;
+    filesys *fs;
+    int ret;
+} volume;
 
-void main()
+
+static filesys* mount_image(const char *image)
 {
-    if(open_disk()!=0)
+    disk *d = open_disk(image);
+    if(d == NULL)
     {
-        printf("fail to open the disk\n");
-        return;
+        printf("fail to open the disk %s\n", image);
+        return NULL;
+    }
+    filesys *fs = filesys_init(d);
+    if(fs == NULL)
+        close_disk(d);
+    return fs;
+}
+
+
+static void* serve_volume(void *arg)
+{
+    volume *v = arg;
+    v->ret = server_run(v->fs, v->sock_path, v->workers);
+    filesys_shutdown(v->fs);
+    return NULL;
+}
+
+
+int main(int argc, char *argv[])
+{
+    // main -s [socket] [workers] [image...]: 以服务端模式运行
+    // 第一个镜像(默认为disk)在socket上服务, 其余镜像分别在<image>.sock上服务
+    if(argc >= 2 && !strcmp(argv[1], "-s"))
+    {
+        char *sock_path = argc >= 3 ? argv[2] : SERVER_DEFAULT_SOCKET;
+        int workers = argc >= 4 ? atoi(argv[3]) : SERVER_DEFAULT_WORKERS;
+        int num = argc > 4 ? argc - 4 : 1;
+        volume *vols = calloc(num, sizeof(volume));
+        int r = 0;
+        for(int i=0; i<num; i++)
+        {
+            vols[i].image = argc > 4 ? argv[4+i] : "disk";
+            if(i == 0)
+                snprintf(vols[i].sock_path, sizeof(vols[i].sock_path), "%s", sock_path);
+            else
+                snprintf(vols[i].sock_path, sizeof(vols[i].sock_path), "%s.sock", vols[i].image);
+            vols[i].workers = workers;
+            vols[i].fs = mount_image(vols[i].image);
+            if(vols[i].fs == NULL || pthread_create(&vols[i].thread, NULL, serve_volume, &vols[i]) != 0)
+            {
+                num = i;
+                r = 1;
+                break;
+            }
+        }
+        for(int i=0; i<num; i++)
+        {
+            pthread_join(vols[i].thread, NULL);
+            r |= vols[i].ret != 0;
+        }
+        free(vols);
+        return r;
+    }
+
+    // main -r snapshot [image]: 只读挂载镜像中的快照, 运行交互式命令
+    // main [image]: 在镜像(默认为disk)上运行交互式命令
+    filesys *fs;
+    if(argc >= 3 && !strcmp(argv[1], "-r"))
+    {
+        const char *image = argc >= 4 ? argv[3] : "disk";
+        disk *d = open_disk_path(image);
+        if(d == NULL)
+        {
+            printf("fail to open the disk %s\n", image);
+            return 1;
+        }
+        fs = filesys_open_snapshot(d, argv[2]);
+        if(fs == NULL)
+        {
+            close_disk(d);
+            return 1;
+        }
     }
-    filesys_init();
+    else
+        fs = mount_image(argc >= 2 ? argv[1] : "disk");
+    if(fs == NULL)
+        return 1;
+
     char cmd[MAXLINE];
     while(getcmd(cmd, MAXLINE) >= 0)
     {
         char *argv[MAXARG];
         int argc;
         parsecmd(cmd, argv, &argc);
-        runcmd(argv, argc);
+        runcmd(fs, argv, argc);
     }
-    return;
+    // 输入结束时也要卸载: 延迟分配的数据只有写回时才落盘
+    filesys_shutdown(fs);
+    return 0;
 }
 
 int getcmd(char* cmd, int nbuf) //从缓冲区中读取命令
@@ -55,7 +149,7 @@ void parsecmd(char* cmd, char* argv[], int* argc) //将命令中的变量存入
   *argc = i;
 }
 
-void runcmd(char* argv[], int argc) //运行命令
+void runcmd(filesys *fs, char* argv[], int argc) //运行命令
 {
     int i;
     if(!strcmp(argv[0], "ls"))
@@ -63,12 +157,34 @@ void runcmd(char* argv[], int argc) //运行命令
         if(argc==1)
         {
             char root = '/';
-            ls(&root);
+            ls(fs, &root);
         }
         else
         {
-            ls(argv[1]);
+            ls(fs, argv[1]);
+        }
+    }
+
+    else if(!strcmp(argv[0], "cat"))
+    {
+        // cat path...: 打印文件内容, -r只读挂载快照时读到的是快照中的内容
+        if(argc==1)
+        {
+            printf("no enough arguments'\n");
+            return;
+        }
+        char buf[4096];
+        for(i=1; i<argc; i++)
+        {
+            uint32_t offset = 0;
+            int n;
+            while((n = read_file(fs, argv[i], offset, buf, sizeof(buf))) > 0)
+            {
+                fwrite(buf, 1, n, stdout);
+                offset += n;
+            }
         }
+        fflush(stdout);
     }
 
     else if(!strcmp(argv[0], "mkdir"))
@@ -78,7 +194,7 @@ void runcmd(char* argv[], int argc) //运行命令
             printf("no enough arguments'\n");
             return;
         }
-        mkdir(argv[1]);
+        mkdir(fs, argv[1]);
     }
 
     else if(!strcmp(argv[0], "touch"))
@@ -88,22 +204,155 @@ void runcmd(char* argv[], int argc) //运行命令
             printf("no enough arguments'\n");
             return;
         }
-        touch(argv[1]);
+        if(!strcmp(argv[1], "-n"))
+        {
+            // touch -n <count> <dir/prefix>: 创建prefix0 ~ prefix<count-1>
+            if(argc <= 3)
+            {
+                printf("no enough arguments'\n");
+                return;
+            }
+            int num = atoi(argv[2]);
+            if(num <= 0 || num > MAXBULK)
+            {
+                printf("invalid count %s\n", argv[2]);
+                return;
+            }
+            char dir[MAXLINE];
+            char *prefix = split_path(argv[3], dir);
+            char names[MAXBULK][121];
+            char *name_list[MAXBULK];
+            for(i=0; i<num; i++)
+            {
+                snprintf(names[i], 121, "%s%d", prefix, i);
+                name_list[i] = names[i];
+            }
+            touch_bulk(fs, dir, name_list, num);
+        }
+        else if(argc == 2)
+        {
+            touch(fs, argv[1]);
+        }
+        else
+        {
+            // touch path1 path2 ...: 相邻且位于同一目录下的文件一起批量创建
+            char dir[MAXLINE];
+            char next_dir[MAXLINE];
+            char *name_list[MAXARG];
+            int num = 0;
+            for(i=1; i<argc; i++)
+            {
+                char *name = split_path(argv[i], next_dir);
+                if(num > 0 && strcmp(dir, next_dir))
+                {
+                    touch_bulk(fs, dir, name_list, num);
+                    num = 0;
+                }
+                strcpy(dir, next_dir);
+                name_list[num++] = name;
+            }
+            touch_bulk(fs, dir, name_list, num);
+        }
     }
 
     else if(!strcmp(argv[0], "cp"))
     {
-        if(argc <= 2)
+        // cp --reflink dest src: 共享数据块, 写时才复制
+        int reflink = argc > 1 && !strcmp(argv[1], "--reflink");
+        if(argc <= 2 + reflink)
         {
             printf("no enough arguments'\n");
             return;
         }
-        copy(argv[1], argv[2]);
+        if(reflink)
+            copy_reflink(fs, argv[2], argv[3]);
+        else
+            copy(fs, argv[1], argv[2]);
+    }
+
+    else if(!strcmp(argv[0], "compress"))
+    {
+        // compress path...: 启用压缩; compress -d path...: 关闭压缩
+        int enable = !(argc > 1 && !strcmp(argv[1], "-d"));
+        if(argc <= 2 - enable)
+        {
+            printf("no enough arguments'\n");
+            return;
+        }
+        for(i=2-enable; i<argc; i++)
+            set_compress(fs, argv[i], enable);
+    }
+
+    else if(!strcmp(argv[0], "rm"))
+    {
+        if(argc==1)
+        {
+            printf("no enough arguments'\n");
+            return;
+        }
+        for(i=1; i<argc; i++)
+            remove_file(fs, argv[i]);
+    }
+
+    else if(!strcmp(argv[0], "sync"))
+    {
+        filesys_sync(fs);
+    }
+
+    else if(!strcmp(argv[0], "cache"))
+    {
+        // cache: 打印替换策略和命中率; cache lru|2q: 切换替换策略
+        if(argc > 1 && set_cache_policy(fs, argv[1]) != 0)
+            return;
+        cache_info(fs);
+    }
+
+    else if(!strcmp(argv[0], "resize"))
+    {
+        // resize size: 在线扩大磁盘镜像, size可以带K/M/G后缀
+        if(argc==1)
+        {
+            printf("no enough arguments'\n");
+            return;
+        }
+        char *end;
+        uint64_t size = strtoull(argv[1], &end, 10);
+        switch(*end)
+        {
+            case 'g': case 'G': size <<= 10; // fall through
+            case 'm': case 'M': size <<= 10; // fall through
+            case 'k': case 'K': size <<= 10; end++; break;
+        }
+        if(end == argv[1] || *end != '\0')
+        {
+            printf("invalid size %s\n", argv[1]);
+            return;
+        }
+        filesys_resize(fs, size);
+    }
+
+    else if(!strcmp(argv[0], "snapshot"))
+    {
+        // snapshot: 列出快照; snapshot name: 创建快照; snapshot -d name: 删除快照
+        if(argc == 1)
+            ls_snapshots(fs);
+        else if(!strcmp(argv[1], "-d"))
+        {
+            if(argc == 2)
+            {
+                printf("no enough arguments'\n");
+                return;
+            }
+            filesys_snapshot_delete(fs, argv[2]);
+        }
+        else
+            filesys_snapshot(fs, argv[1]);
     }
 
     else if(!strcmp(argv[0], "shutdown"))
     {
-        shutdown();
+        filesys_shutdown(fs);
+        exit(0);
     }
 
     else
@@ -112,4 +361,24 @@ void runcmd(char* argv[], int argc) //运行命令
         return;
     }
 
+}
+
+char* split_path(char* path, char* dir) //将path拆分为上一级目录dir, 返回文件名
+{
+    char *slash = strrchr(path, '/');
+    if(slash == NULL)
+    {
+        strcpy(dir, "/");
+        return path;
+    }
+    if(slash == path)
+    {
+        strcpy(dir, "/");
+    }
+    else
+    {
+        memcpy(dir, path, slash - path);
+        dir[slash - path] = '\0';
+    }
+    return slash + 1;
 }
\ No newline at end of file
@@ -0,0 +1,484 @@
+#include "filesys.h"
+#include "server.h"
+#include "protocol.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#define QUEUE_SIZE 1024
+#define MAX_EVENTS 64
+#define SEND_TIMEOUT_MS 5000    // 客户端不读响应时, 发送最多等待这么久, 超时后关闭连接
+
+// 一个客户端连接; 套接字是非阻塞的, 请求可以分多次到达, 工作线程只读取已经到达的数据,
+// 不会因为客户端只发了半个请求而阻塞
+typedef struct conn {
+    int fd;
+    // EPOLLONESHOT保证同一时刻只有一个工作线程处理连接; 处理时持有这个锁,
+    // 让前一个工作线程的写入对下一个工作线程可见
+    pthread_mutex_t lock;
+    // 正在接收的请求, 已经收到got字节, 依次为请求头, 路径和写请求的数据
+    fs_request req;
+    char path[FS_PATH_MAX + 1];
+    char *data;                 // 写请求的数据, 第一次收到写请求时分配
+    uint32_t got;
+    struct conn *prev, *next;   // 所有连接的链表, 退出时关闭还没有关闭的连接
+} conn;
+
+// 一个服务端实例服务一个文件系统, 一个进程中可以同时运行多个
+typedef struct server {
+    filesys *fs;
+    int epoll_fd;
+    // 有请求可读的连接队列, 由主线程放入, 工作线程取出
+    conn *queue[QUEUE_SIZE];
+    int queue_head, queue_tail, queue_count;
+    pthread_mutex_t queue_lock;
+    pthread_cond_t queue_not_empty;
+    pthread_cond_t queue_not_full;
+    conn conns;                 // 连接链表的哨兵
+    pthread_mutex_t conns_lock;
+} server;
+
+// epoll事件的data.ptr指向连接; 监听套接字和wake_pipe用这两个标记区分
+static char listen_tag, wake_tag;
+
+// 收到SIGINT/SIGTERM后所有服务端实例都退出; 信号处理函数向wake_pipe写入, 唤醒所有实例的epoll
+// stopping由信号处理函数写入, 各实例的主线程读取, 用无锁的原子变量
+static atomic_int stopping = 0;
+static int wake_pipe[2] = { -1, -1 };
+static pthread_once_t signal_once = PTHREAD_ONCE_INIT;
+
+
+static void queue_push(server *srv, conn *c)
+{
+    pthread_mutex_lock(&srv->queue_lock);
+    while(srv->queue_count == QUEUE_SIZE)
+        pthread_cond_wait(&srv->queue_not_full, &srv->queue_lock);
+    srv->queue[srv->queue_tail] = c;
+    srv->queue_tail = (srv->queue_tail + 1) % QUEUE_SIZE;
+    srv->queue_count++;
+    pthread_cond_signal(&srv->queue_not_empty);
+    pthread_mutex_unlock(&srv->queue_lock);
+}
+
+
+static conn* queue_pop(server *srv)
+{
+    pthread_mutex_lock(&srv->queue_lock);
+    while(srv->queue_count == 0)
+        pthread_cond_wait(&srv->queue_not_empty, &srv->queue_lock);
+    conn *c = srv->queue[srv->queue_head];
+    srv->queue_head = (srv->queue_head + 1) % QUEUE_SIZE;
+    srv->queue_count--;
+    pthread_cond_signal(&srv->queue_not_full);
+    pthread_mutex_unlock(&srv->queue_lock);
+    return c;
+}
+
+
+/**
+ * @brief 为新接受的套接字fd建立连接, 加入连接链表
+ */
+static conn* open_conn(server *srv, int fd)
+{
+    conn *c = calloc(1, sizeof(conn));
+    c->fd = fd;
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_mutex_lock(&srv->conns_lock);
+    c->next = srv->conns.next;
+    c->prev = &srv->conns;
+    c->next->prev = c;
+    srv->conns.next = c;
+    pthread_mutex_unlock(&srv->conns_lock);
+    return c;
+}
+
+
+/**
+ * @brief 关闭连接: 先从epoll中删除再关闭套接字, 关闭后编号可能立刻被新连接复用
+ */
+static void close_conn(server *srv, conn *c)
+{
+    epoll_ctl(srv->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    pthread_mutex_lock(&srv->conns_lock);
+    c->prev->next = c->next;
+    c->next->prev = c->prev;
+    pthread_mutex_unlock(&srv->conns_lock);
+    pthread_mutex_destroy(&c->lock);
+    free(c->data);
+    free(c);
+}
+
+
+/**
+ * @brief 读取连接c上已经到达的数据, 接在正在接收的请求后面
+ * @return 收到完整的请求返回1, 数据还没有到达返回0, 连接关闭, 出错或请求不合法返回-1
+ */
+static int recv_request(conn *c)
+{
+    const uint32_t head = sizeof(fs_request);
+    for(;;)
+    {
+        char *dst;
+        uint32_t need;
+        if(c->got < head)
+        {
+            dst = (char*)&c->req + c->got;
+            need = head - c->got;
+        }
+        else
+        {
+            if(c->req.magic != FS_PROTO_MAGIC || c->req.path_len > FS_PATH_MAX || c->req.data_len > FS_DATA_MAX)
+                return -1;
+            uint32_t body = c->req.path_len + (c->req.op == FS_OP_WRITE ? c->req.data_len : 0);
+            uint32_t off = c->got - head;
+            if(off == body)
+            {
+                c->path[c->req.path_len] = '\0';
+                return 1;
+            }
+            if(off < c->req.path_len)
+            {
+                dst = c->path + off;
+                need = c->req.path_len - off;
+            }
+            else
+            {
+                if(c->data == NULL)
+                    c->data = malloc(FS_DATA_MAX);
+                dst = c->data + (off - c->req.path_len);
+                need = body - off;
+            }
+        }
+        ssize_t n = read(c->fd, dst, need);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if(n <= 0)
+            return -1;
+        c->got += n;
+    }
+}
+
+
+/**
+ * @brief 发送响应头和len个字节的响应数据
+ * @return 成功返回0, 失败或者客户端SEND_TIMEOUT_MS内都不读取返回-1
+ */
+static int send_response(int fd, int32_t status, char *data, uint32_t len)
+{
+    fs_response resp;
+    resp.status = status;
+    resp.data_len = len;
+
+    struct iovec iov[2];
+    iov[0].iov_base = &resp;
+    iov[0].iov_len = sizeof(resp);
+    iov[1].iov_base = data;
+    iov[1].iov_len = len;
+    struct iovec *v = iov;
+    int iovcnt = len > 0 ? 2 : 1;
+
+    while(iovcnt > 0)
+    {
+        ssize_t n = writev(fd, v, iovcnt);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            // 套接字是非阻塞的, 发送缓冲区满时等待客户端读取
+            struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+            if(poll(&pfd, 1, SEND_TIMEOUT_MS) <= 0)
+                return -1;
+            continue;
+        }
+        if(n < 0)
+            return -1;
+        // 处理部分写
+        while(iovcnt > 0 && (size_t)n >= v->iov_len)
+        {
+            n -= v->iov_len;
+            v++;
+            iovcnt--;
+        }
+        if(iovcnt > 0)
+        {
+            v->iov_base = (char*)v->iov_base + n;
+            v->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * @brief 将path目录下的目录项打包为fs_dirent序列存放到data中
+ * @return 成功返回目录项数, 失败返回-1, 打包后的长度存放到len中
+ */
+static int pack_dir(filesys *fs, char *path, char *data, uint32_t *len)
+{
+    // 目录项数随块大小变化, 按最大的块大小从堆上分配
+    dir_item *items = malloc(MAX_DIR_ITEMS * sizeof(dir_item));
+    int num = read_dir(fs, path, items, MAX_DIR_ITEMS);
+    *len = 0;
+    if(num < 0)
+    {
+        free(items);
+        return -1;
+    }
+
+    for(int i=0; i<num; i++)
+    {
+        fs_dirent dirent;
+        dirent.inode_id = items[i].inode_id;
+        dirent.type = items[i].type;
+        dirent.name_len = strlen(items[i].name);
+        if(*len + sizeof(dirent) + dirent.name_len > FS_DATA_MAX)
+            break;
+        memcpy(data + *len, &dirent, sizeof(dirent));
+        memcpy(data + *len + sizeof(dirent), items[i].name, dirent.name_len);
+        *len += sizeof(dirent) + dirent.name_len;
+    }
+    free(items);
+    return num;
+}
+
+
+/**
+ * @brief 执行连接c上收到的完整请求并发送响应, 之后开始接收下一个请求
+ * @param data 响应数据的缓冲区, FS_DATA_MAX字节
+ * @return 成功返回0, 发送失败返回-1
+ */
+static int handle_request(filesys *fs, conn *c, char *data)
+{
+    fs_request req = c->req;
+    char *path = c->path;
+    c->got = 0;
+
+    int32_t status = -1;
+    uint32_t len = 0;
+    switch(req.op)
+    {
+        case FS_OP_LOOKUP:
+        {
+            inode stat;
+            status = lookup(fs, path, &stat);
+            if(status >= 0)
+            {
+                fs_stat *st = (fs_stat*)data;
+                st->inode_id = status;
+                st->size = stat.size;
+                st->file_type = stat.file_type;
+                st->link = stat.link;
+                len = sizeof(fs_stat);
+            }
+            break;
+        }
+        case FS_OP_CREATE:
+            status = req.flags == TYPE_FOLDER ? mkdir(fs, path) : touch(fs, path);
+            break;
+        case FS_OP_READDIR:
+            status = pack_dir(fs, path, data, &len);
+            break;
+        case FS_OP_READ:
+            status = read_file(fs, path, req.offset, data, req.data_len);
+            if(status > 0)
+                len = status;
+            break;
+        case FS_OP_WRITE:
+            status = write_file(fs, path, req.offset, c->data, req.data_len);
+            break;
+        case FS_OP_COPY:
+        {
+            // 路径为"dest\0src"
+            size_t dest_len = strlen(path);
+            if(dest_len < req.path_len)
+                status = req.flags & FS_COPY_REFLINK ? copy_reflink(fs, path, path + dest_len + 1)
+                                                     : copy(fs, path, path + dest_len + 1);
+            break;
+        }
+        case FS_OP_CLOSE:
+            status = close_file(fs, path);
+            break;
+        case FS_OP_REMOVE:
+            status = remove_file(fs, path);
+            break;
+        case FS_OP_SYNC:
+            filesys_sync(fs);
+            status = 0;
+            break;
+        default:
+            break;
+    }
+
+    return send_response(c->fd, status, data, len);
+}
+
+
+static void* worker_main(void *arg)
+{
+    server *srv = arg;
+    char *data = malloc(FS_DATA_MAX);
+    for(;;)
+    {
+        conn *c = queue_pop(srv);
+        if(c == NULL)
+            break;
+
+        // 处理已经完整到达的所有请求, 剩下的半个请求留在连接中等下次可读
+        int r;
+        pthread_mutex_lock(&c->lock);
+        while((r = recv_request(c)) == 1)
+        {
+            if(handle_request(srv->fs, c, data) < 0)
+            {
+                r = -1;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&c->lock);
+        if(r < 0)
+        {
+            close_conn(srv, c);
+            continue;
+        }
+
+        // 连接以EPOLLONESHOT注册, 处理完后重新监听
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLONESHOT;
+        ev.data.ptr = c;
+        if(epoll_ctl(srv->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev) < 0)
+            close_conn(srv, c);
+    }
+    free(data);
+    return NULL;
+}
+
+
+static void handle_signal(int sig)
+{
+    (void)sig;
+    atomic_store(&stopping, 1);
+    ssize_t r = write(wake_pipe[1], "", 1);
+    (void)r;
+}
+
+
+static void install_signals()
+{
+    pipe(wake_pipe);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+}
+
+
+int server_run(filesys *fs, const char *sock_path, int workers)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(sock_path) >= sizeof(addr.sun_path))
+    {
+        printf("socket path %s is too long\n", sock_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, sock_path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listen_fd < 0)
+    {
+        printf("fail to create socket\n");
+        return -1;
+    }
+    unlink(sock_path);
+    if(bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listen_fd, 128) < 0)
+    {
+        printf("fail to listen on %s\n", sock_path);
+        close(listen_fd);
+        return -1;
+    }
+
+    pthread_once(&signal_once, install_signals);
+    server *srv = calloc(1, sizeof(server));
+    srv->fs = fs;
+    pthread_mutex_init(&srv->queue_lock, NULL);
+    pthread_cond_init(&srv->queue_not_empty, NULL);
+    pthread_cond_init(&srv->queue_not_full, NULL);
+    pthread_mutex_init(&srv->conns_lock, NULL);
+    srv->conns.prev = srv->conns.next = &srv->conns;
+
+    srv->epoll_fd = epoll_create1(0);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &listen_tag;
+    epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+    // wake_pipe写入后一直可读, 所有实例都会醒来
+    ev.data.ptr = &wake_tag;
+    epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, wake_pipe[0], &ev);
+
+    if(workers <= 0)
+        workers = SERVER_DEFAULT_WORKERS;
+    pthread_t *threads = malloc(sizeof(pthread_t) * workers);
+    for(int i=0; i<workers; i++)
+        pthread_create(&threads[i], NULL, worker_main, srv);
+
+    printf("serving on %s with %d workers\n", sock_path, workers);
+    fflush(stdout);
+
+    struct epoll_event events[MAX_EVENTS];
+    while(!atomic_load(&stopping))
+    {
+        int n = epoll_wait(srv->epoll_fd, events, MAX_EVENTS, -1);
+        for(int i=0; i<n; i++)
+        {
+            if(events[i].data.ptr == &wake_tag)
+                continue;
+            if(events[i].data.ptr == &listen_tag)
+            {
+                int client_fd = accept(listen_fd, NULL, NULL);
+                if(client_fd < 0)
+                    continue;
+                fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) | O_NONBLOCK);
+                conn *c = open_conn(srv, client_fd);
+                struct epoll_event client_ev;
+                client_ev.events = EPOLLIN | EPOLLONESHOT;
+                client_ev.data.ptr = c;
+                if(epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, client_fd, &client_ev) < 0)
+                    close_conn(srv, c);
+            }
+            else
+            {
+                queue_push(srv, events[i].data.ptr);
+            }
+        }
+    }
+
+    // 通知所有工作线程退出
+    for(int i=0; i<workers; i++)
+        queue_push(srv, NULL);
+    for(int i=0; i<workers; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    // 关闭还连着的客户端
+    while(srv->conns.next != &srv->conns)
+        close_conn(srv, srv->conns.next);
+
+    close(listen_fd);
+    close(srv->epoll_fd);
+    free(srv);
+    unlink(sock_path);
+    return 0;
+}
@@ -0,0 +1,140 @@
+#include "disk.h"
+#include "filesys.h"
+
+// 压缩测试: 可压缩的数据按压缩格式存放, 重新挂载后读回完整; 部分覆盖写后解压再重新压缩;
+// 不可压缩的数据按普通块存放; 关闭压缩后按普通块写回, 内容不变
+#define IMAGE "compress.img"
+#define DATA_LEN 5000
+#define BLOCK_LEN 1024
+
+static char text_data[DATA_LEN];
+static char noise_data[DATA_LEN];
+static const char patch[] = "PARTIAL OVERWRITE IN THE MIDDLE OF A COMPRESSED FILE";
+
+
+/**
+ * @brief 从fs中读出path的全部内容, 和长度为DATA_LEN的expect比较
+ * @return 内容一致返回0, 否则返回1
+ */
+static int check_file(filesys *fs, char *path, const char *expect, const char *what)
+{
+    char buf[DATA_LEN + 1];
+    int n = read_file(fs, path, 0, buf, sizeof(buf));
+    if(n != DATA_LEN || memcmp(buf, expect, DATA_LEN) != 0)
+    {
+        printf("%s: read %d bytes from %s, expected %d bytes of the written content\n", what, n, path, DATA_LEN);
+        return 1;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief 检查path是否按压缩格式存放: compressed为1时应该有INODE_COMPRESSED标记并且比原数据少用块,
+ *        为0时应该没有这个标记并且每个块都有数据块
+ * @return 符合返回0, 否则返回1
+ */
+static int check_layout(filesys *fs, char *path, int compressed, const char *what)
+{
+    inode stat;
+    if(lookup(fs, path, &stat) < 0)
+    {
+        printf("%s: %s is not exist\n", what, path);
+        return 1;
+    }
+    int used = 0;
+    for(int i=0; i<6; i++)
+        used += stat.block_point[i] != 0;
+    int plain = (DATA_LEN + BLOCK_LEN - 1) / BLOCK_LEN;
+    if(compressed != ((stat.flags & INODE_COMPRESSED) != 0) || (compressed ? used >= plain : used != plain))
+    {
+        printf("%s: %s has flags %#x and %d blocks, expected it %s\n", what, path, stat.flags, used,
+            compressed ? "compressed" : "stored as plain blocks");
+        return 1;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief 卸载fs再重新挂载同一个镜像
+ * @return 新的实例, 挂载失败返回NULL
+ */
+static filesys* remount(filesys *fs)
+{
+    filesys_shutdown(fs);
+    fs = filesys_init(open_disk_path(IMAGE));
+    if(fs == NULL)
+        printf("fail to mount the file system\n");
+    return fs;
+}
+
+
+int main(void)
+{
+    static const char words[] = "the quick brown fox jumps over the lazy dog. ";
+    for(int i=0; i<DATA_LEN; i++)
+        text_data[i] = words[i % (sizeof(words) - 1)];
+    // 线性同余生成的字节几乎压缩不了
+    uint32_t seed = 12345;
+    for(int i=0; i<DATA_LEN; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        noise_data[i] = seed >> 24;
+    }
+
+    unlink(IMAGE);
+    // open_disk()创建新的镜像, 挂载时发现没有格式化会先格式化
+    disk *d = open_disk(IMAGE);
+    filesys *fs = d != NULL ? filesys_init(d) : NULL;
+    if(fs == NULL)
+    {
+        printf("fail to create the file system\n");
+        return 1;
+    }
+    if(touch(fs, "/text") < 0 || touch(fs, "/noise") < 0
+        || write_file(fs, "/text", 0, text_data, DATA_LEN) != DATA_LEN
+        || write_file(fs, "/noise", 0, noise_data, DATA_LEN) != DATA_LEN
+        || set_compress(fs, "/text", 1) != 0 || set_compress(fs, "/noise", 1) != 0)
+    {
+        printf("fail to prepare the files\n");
+        filesys_shutdown(fs);
+        return 1;
+    }
+
+    int bad = 0;
+    if((fs = remount(fs)) == NULL)
+        return 1;
+    bad |= check_layout(fs, "/text", 1, "compressible");
+    bad |= check_file(fs, "/text", text_data, "compressible");
+    bad |= check_layout(fs, "/noise", 0, "incompressible");
+    bad |= check_file(fs, "/noise", noise_data, "incompressible");
+
+    // 部分覆盖写: 簇先解压到缓存中, 写回时整个文件重新压缩
+    memcpy(text_data + 2000, patch, strlen(patch));
+    if(write_file(fs, "/text", 2000, (char*)patch, strlen(patch)) != (int)strlen(patch))
+    {
+        printf("fail to overwrite /text\n");
+        bad = 1;
+    }
+    bad |= check_file(fs, "/text", text_data, "overwritten before remount");
+    if((fs = remount(fs)) == NULL)
+        return 1;
+    bad |= check_layout(fs, "/text", 1, "overwritten");
+    bad |= check_file(fs, "/text", text_data, "overwritten");
+
+    // 关闭压缩后按普通文件写回
+    if(set_compress(fs, "/text", 0) != 0)
+    {
+        printf("fail to disable compression on /text\n");
+        bad = 1;
+    }
+    if((fs = remount(fs)) == NULL)
+        return 1;
+    bad |= check_layout(fs, "/text", 0, "decompressed");
+    bad |= check_file(fs, "/text", text_data, "decompressed");
+    filesys_shutdown(fs);
+
+    unlink(IMAGE);
+    return bad;
+}
@@ -0,0 +1,87 @@
+#include "disk.h"
+#include "filesys.h"
+
+// 去重测试: 内容相同的文件去重后释放了块; 之后写其中一个文件, 其他文件的内容不变, 重新挂载后也一样
+#define IMAGE "dedupe.img"
+#define DATA_LEN 4096
+
+static char same_data[DATA_LEN];
+static char new_data[DATA_LEN];
+static const char patch[] = "written after the dedupe";
+
+
+/**
+ * @brief 从fs中读出path的全部内容, 和长度为DATA_LEN的expect比较
+ * @return 内容一致返回0, 否则返回1
+ */
+static int check_file(filesys *fs, char *path, const char *expect, const char *what)
+{
+    char buf[DATA_LEN + 1];
+    int n = read_file(fs, path, 0, buf, sizeof(buf));
+    if(n != DATA_LEN || memcmp(buf, expect, DATA_LEN) != 0)
+    {
+        printf("%s: read %d bytes from %s, expected %d bytes of the expected content\n", what, n, path, DATA_LEN);
+        return 1;
+    }
+    return 0;
+}
+
+
+int main(void)
+{
+    for(int i=0; i<DATA_LEN; i++)
+        same_data[i] = 'a' + i % 26;
+    memcpy(new_data, same_data, DATA_LEN);
+    memcpy(new_data, patch, strlen(patch));
+
+    unlink(IMAGE);
+    // open_disk()创建新的镜像, 挂载时发现没有格式化会先格式化
+    disk *d = open_disk(IMAGE);
+    filesys *fs = d != NULL ? filesys_init(d) : NULL;
+    if(fs == NULL)
+    {
+        printf("fail to create the file system\n");
+        return 1;
+    }
+    char *paths[] = {"/a", "/b", "/c"};
+    for(int i=0; i<3; i++)
+    {
+        if(touch(fs, paths[i]) < 0 || write_file(fs, paths[i], 0, same_data, DATA_LEN) != DATA_LEN)
+        {
+            printf("fail to prepare %s\n", paths[i]);
+            filesys_shutdown(fs);
+            return 1;
+        }
+    }
+
+    int bad = 0;
+    dedupe_stat stat;
+    if(filesys_dedupe(fs, 2, &stat) != 0 || stat.freed == 0)
+    {
+        printf("dedupe freed %llu blocks, expected some\n", (unsigned long long)stat.freed);
+        bad = 1;
+    }
+    if(write_file(fs, "/b", 0, (char*)patch, strlen(patch)) != (int)strlen(patch))
+    {
+        printf("fail to write /b after the dedupe\n");
+        bad = 1;
+    }
+    bad |= check_file(fs, "/a", same_data, "after writing /b");
+    bad |= check_file(fs, "/b", new_data, "after writing /b");
+    bad |= check_file(fs, "/c", same_data, "after writing /b");
+    filesys_shutdown(fs);
+
+    fs = filesys_init(open_disk_path(IMAGE));
+    if(fs == NULL)
+    {
+        printf("fail to mount the file system\n");
+        return 1;
+    }
+    bad |= check_file(fs, "/a", same_data, "after remount");
+    bad |= check_file(fs, "/b", new_data, "after remount");
+    bad |= check_file(fs, "/c", same_data, "after remount");
+    filesys_shutdown(fs);
+
+    unlink(IMAGE);
+    return bad;
+}
@@ -0,0 +1,110 @@
+#include "disk.h"
+#include "filesys.h"
+
+// reflink测试: 写复制出的文件时原文件不变; 删除其中一个文件并重新挂载后, 另一个文件仍然完整,
+// 共享的块都只剩一个引用, 引用计数表变为空
+#define IMAGE "reflink.img"
+#define DATA_LEN 3000
+
+static char src_data[DATA_LEN];
+static char dest_data[DATA_LEN];
+static const char patch[] = "written to the copy only";
+
+
+/**
+ * @brief 从fs中读出path的全部内容, 和长度为len的expect比较
+ * @return 内容一致返回0, 否则返回1
+ */
+static int check_file(filesys *fs, char *path, const char *expect, int len, const char *what)
+{
+    char buf[DATA_LEN + 1];
+    int n = read_file(fs, path, 0, buf, sizeof(buf));
+    if(n != len || memcmp(buf, expect, len) != 0)
+    {
+        printf("%s: read %d bytes from %s, expected %d bytes of the original content\n", what, n, path, len);
+        return 1;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief 直接从镜像中读出超级块里的引用计数表项数
+ * @return 读取失败返回-1
+ */
+static int read_refcount_count(void)
+{
+    disk *d = open_disk_path(IMAGE);
+    if(d == NULL)
+        return -1;
+    char buf[SUPER_BLOCK_SIZE];
+    int ret = disk_read_blocks(d, SUPER_BLOCK_INDEX, SUPER_BLOCK_SIZE/DEVICE_BLOCK_SIZE, buf);
+    close_disk(d);
+    return ret != 0 ? -1 : (int)((sp_block*)buf)->refcount_count;
+}
+
+
+int main(void)
+{
+    for(int i=0; i<DATA_LEN; i++)
+        src_data[i] = 'a' + i % 26;
+    memcpy(dest_data, src_data, DATA_LEN);
+    memcpy(dest_data, patch, strlen(patch));
+
+    unlink(IMAGE);
+    // open_disk()创建新的镜像, 挂载时发现没有格式化会先格式化
+    disk *d = open_disk(IMAGE);
+    filesys *fs = d != NULL ? filesys_init(d) : NULL;
+    if(fs == NULL)
+    {
+        printf("fail to create the file system\n");
+        return 1;
+    }
+    int bad = 0;
+    if(touch(fs, "/a") < 0
+        || write_file(fs, "/a", 0, src_data, DATA_LEN) != DATA_LEN
+        || copy_reflink(fs, "/b", "/a") < 0
+        || write_file(fs, "/b", 0, (char*)patch, strlen(patch)) != (int)strlen(patch))
+    {
+        printf("fail to prepare the files\n");
+        filesys_shutdown(fs);
+        return 1;
+    }
+    bad |= check_file(fs, "/a", src_data, DATA_LEN, "source after writing the copy");
+    bad |= check_file(fs, "/b", dest_data, DATA_LEN, "copy after writing it");
+    filesys_shutdown(fs);
+
+    fs = filesys_init(open_disk_path(IMAGE));
+    if(fs == NULL)
+    {
+        printf("fail to mount the file system\n");
+        return 1;
+    }
+    bad |= check_file(fs, "/a", src_data, DATA_LEN, "source after remount");
+    bad |= check_file(fs, "/b", dest_data, DATA_LEN, "copy after remount");
+    if(remove_file(fs, "/a") != 0)
+    {
+        printf("fail to remove the source\n");
+        bad = 1;
+    }
+    filesys_shutdown(fs);
+
+    fs = filesys_init(open_disk_path(IMAGE));
+    if(fs == NULL)
+    {
+        printf("fail to mount the file system\n");
+        return 1;
+    }
+    bad |= check_file(fs, "/b", dest_data, DATA_LEN, "copy after removing the source");
+    filesys_shutdown(fs);
+
+    int refs = read_refcount_count();
+    if(refs != 0)
+    {
+        printf("refcount table still has %d entries after removing the source\n", refs);
+        bad = 1;
+    }
+
+    unlink(IMAGE);
+    return bad;
+}
@@ -0,0 +1,93 @@
+#include "disk.h"
+#include "filesys.h"
+
+// 快照读测试: 快照之后修改过的文件和删除后重新创建的文件, 从快照中读回的仍是快照时的内容;
+// 删除快照之后当前的内容不变
+#define IMAGE "snapshot_read.img"
+
+static const char old_data[] = "content before the snapshot";
+static const char new_data[] = "NEW DATA written after the snapshot, longer than before";
+
+
+/**
+ * @brief 从fs中读出path的全部内容到buf中, 和expect比较
+ * @return 内容一致返回0, 否则返回1
+ */
+static int check_file(filesys *fs, char *path, const char *expect, const char *what)
+{
+    char buf[256];
+    memset(buf, 0, sizeof(buf));
+    int n = read_file(fs, path, 0, buf, sizeof(buf) - 1);
+    if(n != (int)strlen(expect) || memcmp(buf, expect, n) != 0)
+    {
+        printf("%s: read %d bytes \"%s\", expected \"%s\"\n", what, n, n > 0 ? buf : "", expect);
+        return 1;
+    }
+    return 0;
+}
+
+
+int main(void)
+{
+    unlink(IMAGE);
+    // open_disk()创建新的镜像, 挂载时发现没有格式化会先格式化
+    disk *d = open_disk(IMAGE);
+    filesys *fs = d != NULL ? filesys_init(d) : NULL;
+    if(fs == NULL)
+    {
+        printf("fail to create the file system\n");
+        return 1;
+    }
+    if(touch(fs, "/a") < 0 || touch(fs, "/b") < 0
+        || write_file(fs, "/a", 0, (char*)old_data, strlen(old_data)) != (int)strlen(old_data)
+        || write_file(fs, "/b", 0, (char*)old_data, strlen(old_data)) != (int)strlen(old_data)
+        || filesys_snapshot(fs, "s1") != 0
+        || write_file(fs, "/a", 0, (char*)new_data, strlen(new_data)) != (int)strlen(new_data)
+        || remove_file(fs, "/b") != 0 || touch(fs, "/b") < 0
+        || write_file(fs, "/b", 0, (char*)new_data, strlen(new_data)) != (int)strlen(new_data))
+    {
+        printf("fail to prepare the file\n");
+        filesys_shutdown(fs);
+        return 1;
+    }
+    filesys_shutdown(fs);
+
+    int bad = 0;
+    fs = filesys_open_snapshot(open_disk_path(IMAGE), "s1");
+    if(fs == NULL)
+    {
+        printf("fail to open the snapshot\n");
+        return 1;
+    }
+    bad |= check_file(fs, "/a", old_data, "snapshot");
+    bad |= check_file(fs, "/b", old_data, "snapshot");
+    filesys_shutdown(fs);
+
+    fs = filesys_init(open_disk_path(IMAGE));
+    if(fs == NULL)
+    {
+        printf("fail to mount the file system\n");
+        return 1;
+    }
+    bad |= check_file(fs, "/a", new_data, "live");
+    bad |= check_file(fs, "/b", new_data, "live");
+    if(filesys_snapshot_delete(fs, "s1") != 0)
+    {
+        printf("fail to delete the snapshot\n");
+        bad = 1;
+    }
+    filesys_shutdown(fs);
+
+    fs = filesys_init(open_disk_path(IMAGE));
+    if(fs == NULL)
+    {
+        printf("fail to mount the file system\n");
+        return 1;
+    }
+    bad |= check_file(fs, "/a", new_data, "after delete");
+    bad |= check_file(fs, "/b", new_data, "after delete");
+    filesys_shutdown(fs);
+
+    unlink(IMAGE);
+    return bad;
+}
@@ -0,0 +1,140 @@
+#include "disk.h"
+#include "filesys.h"
+
+// 尾块打包测试, 每一步都重新挂载后读回检查: 两个小文件共用一个尾块; 文件变大后搬出尾块;
+// 搬出后空出的槽被新的小文件重新使用
+#define IMAGE "tail_pack.img"
+#define GROWN_LEN 3000
+
+static char a_data[GROWN_LEN];
+static char b_data[120];
+static char c_data[110];
+
+
+/**
+ * @brief 从fs中读出path的全部内容, 和长度为len的expect比较
+ * @return 内容一致返回0, 否则返回1
+ */
+static int check_file(filesys *fs, char *path, const char *expect, int len, const char *what)
+{
+    char buf[GROWN_LEN + 1];
+    int n = read_file(fs, path, 0, buf, sizeof(buf));
+    if(n != len || memcmp(buf, expect, len) != 0)
+    {
+        printf("%s: read %d bytes from %s, expected %d bytes of the written content\n", what, n, path, len);
+        return 1;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief 读出path的inode, 打包在尾块中时返回槽号, 尾块号存放到block中
+ * @return 不在尾块中或不存在返回-1
+ */
+static int tail_slot(filesys *fs, char *path, uint64_t *block)
+{
+    inode stat;
+    if(lookup(fs, path, &stat) < 0 || !(stat.flags & INODE_TAIL))
+        return -1;
+    *block = stat.block_point[0];
+    return (stat.flags & TAIL_SLOT_MASK) >> TAIL_SLOT_SHIFT;
+}
+
+
+/**
+ * @brief 卸载fs再重新挂载同一个镜像
+ * @return 新的实例, 挂载失败返回NULL
+ */
+static filesys* remount(filesys *fs)
+{
+    filesys_shutdown(fs);
+    fs = filesys_init(open_disk_path(IMAGE));
+    if(fs == NULL)
+        printf("fail to mount the file system\n");
+    return fs;
+}
+
+
+int main(void)
+{
+    for(int i=0; i<GROWN_LEN; i++)
+        a_data[i] = 'a' + i % 26;
+    memset(b_data, 'b', sizeof(b_data));
+    memset(c_data, 'c', sizeof(c_data));
+
+    unlink(IMAGE);
+    // open_disk()创建新的镜像, 挂载时发现没有格式化会先格式化
+    disk *d = open_disk(IMAGE);
+    filesys *fs = d != NULL ? filesys_init(d) : NULL;
+    if(fs == NULL)
+    {
+        printf("fail to create the file system\n");
+        return 1;
+    }
+    if(touch(fs, "/a") < 0 || touch(fs, "/b") < 0
+        || write_file(fs, "/a", 0, a_data, 100) != 100
+        || write_file(fs, "/b", 0, b_data, sizeof(b_data)) != (int)sizeof(b_data))
+    {
+        printf("fail to prepare the files\n");
+        filesys_shutdown(fs);
+        return 1;
+    }
+
+    // 两个小文件共用一个尾块的不同槽
+    int bad = 0;
+    if((fs = remount(fs)) == NULL)
+        return 1;
+    uint64_t a_block = 0, b_block = 0;
+    int a_slot = tail_slot(fs, "/a", &a_block);
+    int b_slot = tail_slot(fs, "/b", &b_block);
+    if(a_slot < 0 || b_slot < 0 || a_block != b_block || a_slot == b_slot)
+    {
+        printf("small files: /a in block %llu slot %d, /b in block %llu slot %d, expected one shared tail block\n",
+            (unsigned long long)a_block, a_slot, (unsigned long long)b_block, b_slot);
+        bad = 1;
+    }
+    bad |= check_file(fs, "/a", a_data, 100, "small files");
+    bad |= check_file(fs, "/b", b_data, sizeof(b_data), "small files");
+
+    // /a变大后搬出尾块, /b不受影响
+    if(write_file(fs, "/a", 100, a_data + 100, GROWN_LEN - 100) != GROWN_LEN - 100)
+    {
+        printf("fail to grow /a\n");
+        bad = 1;
+    }
+    if((fs = remount(fs)) == NULL)
+        return 1;
+    uint64_t block;
+    if(tail_slot(fs, "/a", &block) >= 0 || tail_slot(fs, "/b", &block) != b_slot)
+    {
+        printf("grown file: /a should have left the tail block and /b should stay in slot %d\n", b_slot);
+        bad = 1;
+    }
+    bad |= check_file(fs, "/a", a_data, GROWN_LEN, "grown file");
+    bad |= check_file(fs, "/b", b_data, sizeof(b_data), "grown file");
+
+    // 新的小文件放进/a空出的槽
+    if(touch(fs, "/c") < 0 || write_file(fs, "/c", 0, c_data, sizeof(c_data)) != (int)sizeof(c_data))
+    {
+        printf("fail to write /c\n");
+        bad = 1;
+    }
+    if((fs = remount(fs)) == NULL)
+        return 1;
+    uint64_t c_block = 0;
+    int c_slot = tail_slot(fs, "/c", &c_block);
+    if(c_block != b_block || c_slot != a_slot)
+    {
+        printf("reused slot: /c in block %llu slot %d, expected block %llu slot %d\n",
+            (unsigned long long)c_block, c_slot, (unsigned long long)b_block, a_slot);
+        bad = 1;
+    }
+    bad |= check_file(fs, "/a", a_data, GROWN_LEN, "reused slot");
+    bad |= check_file(fs, "/b", b_data, sizeof(b_data), "reused slot");
+    bad |= check_file(fs, "/c", c_data, sizeof(c_data), "reused slot");
+    filesys_shutdown(fs);
+
+    unlink(IMAGE);
+    return bad;
+}
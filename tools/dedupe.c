@@ -0,0 +1,61 @@
+// 离线去重: 找出镜像中内容相同的文件数据块, 让它们共享同一个块并释放多余的块
+// 共享的块带引用计数, 之后任一个文件写这个块时才复制出新块
+//
+// 用法: dedupe [-t threads] [image]
+// -t: 并行计算哈希的线程数, 默认为在线CPU数
+// image默认为当前目录下的disk; 运行期间不能有其他进程使用这个镜像
+
+#include "disk.h"
+#include "filesys.h"
+
+
+int main(int argc, char *argv[])
+{
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+    int bad = 0;
+    while((opt = getopt(argc, argv, "t:")) != -1)
+    {
+        switch(opt)
+        {
+            case 't': threads = atoi(optarg); bad |= threads <= 0; break;
+            default: bad = 1; break;
+        }
+    }
+    if(bad || optind + 1 < argc)
+    {
+        printf("usage: %s [-t threads] [image]\n", argv[0]);
+        return 1;
+    }
+    const char *image = optind < argc ? argv[optind] : "disk";
+
+    disk *d = open_disk_path(image);
+    if(d == NULL)
+    {
+        printf("fail to open %s\n", image);
+        return 1;
+    }
+    // filesys_init()会格式化没有文件系统的镜像, 先检查超级块
+    char buf[SUPER_BLOCK_SIZE];
+    sp_block sb;
+    disk_read_blocks(d, SUPER_BLOCK_INDEX, SUPER_BLOCK_SIZE/DEVICE_BLOCK_SIZE, buf);
+    memcpy(&sb, buf, sizeof(sp_block));
+    if(sb.magic_num != SYS_MAGIC_NUM)
+    {
+        printf("%s is not a formatted image\n", image);
+        close_disk(d);
+        return 1;
+    }
+    filesys *fs = filesys_init(d);
+    if(fs == NULL)
+        return 1;
+
+    dedupe_stat stat;
+    int ret = filesys_dedupe(fs, threads, &stat);
+    printf("%s: scanned %llu blocks, remapped %llu duplicates, freed %llu blocks\n", image,
+           (unsigned long long)stat.scanned, (unsigned long long)stat.duplicates, (unsigned long long)stat.freed);
+    if(ret != 0)
+        printf("dedupe stopped early on an I/O error\n");
+    filesys_shutdown(fs);
+    return ret != 0;
+}
@@ -0,0 +1,197 @@
+// 文件系统核心的多线程create/lookup基准测试
+// 线程数从1开始每轮翻倍直到max_threads, 每个线程在自己的目录下创建files个文件,
+// 然后随机lookup这些文件lookups次, 分别输出每轮创建和查找的吞吐量
+//
+// 用法: fsbench [-c max_threads] [-n files_per_thread] [-l lookups_per_thread] [-w]
+// -w: 每轮额外运行一个写线程, 在/r<轮次>w下不断创建和写文件, 用于观察并发写时的读吞吐
+// 在当前目录的disk镜像上运行, 会在根目录下创建/r<轮次>t<线程>目录
+
+#include "disk.h"
+#include "filesys.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+static int max_threads = 8;
+static int files = 32;
+static int lookups = 20000;
+static int with_writer = 0;
+// 主线程写入, 后台写者线程读取, 用原子变量
+static atomic_int writer_running;
+static pthread_barrier_t barrier;
+static filesys *fs;
+
+typedef struct worker {
+    pthread_t thread;
+    int round;
+    int id;
+    uint64_t errors;
+} worker;
+
+static uint64_t phase_start[3];
+
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+static void* worker_main(void *arg)
+{
+    worker *w = arg;
+    char path[128];
+    unsigned seed = w->id * 7919 + w->round;
+    inode stat;
+
+    // 阶段之间用barrier分隔, 由0号线程记录时间
+    pthread_barrier_wait(&barrier);
+    if(w->id == 0)
+        phase_start[0] = now_ns();
+    for(int i=0; i<files; i++)
+    {
+        snprintf(path, sizeof(path), "/r%dt%d/f%d", w->round, w->id, i);
+        if(touch(fs, path) < 0)
+            w->errors++;
+    }
+
+    pthread_barrier_wait(&barrier);
+    if(w->id == 0)
+        phase_start[1] = now_ns();
+    for(int i=0; i<lookups; i++)
+    {
+        snprintf(path, sizeof(path), "/r%dt%d/f%d", w->round, w->id, rand_r(&seed) % files);
+        if(lookup(fs, path, &stat) < 0)
+            w->errors++;
+    }
+
+    pthread_barrier_wait(&barrier);
+    if(w->id == 0)
+        phase_start[2] = now_ns();
+    return NULL;
+}
+
+
+static void* writer_main(void *arg)
+{
+    int round = *(int*)arg;
+    char path[128];
+    char data[MIN_BLOCK_SIZE];
+    int created = 0;
+    int full = 0;
+    memset(data, 'w', MIN_BLOCK_SIZE);
+
+    snprintf(path, sizeof(path), "/r%dw", round);
+    mkdir(fs, path);
+    snprintf(path, sizeof(path), "/r%dw/f", round);
+    touch(fs, path);
+    while(atomic_load(&writer_running))
+    {
+        if(!full)
+        {
+            snprintf(path, sizeof(path), "/r%dw/n%d", round, created++);
+            full = touch(fs, path) < 0;
+        }
+        else
+        {
+            snprintf(path, sizeof(path), "/r%dw/f", round);
+            write_file(fs, path, 0, data, MIN_BLOCK_SIZE);
+        }
+    }
+    return NULL;
+}
+
+
+static void run_round(int round, int threads)
+{
+    char path[64];
+    worker *ws = calloc(threads, sizeof(worker));
+    for(int i=0; i<threads; i++)
+    {
+        snprintf(path, sizeof(path), "/r%dt%d", round, i);
+        mkdir(fs, path);
+        ws[i].round = round;
+        ws[i].id = i;
+    }
+
+    pthread_t writer;
+    atomic_store(&writer_running, 1);
+    if(with_writer)
+        pthread_create(&writer, NULL, writer_main, &round);
+
+    pthread_barrier_init(&barrier, NULL, threads);
+    for(int i=0; i<threads; i++)
+        pthread_create(&ws[i].thread, NULL, worker_main, &ws[i]);
+    uint64_t errors = 0;
+    for(int i=0; i<threads; i++)
+    {
+        pthread_join(ws[i].thread, NULL);
+        errors += ws[i].errors;
+    }
+    pthread_barrier_destroy(&barrier);
+    atomic_store(&writer_running, 0);
+    if(with_writer)
+        pthread_join(writer, NULL);
+
+    double create_sec = (phase_start[1] - phase_start[0]) / 1e9;
+    double lookup_sec = (phase_start[2] - phase_start[1]) / 1e9;
+    printf("%7d %14.0f %14.0f %8llu\n", threads,
+           (double)threads * files / create_sec,
+           (double)threads * lookups / lookup_sec,
+           (unsigned long long)errors);
+    fflush(stdout);
+    free(ws);
+}
+
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    while((opt = getopt(argc, argv, "c:n:l:w")) != -1)
+    {
+        switch(opt)
+        {
+            case 'c': max_threads = atoi(optarg); break;
+            case 'n': files = atoi(optarg); break;
+            case 'l': lookups = atoi(optarg); break;
+            case 'w': with_writer = 1; break;
+            default:
+                printf("usage: %s [-c max_threads] [-n files_per_thread] [-l lookups_per_thread] [-w]\n", argv[0]);
+                return 1;
+        }
+    }
+    if(max_threads <= 0 || files <= 0 || lookups <= 0)
+    {
+        printf("invalid arguments\n");
+        return 1;
+    }
+
+    disk *d = open_disk("disk");
+    if(d == NULL)
+    {
+        printf("fail to open the disk\n");
+        return 1;
+    }
+    fs = filesys_init(d);
+    if(fs == NULL)
+    {
+        close_disk(d);
+        return 1;
+    }
+
+    printf("%7s %14s %14s %8s\n", "threads", "creates/sec", "lookups/sec", "errors");
+    int round = 0;
+    for(int threads = 1; ; threads *= 2)
+    {
+        if(threads > max_threads)
+            threads = max_threads;
+        run_round(round++, threads);
+        if(threads == max_threads)
+            break;
+    }
+    filesys_shutdown(fs);
+    return 0;
+}
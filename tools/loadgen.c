@@ -0,0 +1,309 @@
+// 文件系统服务端的压力测试客户端
+// 客户端数从1开始每轮翻倍直到max_clients, 每轮运行seconds秒,
+// 输出每轮的吞吐量(ops/sec)和延迟分位数
+//
+// 用法: loadgen [-c max_clients] [-t seconds] [-w write_percent] [socket]
+
+#include "protocol.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FILE_TYPE   1
+#define FOLDER_TYPE 0
+#define FILE_BYTES  1024
+
+static const char *sock_path = "fs.sock";
+static int max_clients = 16;
+static int seconds = 3;
+static int write_percent = 2;
+static volatile int running;
+
+typedef struct client {
+    pthread_t thread;
+    int id;
+    int fd;
+    unsigned seed;
+    uint64_t *lat;              // 每个操作的延迟(纳秒)
+    size_t lat_num, lat_cap;
+    uint64_t errors;
+    int created;
+} client;
+
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+static int connect_server()
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, sock_path, sizeof(addr.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+        printf("fail to connect to %s\n", sock_path);
+        exit(1);
+    }
+    return fd;
+}
+
+
+static int io_full(int fd, void *data, size_t len, int is_write)
+{
+    char *p = data;
+    while(len > 0)
+    {
+        ssize_t n = is_write ? write(fd, p, len) : read(fd, p, len);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief 发送一个请求并等待响应, 响应数据存放到out中(最多FS_DATA_MAX字节)
+ * @return 返回响应的status, 连接出错时退出
+ */
+static int call(int fd, uint16_t op, uint16_t flags, const char *path, uint32_t path_len,
+                uint32_t offset, const char *data, uint32_t data_len, char *out)
+{
+    fs_request req;
+    req.magic = FS_PROTO_MAGIC;
+    req.op = op;
+    req.flags = flags;
+    req.path_len = path_len;
+    req.offset = offset;
+    req.data_len = data_len;
+
+    struct iovec iov[3];
+    iov[0].iov_base = &req;
+    iov[0].iov_len = sizeof(req);
+    iov[1].iov_base = (void*)path;
+    iov[1].iov_len = path_len;
+    iov[2].iov_base = (void*)data;
+    iov[2].iov_len = op == FS_OP_WRITE ? data_len : 0;
+    size_t total = iov[0].iov_len + iov[1].iov_len + iov[2].iov_len;
+    if(writev(fd, iov, 3) != (ssize_t)total)
+    {
+        printf("fail to send request\n");
+        exit(1);
+    }
+
+    fs_response resp;
+    if(io_full(fd, &resp, sizeof(resp), 0) < 0 || resp.data_len > FS_DATA_MAX
+       || io_full(fd, out, resp.data_len, 0) < 0)
+    {
+        printf("fail to receive response\n");
+        exit(1);
+    }
+    return resp.status;
+}
+
+
+static int call_path(int fd, uint16_t op, uint16_t flags, const char *path,
+                     uint32_t offset, const char *data, uint32_t data_len, char *out)
+{
+    return call(fd, op, flags, path, strlen(path), offset, data, data_len, out);
+}
+
+
+static void record(client *c, uint64_t ns)
+{
+    if(c->lat_num == c->lat_cap)
+    {
+        c->lat_cap = c->lat_cap ? c->lat_cap * 2 : 4096;
+        c->lat = realloc(c->lat, c->lat_cap * sizeof(uint64_t));
+    }
+    c->lat[c->lat_num++] = ns;
+}
+
+
+static void* client_main(void *arg)
+{
+    client *c = arg;
+    char *out = malloc(FS_DATA_MAX);
+    char data[FILE_BYTES];
+    char path[FS_PATH_MAX];
+    char dir[64];
+    char file[64];
+    memset(data, 'a' + c->id % 26, FILE_BYTES);
+    snprintf(dir, sizeof(dir), "/lg%d", c->id);
+    snprintf(file, sizeof(file), "/lg%d/f", c->id);
+
+    while(running)
+    {
+        int r = rand_r(&c->seed) % 100;
+        int status;
+        uint64_t start = now_ns();
+        if(r < write_percent)
+        {
+            // 一半创建新文件, 一半覆盖写已有文件
+            if(r % 2 == 0)
+            {
+                snprintf(path, sizeof(path), "%s/n%d", dir, c->created++);
+                status = call_path(c->fd, FS_OP_CREATE, FILE_TYPE, path, 0, NULL, 0, out);
+            }
+            else
+                status = call_path(c->fd, FS_OP_WRITE, 0, file, 0, data, FILE_BYTES, out);
+        }
+        else if(r < write_percent + (100 - write_percent) / 2)
+            status = call_path(c->fd, FS_OP_LOOKUP, 0, file, 0, NULL, 0, out);
+        else if(r < write_percent + (100 - write_percent) * 3 / 4)
+            status = call_path(c->fd, FS_OP_READDIR, 0, dir, 0, NULL, 0, out);
+        else
+            status = call_path(c->fd, FS_OP_READ, 0, file, 0, NULL, FILE_BYTES, out);
+        record(c, now_ns() - start);
+        if(status < 0)
+            c->errors++;
+    }
+    free(out);
+    return NULL;
+}
+
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+
+static double percentile_us(uint64_t *lat, size_t num, double p)
+{
+    if(num == 0)
+        return 0;
+    size_t i = (size_t)(p * (num - 1));
+    return lat[i] / 1000.0;
+}
+
+
+/**
+ * @brief 为每个客户端创建/lg<id>目录和/lg<id>/f文件
+ */
+static void setup(int clients)
+{
+    int fd = connect_server();
+    char *out = malloc(FS_DATA_MAX);
+    char data[FILE_BYTES];
+    char path[64];
+    memset(data, 'x', FILE_BYTES);
+    for(int i=0; i<clients; i++)
+    {
+        snprintf(path, sizeof(path), "/lg%d", i);
+        call_path(fd, FS_OP_CREATE, FOLDER_TYPE, path, 0, NULL, 0, out);
+        snprintf(path, sizeof(path), "/lg%d/f", i);
+        call_path(fd, FS_OP_CREATE, FILE_TYPE, path, 0, NULL, 0, out);
+        call_path(fd, FS_OP_WRITE, 0, path, 0, data, FILE_BYTES, out);
+    }
+    free(out);
+    close(fd);
+}
+
+
+static void run_round(int clients)
+{
+    client *cs = calloc(clients, sizeof(client));
+    for(int i=0; i<clients; i++)
+    {
+        cs[i].id = i;
+        cs[i].seed = i * 7919 + 1;
+        cs[i].fd = connect_server();
+    }
+
+    running = 1;
+    uint64_t start = now_ns();
+    for(int i=0; i<clients; i++)
+        pthread_create(&cs[i].thread, NULL, client_main, &cs[i]);
+    sleep(seconds);
+    running = 0;
+    for(int i=0; i<clients; i++)
+        pthread_join(cs[i].thread, NULL);
+    double elapsed = (now_ns() - start) / 1e9;
+
+    // 合并所有客户端的延迟后计算分位数
+    size_t total = 0;
+    uint64_t errors = 0;
+    for(int i=0; i<clients; i++)
+    {
+        total += cs[i].lat_num;
+        errors += cs[i].errors;
+    }
+    uint64_t *lat = malloc(sizeof(uint64_t) * (total ? total : 1));
+    size_t pos = 0;
+    for(int i=0; i<clients; i++)
+    {
+        memcpy(lat + pos, cs[i].lat, cs[i].lat_num * sizeof(uint64_t));
+        pos += cs[i].lat_num;
+        free(cs[i].lat);
+        close(cs[i].fd);
+    }
+    qsort(lat, total, sizeof(uint64_t), cmp_u64);
+
+    printf("%7d %12.0f %10.1f %10.1f %10.1f %10.1f %8llu\n", clients, total / elapsed,
+           percentile_us(lat, total, 0.50), percentile_us(lat, total, 0.90),
+           percentile_us(lat, total, 0.99), percentile_us(lat, total, 0.999),
+           (unsigned long long)errors);
+    fflush(stdout);
+    free(lat);
+    free(cs);
+}
+
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    while((opt = getopt(argc, argv, "c:t:w:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'c': max_clients = atoi(optarg); break;
+            case 't': seconds = atoi(optarg); break;
+            case 'w': write_percent = atoi(optarg); break;
+            default:
+                printf("usage: %s [-c max_clients] [-t seconds] [-w write_percent] [socket]\n", argv[0]);
+                return 1;
+        }
+    }
+    if(optind < argc)
+        sock_path = argv[optind];
+    if(max_clients <= 0 || seconds <= 0 || write_percent < 0 || write_percent > 100)
+    {
+        printf("invalid arguments\n");
+        return 1;
+    }
+
+    setup(max_clients);
+    printf("%7s %12s %10s %10s %10s %10s %8s\n",
+           "clients", "ops/sec", "p50(us)", "p90(us)", "p99(us)", "p99.9(us)", "errors");
+    for(int clients = 1; ; clients *= 2)
+    {
+        if(clients > max_clients)
+            clients = max_clients;
+        run_round(clients);
+        if(clients == max_clients)
+            break;
+    }
+    return 0;
+}
@@ -0,0 +1,114 @@
+// 按指定的几何参数格式化磁盘镜像
+// 块大小, 每组inode数等几何参数都写在超级块中, 挂载时从超级块读取
+//
+// 用法: mkfs [-s size] [-b block_size] [-i inode_ratio] [-j journal_size] [image]
+// -s: 镜像大小, 指定时创建或截断镜像文件到这个大小, 否则使用镜像文件现有的大小
+// -b: 块大小, 1K到64K之间的2的幂, 默认1K
+// -i: 每多少字节的空间分配一个inode, 默认4K; 小文件多时调小, 大文件多时调大
+// -j: 日志区大小, 默认没有日志区; 日志区只能放在第一个块组中
+// 大小都可以带K/M/G后缀, image默认为当前目录下的disk
+
+#include "disk.h"
+#include "filesys.h"
+
+#include <fcntl.h>
+
+
+/**
+ * @brief 解析带K/M/G后缀的大小
+ * @return 成功返回0, 格式错误返回-1
+ */
+static int parse_size(const char *arg, uint64_t *size)
+{
+    char *end;
+    unsigned long long value = strtoull(arg, &end, 10);
+    if(end == arg)
+        return -1;
+    switch(*end)
+    {
+        case 'g': case 'G': value <<= 10; // fall through
+        case 'm': case 'M': value <<= 10; // fall through
+        case 'k': case 'K': value <<= 10; end++; break;
+        case '\0': break;
+        default: return -1;
+    }
+    if(*end != '\0')
+        return -1;
+    *size = value;
+    return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+    uint64_t image_size = 0;
+    uint64_t block_size = DEFAULT_BLOCK_SIZE;
+    uint64_t inode_ratio = DEFAULT_INODE_RATIO;
+    uint64_t journal_size = 0;
+    int opt;
+    int bad = 0;
+    while((opt = getopt(argc, argv, "s:b:i:j:")) != -1)
+    {
+        switch(opt)
+        {
+            case 's': bad |= parse_size(optarg, &image_size); break;
+            case 'b': bad |= parse_size(optarg, &block_size); break;
+            case 'i': bad |= parse_size(optarg, &inode_ratio); break;
+            case 'j': bad |= parse_size(optarg, &journal_size); break;
+            default: bad = 1; break;
+        }
+    }
+    if(bad || optind + 1 < argc)
+    {
+        printf("usage: %s [-s size] [-b block_size] [-i inode_ratio] [-j journal_size] [image]\n", argv[0]);
+        return 1;
+    }
+    if(block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE || (block_size & (block_size-1)) != 0)
+    {
+        printf("block size must be a power of two between %d and %d\n", MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+        return 1;
+    }
+    if(inode_ratio < MIN_BLOCK_SIZE || inode_ratio > UINT32_MAX)
+    {
+        printf("inode ratio must be at least %d\n", MIN_BLOCK_SIZE);
+        return 1;
+    }
+    const char *image = optind < argc ? argv[optind] : "disk";
+
+    if(image_size > 0)
+    {
+        int fd = open(image, O_RDWR | O_CREAT, 0644);
+        if(fd < 0 || ftruncate(fd, image_size) != 0)
+        {
+            printf("fail to create %s\n", image);
+            return 1;
+        }
+        close(fd);
+    }
+    disk *d = open_disk_path(image);
+    if(d == NULL)
+    {
+        printf("fail to open %s\n", image);
+        return 1;
+    }
+
+    uint64_t journal_blocks = (journal_size + block_size - 1) / block_size;
+    if(filesys_format(d, block_size, inode_ratio, journal_blocks) != 0)
+    {
+        close_disk(d);
+        return 1;
+    }
+
+    // 从刚写入的超级块读出实际的几何参数
+    char buf[SUPER_BLOCK_SIZE];
+    sp_block sb;
+    disk_read_blocks(d, SUPER_BLOCK_INDEX, SUPER_BLOCK_SIZE/DEVICE_BLOCK_SIZE, buf);
+    memcpy(&sb, buf, sizeof(sp_block));
+    close_disk(d);
+
+    printf("%s: block size %u, %llu blocks in %u groups, %u inodes (%u per group), journal %u blocks\n",
+           image, sb.block_size, (unsigned long long)sb.block_count, sb.group_count,
+           sb.inode_count, sb.inodes_per_group, sb.journal_blocks);
+    printf("%lld free blocks, %lld free inodes\n", (long long)sb.free_block_count, (long long)sb.free_inode_count);
+    return 0;
+}